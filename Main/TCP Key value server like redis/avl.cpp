@@ -121,7 +121,7 @@ AVLNode *avl_offset(AVLNode *node,int64_t offset){
     while(offset != pos){
         if(pos<offset && pos+avl_cnt(node->right) >=offset){
             //this means that the target is inside the right subtree
-            node=node->left;
+            node=node->right;
             pos+= avl_cnt(node->left)+1;
         }else if(pos>offset && pos-avl_cnt(node->left)<=offset){
             //this means the target node is inside the left subree
@@ -132,8 +132,9 @@ AVLNode *avl_offset(AVLNode *node,int64_t offset){
             AVLNode *parent = node->parent;
             if(!parent) return NULL;
 
-            if(node->right == node) pos-= avl_cnt(node->left)+1;
+            if(parent->right == node) pos-= avl_cnt(node->left)+1;
             else pos+=avl_cnt(node->right)+1;
+            node = parent;
         }
     }
     return node;
@@ -141,3 +142,27 @@ AVLNode *avl_offset(AVLNode *node,int64_t offset){
 
 
 
+//the rank of the node which is the number of nodes before it in the traversal
+int64_t avl_rank(AVLNode *node){
+    int64_t rank = avl_cnt(node->left);
+    for(;node->parent;node = node->parent){
+        if(node->parent->right == node) rank += avl_cnt(node->parent->left)+1;
+    }
+    return rank;
+}
+
+static AVLNode *avl_build(AVLNode **nodes,size_t n,AVLNode *parent){
+    if(!n) return NULL;
+    //the middle one is the root so the two halves differ in height by one at most
+    size_t mid = n/2;
+    AVLNode *node = nodes[mid];
+    node->parent = parent;
+    node->left = avl_build(nodes,mid,node);
+    node->right = avl_build(nodes+mid+1,n-mid-1,node);
+    avl_update(node);
+    return node;
+}
+
+AVLNode *avl_build(AVLNode **nodes,size_t n){
+    return avl_build(nodes,n,NULL);
+}
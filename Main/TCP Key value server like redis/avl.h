@@ -23,4 +23,7 @@ inline uint32_t avl_cnt(AVLNode *node) {return node? node->cnt : 0;}
 //API 
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
-AVLNode *avl_offset(AVLNode *node,int64_t offset);
\ No newline at end of file
+AVLNode *avl_offset(AVLNode *node,int64_t offset);
+int64_t  avl_rank(AVLNode *node);
+//a balanced tree of the nodes, which are in order, returns the root
+AVLNode *avl_build(AVLNode **nodes,size_t n);
\ No newline at end of file
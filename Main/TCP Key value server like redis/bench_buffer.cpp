@@ -0,0 +1,99 @@
+// deep pipeline microbenchmark of the connection buffer
+//   g++ -std=gnu++17 -O2 -o bench_buffer bench_buffer.cpp buffer.cpp
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "buffer.h"
+
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+//the old buffer, erase() moves the remaining data on every consume
+using VecBuffer = std::vector<uint8_t>;
+
+static void vec_append(VecBuffer &buf,const uint8_t *data,size_t len){
+    buf.insert(buf.end(),data,data+len);
+}
+static void vec_consume(VecBuffer &buf,size_t len){
+    buf.erase(buf.begin(),buf.begin()+len);
+}
+
+//a pipelined batch of small requests like "get key:N"
+static void make_batch(std::vector<uint8_t> &out,size_t depth){
+    out.clear();
+    for(size_t i=0;i<depth;++i){
+        char key[32];
+        int klen = snprintf(key,sizeof(key),"key:%zu",i);
+        uint32_t nstr = 2,len_get = 3,len_key = (uint32_t)klen;
+        uint32_t len = 4 + 4 + len_get + 4 + len_key;
+        const uint8_t *parts[] = {(uint8_t *)&len,(uint8_t *)&nstr,(uint8_t *)&len_get,(uint8_t *)"get",(uint8_t *)&len_key,(uint8_t *)key};
+        size_t sizes[] = {4,4,4,3,4,(size_t)klen};
+        for(size_t j=0;j<6;++j) out.insert(out.end(),parts[j],parts[j]+sizes[j]);
+    }
+}
+
+//the socket delivers the batch in 64KB reads, the requests are consumed one by one like try_one_request()
+const size_t k_read_size = 64*1024;
+
+static uint64_t run_vec(const std::vector<uint8_t> &batch,size_t &nreq){
+    VecBuffer in;
+    uint64_t start = get_monotonic_nsec();
+    for(size_t off=0;off<batch.size();off+=k_read_size){
+        size_t n = batch.size()-off < k_read_size ? batch.size()-off : k_read_size;
+        vec_append(in,batch.data()+off,n);
+        while(in.size()>=4){
+            uint32_t len = 0;
+            memcpy(&len,in.data(),4);
+            if(4+len > in.size()) break;
+            vec_consume(in,4+len);
+            nreq++;
+        }
+    }
+    return get_monotonic_nsec()-start;
+}
+
+static uint64_t run_buf(const std::vector<uint8_t> &batch,size_t &nreq){
+    Buffer in;
+    uint64_t start = get_monotonic_nsec();
+    for(size_t off=0;off<batch.size();off+=k_read_size){
+        size_t n = batch.size()-off < k_read_size ? batch.size()-off : k_read_size;
+        buf_append(in,batch.data()+off,n);
+        while(buf_size(in)>=4){
+            uint32_t len = 0;
+            memcpy(&len,buf_data(in),4);
+            if(4+len > buf_size(in)) break;
+            buf_consume(in,4+len);
+            nreq++;
+        }
+    }
+    return get_monotonic_nsec()-start;
+}
+
+int main(){
+    const size_t depths[] = {100,1000,10*1000,100*1000};
+    printf("%10s %16s %16s %10s\n","depth","vector req/s","Buffer req/s","speedup");
+    std::vector<uint8_t> batch;
+    for(size_t depth : depths){
+        make_batch(batch,depth);
+        //repeat the small depths so each run is long enough to measure
+        size_t rounds = 1000*1000/depth;
+        if(rounds<1) rounds = 1;
+        uint64_t t_vec = 0,t_buf = 0;
+        size_t n_vec = 0,n_buf = 0;
+        for(size_t r=0;r<rounds;++r){
+            t_vec += run_vec(batch,n_vec);
+            t_buf += run_buf(batch,n_buf);
+        }
+        assert(n_vec == n_buf && n_vec == depth*rounds);
+        double vec_rps = n_vec*1e9/t_vec;
+        double buf_rps = n_buf*1e9/t_buf;
+        printf("%10zu %16.0f %16.0f %9.1fx\n",depth,vec_rps,buf_rps,buf_rps/vec_rps);
+    }
+    return 0;
+}
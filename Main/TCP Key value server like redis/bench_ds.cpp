@@ -0,0 +1,476 @@
+// microbenchmarks of the data structures under the server: HMap, AVL, heap, timer wheel and ZSet
+//   g++ -std=gnu++17 -O2 -o bench_ds bench_ds.cpp hashtable.cpp avl.cpp heap.cpp twheel.cpp zset.cpp slab.cpp
+//   add -DUSE_BTREE and btree.cpp for the zset cases on the B+tree backend
+//   ./bench_ds [max_size]     the sizes go from 1e3 up to max_size (1e7)
+// every case runs in a forked child so the peak RSS is its own
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "hashtable.h"
+#include "avl.h"
+#include "heap.h"
+#include "twheel.h"
+#include "zset.h"
+
+//count the allocations by wrapping the glibc allocator, operator new ends up here as well
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n,size_t size);
+extern "C" void *__libc_realloc(void *ptr,size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static uint64_t g_allocs = 0;
+
+extern "C" void *malloc(size_t size){
+    g_allocs++;
+    return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n,size_t size){
+    g_allocs++;
+    return __libc_calloc(n,size);
+}
+extern "C" void *realloc(void *ptr,size_t size){
+    g_allocs++;
+    return __libc_realloc(ptr,size);
+}
+extern "C" void free(void *ptr){
+    __libc_free(ptr);
+}
+
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+static uint64_t g_rng = 0x9E3779B97F4A7C15ull;
+static uint64_t rng_next(){
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545F4914F6CDD1Dull;
+}
+
+//the measurement of one operation over nops calls
+struct Timer{
+    uint64_t start_ns = 0;
+    uint64_t start_allocs = 0;
+};
+
+static void timer_start(Timer &t){
+    t.start_allocs = g_allocs;
+    t.start_ns = get_monotonic_nsec();
+}
+
+//max_ns is the slowest single call when the case times them one by one, 0 otherwise
+static void report(const char *name,size_t n,const Timer &t,size_t nops,uint64_t max_ns){
+    uint64_t ns = get_monotonic_nsec()-t.start_ns;
+    uint64_t allocs = g_allocs-t.start_allocs;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    char max_str[32] = "-";
+    if(max_ns) snprintf(max_str,sizeof(max_str),"%llu",(unsigned long long)max_ns);
+    printf("%-22s %10zu %10.1f %12.3f %12s %10.1f\n",name,n,(double)ns/nops,(double)allocs/nops,max_str,ru.ru_maxrss/1024.0);
+    fflush(stdout);
+}
+
+//HMap with integer keys, hashed like the server hashes its keys
+struct IntNode{
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool int_eq(HNode *lhs,HNode *rhs){
+    return container_of(lhs,IntNode,node)->key == container_of(rhs,IntNode,node)->key;
+}
+
+static uint64_t int_hash(uint64_t key){
+    return str_hash((const uint8_t *)&key,sizeof(key));
+}
+
+static void bench_hmap(size_t n){
+    std::vector<IntNode> nodes(n);
+    for(size_t i=0;i<n;++i){
+        nodes[i].key = i;
+        nodes[i].node.hcode = int_hash(i);
+    }
+    HMap map;
+
+    //first time each insert on its own, the slowest one shows the cost of starting a rehash
+    uint64_t max_ns = 0;
+    for(size_t i=0;i<n;++i){
+        uint64_t t0 = get_monotonic_nsec();
+        hm_insert(&map,&nodes[i].node);
+        uint64_t d = get_monotonic_nsec()-t0;
+        if(d > max_ns) max_ns = d;
+    }
+    hm_clear(&map);
+    //then the average without the clock calls in the loop
+    Timer t;
+    timer_start(t);
+    for(size_t i=0;i<n;++i) hm_insert(&map,&nodes[i].node);
+    report("hm_insert",n,t,n,max_ns);
+
+    //lookups in random order, the first ones still see the rehash in progress
+    const size_t nops = n < 1000*1000 ? 1000*1000 : n;
+    IntNode key;
+    size_t found = 0;
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        key.key = rng_next() % n;
+        key.node.hcode = int_hash(key.key);
+        found += hm_lookup(&map,&key.node,&int_eq) != NULL;
+    }
+    assert(found == nops);
+    report("hm_lookup hit",n,t,nops,0);
+
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        key.key = n + rng_next() % n;
+        key.node.hcode = int_hash(key.key);
+        found += hm_lookup(&map,&key.node,&int_eq) != NULL;
+    }
+    report("hm_lookup miss",n,t,nops,0);
+
+    timer_start(t);
+    for(size_t i=0;i<n;++i){
+        key.key = i;
+        key.node.hcode = nodes[i].node.hcode;
+        HNode *node = hm_delete(&map,&key.node,&int_eq);
+        assert(node);
+        (void)node;
+    }
+    report("hm_delete",n,t,n,0);
+    hm_clear(&map);
+}
+
+//hm_scan() under churn: a node which is there for the whole scan must come back and the scan must end
+// while nodes come and go between the calls, which keeps the table rehashing
+struct ScanNode{
+    HNode node;
+    uint64_t key = 0;
+    bool from_start = false;    //in the map when the scan started and not deleted since
+    bool seen = false;
+};
+
+static bool scan_eq(HNode *lhs,HNode *rhs){
+    return container_of(lhs,ScanNode,node)->key == container_of(rhs,ScanNode,node)->key;
+}
+
+static void cb_scan_seen(HNode *node,void *){
+    container_of(node,ScanNode,node)->seen = true;
+}
+
+static bool check_scan(){
+    const size_t k_start = 1000,k_max_steps = 20000;
+    bool ok = true;
+    for(uint64_t seed=1;seed<=3;++seed){
+        g_rng = 0x9E3779B97F4A7C15ull * seed;
+        HMap map;
+        std::vector<ScanNode *> live;
+        uint64_t next_key = 0;
+        for(size_t i=0;i<k_start;++i){
+            ScanNode *n = new ScanNode();
+            n->key = next_key++;
+            n->node.hcode = int_hash(n->key);
+            n->from_start = true;
+            hm_insert(&map,&n->node);
+            live.push_back(n);
+        }
+        uint64_t cursor = 0;
+        size_t steps = 0;
+        do{
+            cursor = hm_scan(&map,cursor,1 + rng_next() % 8,&cb_scan_seen,NULL);
+            for(size_t i=0;i<12;++i){
+                ScanNode *n = new ScanNode();
+                n->key = next_key++;
+                n->node.hcode = int_hash(n->key);
+                hm_insert(&map,&n->node);
+                live.push_back(n);
+            }
+            for(size_t i=0;i<8;++i){
+                size_t j = rng_next() % live.size();
+                ScanNode *n = live[j];
+                HNode *node = hm_delete(&map,&n->node,&scan_eq);
+                assert(node == &n->node);
+                (void)node;
+                live[j] = live.back();
+                live.pop_back();
+                delete n;
+            }
+            steps++;
+        }while(cursor != 0 && steps < k_max_steps);
+        size_t missed = 0;
+        for(ScanNode *n : live) missed += n->from_start && !n->seen;
+        printf("scan under churn, seed %llu: %zu steps, %zu of the first keys missed\n",(unsigned long long)seed,steps,missed);
+        if(cursor != 0 || missed) ok = false;
+        for(ScanNode *n : live) delete n;
+        hm_clear(&map);
+    }
+    printf("scan ends and sees every key under churn: %s\n\n",ok ? "yes" : "NO");
+    return ok;
+}
+
+//a zset with n members named "m<i>" and random scores
+static void zset_fill(ZSet *zset,size_t n){
+    char name[32];
+    for(size_t i=0;i<n;++i){
+        int len = snprintf(name,sizeof(name),"m%zu",i);
+        zset_insert(zset,name,(size_t)len,(double)(rng_next() % (n*10)));
+    }
+}
+
+static void bench_zset(size_t n){
+    ZSet zset;
+    Timer t;
+    timer_start(t);
+    zset_fill(&zset,n);
+    report("zset_insert new",n,t,n,0);
+
+    const size_t nops = 1000*1000;
+    char name[32];
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        int len = snprintf(name,sizeof(name),"m%zu",(size_t)(rng_next() % n));
+        zset_insert(&zset,name,(size_t)len,(double)(rng_next() % (n*10)));
+    }
+    report("zset_insert update",n,t,nops,0);
+
+    size_t found = 0;
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        found += zset_seekge(&zset,(double)(rng_next() % (n*10)),"",0) != NULL;
+    }
+    report("zset_seekge",n,t,nops,0);
+
+    //ranks of random members, the name lookup is part of it like in ZRANK
+    timer_start(t);
+    int64_t ranks = 0;
+    for(size_t i=0;i<nops;++i){
+        int len = snprintf(name,sizeof(name),"m%zu",(size_t)(rng_next() % n));
+        ZNode *node = zset_lookup(&zset,name,(size_t)len);
+        assert(node);
+        ranks += zset_rank(&zset,node);
+    }
+    report("zset_rank",n,t,nops,0);
+
+    //offsets from the first node, like ZQUERY with a large offset
+    ZNode *first = zset_seekge(&zset,-1,"",0);
+    assert(first);
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        ZNode *node = znode_offset(&zset,first,(int64_t)(rng_next() % n));
+        assert(node);
+        found += node != NULL;
+    }
+    report("znode_offset",n,t,nops,0);
+
+    //ranges of 100 members from a random score, the way ZQUERY walks them, ns/op is per range
+    const size_t nranges = 100*1000;
+    timer_start(t);
+    for(size_t i=0;i<nranges;++i){
+        ZNode *node = zset_seekge(&zset,(double)(rng_next() % (n*10)),"",0);
+        for(size_t k=0;node && k<100;++k){
+            found += node->len;
+            node = znode_offset(&zset,node,+1);
+        }
+    }
+    report("zset_range 100",n,t,nranges,0);
+
+    //reads of 100k members from a random position like a large ZQUERY, ns/op is per member
+    const size_t k_read = 100*1000;
+    if(n >= k_read){
+        const size_t nreads = 20;
+        timer_start(t);
+        for(size_t i=0;i<nreads;++i){
+            ZNode *node = zset_select(&zset,(int64_t)(rng_next() % (n-k_read+1)));
+            for(size_t k=0;node && k<k_read;++k){
+                found += node->len;
+                node = znode_offset(&zset,node,+1);
+            }
+        }
+        report("read 100k offset",n,t,nreads*k_read,0);
+
+        timer_start(t);
+        for(size_t i=0;i<nreads;++i){
+            ZIter it;
+            zset_iter(&zset,zset_select(&zset,(int64_t)(rng_next() % (n-k_read+1))),&it);
+            for(size_t k=0;it.node && k<k_read;++k){
+                found += it.node->len;
+                zset_iter_next(&it);
+            }
+        }
+        report("read 100k iter",n,t,nreads*k_read,0);
+    }
+    zset_clear(&zset);
+    (void)found;
+    (void)ranks;
+}
+
+//n new members through zset_add_new() in batches like a ZADD with that many pairs
+static void bench_zset_batch(size_t n,size_t batch,const char *label){
+    std::vector<std::string> names(n);
+    std::vector<ZAdd> items(n);
+    for(size_t i=0;i<n;++i){
+        names[i] = "m"+std::to_string(i);
+        items[i].score = (double)(rng_next() % (n*10));
+        items[i].name = names[i].data();
+        items[i].len = names[i].size();
+    }
+    ZSet zset;
+    Timer t;
+    timer_start(t);
+    for(size_t i=0;i<n;i+=batch) zset_add_new(&zset,&items[i],i+batch <= n ? batch : n-i);
+    report(label,n,t,n,0);
+    zset_clear(&zset);
+}
+
+static void bench_zset_batch_1000(size_t n){
+    bench_zset_batch(n,1000,"zset_add_new 1000");
+}
+
+static void bench_zset_batch_all(size_t n){
+    bench_zset_batch(n,n,"zset_add_new all");
+}
+
+//n members in zsets of 100 like leaderboards per user, in the small form or with it turned off
+static void bench_zset_small(size_t n,const char *enc){
+    const size_t k_members = 100;
+    std::vector<ZSet> zsets(n/k_members);
+    char name[64];
+    Timer t;
+    timer_start(t);
+    for(size_t z=0;z<zsets.size();++z){
+        for(size_t i=0;i<k_members;++i){
+            int len = snprintf(name,sizeof(name),"user:%zu",i);
+            zset_insert(&zsets[z],name,(size_t)len,(double)(rng_next() % 1000));
+        }
+    }
+    snprintf(name,sizeof(name),"zset100 insert %s",enc);
+    report(name,n,t,zsets.size()*k_members,0);
+
+    //a ZQUERY of 10 members from a random score
+    const size_t nops = 1000*1000;
+    size_t found = 0;
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        ZSet *zset = &zsets[rng_next() % zsets.size()];
+        ZNode *node = zset_seekge(zset,(double)(rng_next() % 1000),"",0);
+        for(size_t k=0;node && k<10;++k){
+            found += node->len;
+            node = znode_offset(zset,node,+1);
+        }
+    }
+    snprintf(name,sizeof(name),"zset100 query %s",enc);
+    report(name,n,t,nops,0);
+    for(ZSet &zset : zsets) zset_clear(&zset);
+    (void)found;
+}
+
+static void bench_zset_listpack(size_t n){
+    bench_zset_small(n,"lp");
+}
+
+static void bench_zset_tree(size_t n){
+    g_zset_max_listpack_entries = 0;
+    bench_zset_small(n,"tree");
+}
+
+//TTL churn, every op moves a random timer to a new deadline
+static void bench_heap(size_t n){
+    std::vector<size_t> refs(n);
+    std::vector<HeapItem> heap(n);
+    for(size_t i=0;i<n;++i){
+        heap[i].val = rng_next() % (n*10);
+        heap[i].ref = &refs[i];
+        refs[i] = i;
+    }
+    for(size_t i=n;i>0;--i) heap_update(heap.data(),i-1,n);
+
+    const size_t nops = 1000*1000;
+    Timer t;
+    timer_start(t);
+    for(size_t i=0;i<nops;++i){
+        size_t pos = rng_next() % n;
+        heap[pos].val = rng_next() % (n*10);
+        heap_update(heap.data(),pos,n);
+    }
+    report("heap_update",n,t,nops,0);
+
+    //expire them all, popping the smallest one at a time
+    timer_start(t);
+    size_t len = n;
+    while(len > 0){
+        heap[0] = heap[--len];
+        if(len > 0) heap_update(heap.data(),0,len);
+    }
+    report("heap expire",n,t,n,0);
+}
+
+//the same churn on the timer wheel, then the time runs on 10ms at a time until every timer is due
+static void bench_wheel(size_t n){
+    TWheel *tw = new TWheel();
+    tw_init(tw,0);
+    std::vector<TWNode> nodes(n);
+    for(size_t i=0;i<n;++i) tw_add(tw,&nodes[i],rng_next() % (n*10));
+
+    const size_t nops = 1000*1000;
+    Timer t;
+    timer_start(t);
+    for(size_t i=0;i<nops;++i) tw_add(tw,&nodes[rng_next() % n],rng_next() % (n*10));
+    report("tw_add",n,t,nops,0);
+
+    timer_start(t);
+    for(uint64_t now=0;tw->size > 0;now+=10){
+        tw_advance(tw,now);
+        while(TWNode *node = tw_due(tw)) tw_del(tw,node);
+    }
+    report("tw expire",n,t,n,0);
+    delete tw;
+}
+
+static void run_forked(void (*fn)(size_t),size_t n){
+    pid_t pid = fork();
+    if(pid == 0){
+        fn(n);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid,&status,0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("%zu: failed\n",n);
+}
+
+int main(int argc,char **argv){
+    size_t max_size = argc > 1 ? strtoull(argv[1],NULL,10) : 10*1000*1000;
+    if(!check_scan()) return 1;
+#ifdef USE_BTREE
+    printf("zset backend: btree\n");
+#else
+    printf("zset backend: avl\n");
+#endif
+    printf("%-22s %10s %10s %12s %12s %10s\n","case","size","ns/op","allocs/op","max ns","peak MB");
+    fflush(stdout);
+    for(size_t n=1000;n<=max_size;n*=10) run_forked(&bench_hmap,n);
+    for(size_t n=1000;n<=max_size;n*=10) run_forked(&bench_zset,n);
+    for(size_t n=1000;n<=max_size;n*=10){
+        run_forked(&bench_zset_batch_1000,n);
+        run_forked(&bench_zset_batch_all,n);
+    }
+    for(size_t n=1000;n<=max_size;n*=10){
+        run_forked(&bench_zset_listpack,n);
+        run_forked(&bench_zset_tree,n);
+    }
+    for(size_t n=1000;n<=max_size;n*=10){
+        run_forked(&bench_heap,n);
+        run_forked(&bench_wheel,n);
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+// save and load speed of the dump file format, in GB/s of the file
+//   g++ -std=gnu++17 -O2 -o bench_dump bench_dump.cpp dump.cpp threads.cpp -lpthread     (add -msse4.2 for the CRC instruction)
+//   ./bench_dump [path] [keys] [threads]
+// the save includes the fsync() and the load reads the file from the page cache, the keyspace
+// walk and the hash table inserts of the server are not part of it. The load decodes the segments
+// on one thread and then on a thread pool like the server does at startup
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "dump.h"
+#include "threads.h"
+
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+enum { KIND_STR, KIND_INT, KIND_ZSET };
+
+const size_t k_zset_members = 100;
+const size_t k_key_len = 16;
+
+//the keys and the names are made before the clock starts
+static std::string g_keys;
+static std::vector<std::string> g_names;
+
+static void write_file(const char *path,int kind,size_t nkeys,uint64_t *bytes,uint64_t *ns){
+    std::string tmp = std::string(path) + ".tmp";
+    std::string val(100,'v');
+    uint64_t start = get_monotonic_nsec();
+    DumpWriter w;
+    if(!dump_create(&w,tmp.c_str(),DumpHeader{})){
+        perror("dump_create");
+        exit(1);
+    }
+    for(size_t i=0;i<nkeys;++i){
+        std::string_view k(g_keys.data() + i*k_key_len,k_key_len);
+        uint64_t deadline = (i%4 == 0) ? 1700000000000ull + i : k_dump_no_ttl;
+        if(kind == KIND_STR){
+            dump_put_str(&w,k,val,deadline);
+        }else if(kind == KIND_INT){
+            dump_put_int(&w,k,(int64_t)(i*2654435761ull),deadline);
+        }else{
+            dump_put_zset(&w,k,k_zset_members,deadline);
+            for(size_t j=0;j<k_zset_members;++j) dump_put_member(&w,(double)j*1.5,g_names[j]);
+        }
+    }
+    if(!dump_finish(&w,tmp.c_str(),path)){
+        perror("dump_finish");
+        exit(1);
+    }
+    *ns = get_monotonic_nsec()-start;
+    *bytes = w.bytes;
+}
+
+struct SegJob{
+    const DumpFile *f = NULL;
+    size_t seg = 0;
+    bool ok = false;
+    uint64_t n = 0;
+    uint64_t sum = 0;
+    WaitGroup *wg = NULL;
+};
+
+//the checksum of the segment, then every record and member is decoded
+static void decode_seg(SegJob *job){
+    job->ok = dump_seg_ok(job->f,job->seg);
+    const DumpSeg &seg = job->f->segs[job->seg];
+    size_t pos = seg.begin;
+    DumpRec rec;
+    while(dump_next(job->f,&pos,seg.end,&rec) > 0){
+        job->n++;
+        job->sum += rec.key.size() + rec.val.size();
+        double score = 0;
+        std::string_view name;
+        while(dump_next_member(&rec,&score,&name)) job->sum += name.size();
+    }
+}
+
+static void decode_func(void *arg){
+    SegJob *job = (SegJob *)arg;
+    decode_seg(job);
+    wait_group_done(job->wg);
+}
+
+//open maps the file and checks the trailer, the segments are decoded on the pool or on this thread
+static void read_file(const char *path,size_t nkeys,ThreadPool *pool,uint64_t *ns){
+    uint64_t start = get_monotonic_nsec();
+    DumpFile f;
+    if(!dump_open(&f,path)){
+        fprintf(stderr,"dump_open failed\n");
+        exit(1);
+    }
+    std::vector<SegJob> jobs(f.segs.size());
+    WaitGroup wg;
+    wait_group_init(&wg,jobs.size());
+    for(size_t i=0;i<jobs.size();++i){
+        jobs[i].f = &f;
+        jobs[i].seg = i;
+        jobs[i].wg = &wg;
+        if(pool) thread_pool_queue(pool,&decode_func,&jobs[i]);
+        else decode_func(&jobs[i]);
+    }
+    wait_group_wait(&wg);
+    *ns = get_monotonic_nsec()-start;
+    uint64_t n = 0,sum = 0;
+    for(SegJob &job : jobs){
+        assert(job.ok);
+        n += job.n;
+        sum += job.sum;
+    }
+    assert(n == nkeys && f.nkeys == nkeys);
+    if(sum == 0) printf("empty\n");
+    dump_close(&f);
+}
+
+int main(int argc,char **argv){
+    const char *path = argc > 1 ? argv[1] : "/tmp/bench_dump.kdb";
+    size_t nkeys = argc > 2 ? (size_t)atoll(argv[2]) : 4*1000*1000;
+    size_t nthreads = argc > 3 ? (size_t)atoll(argv[3]) : 4;
+    ThreadPool pool;
+    thread_pool_init(&pool,nthreads);
+
+    g_keys.resize(nkeys*k_key_len);
+    for(size_t i=0;i<nkeys;++i){
+        char key[32];
+        snprintf(key,sizeof(key),"key:%012zu",i);
+        memcpy(&g_keys[i*k_key_len],key,k_key_len);
+    }
+    for(size_t j=0;j<k_zset_members;++j) g_names.push_back("member:" + std::to_string(j));
+
+    //the checksum alone
+    std::vector<uint8_t> block(64 << 20,0x5A);
+    uint64_t start = get_monotonic_nsec();
+    uint32_t crc = dump_crc(0,block.data(),block.size());
+    uint64_t crc_ns = get_monotonic_nsec()-start;
+    printf("crc32c %.2f GB/s (%08x)\n\n",block.size()/(double)crc_ns,crc);
+
+    printf("%-6s %10s %10s %8s %12s %12s %12s\n","kind","keys","MB","segs","save GB/s","load GB/s","pool GB/s");
+    const char *names[] = {"str","int","zset"};
+    for(int kind=KIND_STR;kind<=KIND_ZSET;++kind){
+        size_t n = kind == KIND_ZSET ? nkeys/k_zset_members : nkeys;
+        uint64_t bytes = 0,save_ns = 0,load_ns = 0,pool_ns = 0;
+        write_file(path,kind,n,&bytes,&save_ns);
+        read_file(path,n,NULL,&load_ns);
+        read_file(path,n,&pool,&pool_ns);
+        printf("%-6s %10zu %10.1f %8zu %12.2f %12.2f %12.2f\n",names[kind],n,bytes/1e6,
+            (size_t)((bytes+k_dump_segment-1)/k_dump_segment),bytes/(double)save_ns,bytes/(double)load_ns,bytes/(double)pool_ns);
+    }
+    unlink(path);
+    return 0;
+}
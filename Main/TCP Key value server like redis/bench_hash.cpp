@@ -0,0 +1,92 @@
+// throughput of the key hash for short and long keys, against the old 32 bit FNV loop
+//   g++ -std=gnu++17 -O2 -o bench_hash bench_hash.cpp
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "hash.h"
+
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+//the str_hash of the baseline
+static uint64_t fnv_hash(const uint8_t *data,size_t len){
+    uint32_t h = 0x811C9DC5;
+    for(size_t i=0;i<len;i++){
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static uint64_t key_hash(const uint8_t *data,size_t len){
+    return hash_bytes(data,len);
+}
+
+//the two paths on their own, to see where the stripes start to win
+static uint64_t mum_path(const uint8_t *data,size_t len){
+    return hash_mum(data,len,g_hash_key);
+}
+static uint64_t stripe_path(const uint8_t *data,size_t len){
+    return hash_stripes(data,len,g_hash_key);
+}
+
+//ns per hash, the keys are hashed at shifting offsets so the loads are not all aligned
+static double run(uint64_t (*fn)(const uint8_t *,size_t),const std::vector<uint8_t> &buf,size_t len,uint64_t &sink){
+    size_t n = (size_t)(200*1000*1000 / (len+16));
+    if(n < 1000) n = 1000;
+    uint64_t start = get_monotonic_nsec();
+    for(size_t i=0;i<n;++i){
+        //the previous hash feeds the next offset, so the calls can not overlap
+        sink += fn(buf.data() + ((sink + i) & 63),len);
+    }
+    return (double)(get_monotonic_nsec()-start)/n;
+}
+
+//the keys which zeroed a multiply when it was keyed with a public constant: the 16 byte key whose two
+// reads are k_hash_p1, and a 40 byte key whose first block starts with it. They must hash apart per seed
+static bool check_seeded(){
+    uint8_t k16[16] = {},k40[40] = {};
+    uint32_t hi = (uint32_t)(k_hash_p1 >> 32),lo = (uint32_t)k_hash_p1;
+    memcpy(k16,&hi,4);
+    memcpy(k16+8,&lo,4);
+    memcpy(k40,&k_hash_p1,8);
+    bool ok = true;
+    for(uint64_t seed=1;seed<8;++seed){
+        HashKey a = hash_key_make(seed),b = hash_key_make(seed+100);
+        for(size_t fill=0;fill<256;fill+=51){
+            memset(k16+4,(int)fill,4);
+            memset(k16+12,(int)fill,4);
+            memset(k40+8,(int)fill,32);
+            if(hash_mum(k16,16,a) == hash_mum(k16,16,b)) ok = false;
+            if(hash_mum(k40,40,a) == hash_mum(k40,40,b)) ok = false;
+        }
+    }
+    printf("crafted keys hash apart under other seeds: %s\n\n",ok ? "yes" : "NO");
+    return ok;
+}
+
+int main(){
+    if(!check_seeded()) return 1;
+    hash_init();
+    std::vector<uint8_t> buf(1<<20);
+    for(size_t i=0;i<buf.size();++i) buf[i] = (uint8_t)(i*131 + 7);
+    const size_t lens[] = {4,8,16,24,32,64,128,256,512,1024,4096,65536,512*1024};
+    uint64_t sink = 0;
+
+    printf("%8s %12s %12s %10s %12s %12s\n","key len","fnv ns","hash ns","hash GB/s","mum ns","stripes ns");
+    for(size_t len : lens){
+        double fnv = run(&fnv_hash,buf,len,sink);
+        double h = run(&key_hash,buf,len,sink);
+        printf("%8zu %12.1f %12.1f %10.2f",len,fnv,h,len/h);
+        //the two long key paths side by side, the stripe path needs at least one stripe
+        if(len >= k_hash_stripe){
+            printf(" %12.1f %12.1f\n",run(&mum_path,buf,len,sink),run(&stripe_path,buf,len,sink));
+        }else{
+            printf(" %12s %12s\n","-","-");
+        }
+    }
+    return sink == 42;  //keep the results alive
+}
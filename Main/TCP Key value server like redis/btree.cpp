@@ -0,0 +1,505 @@
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include "btree.h"
+#include "zset.h"
+#include "slab.h"
+
+const uint32_t k_leaf_cap = 30;
+const uint32_t k_inner_cap = 36;
+//every node but the root keeps at least half of its slots in use
+const uint32_t k_leaf_min = k_leaf_cap/2;
+const uint32_t k_inner_min = k_inner_cap/2;
+
+struct BLeaf{
+    double scores[k_leaf_cap];      //searched without touching the members until two scores tie
+    ZNode *members[k_leaf_cap];
+    BLeaf *prev;
+    BLeaf *next;
+    uint32_t n;
+};
+
+struct BInner{
+    double scores[k_inner_cap];     //the smallest member of every child
+    ZNode *mins[k_inner_cap];
+    void *kids[k_inner_cap];
+    uint32_t cnts[k_inner_cap];     //the members under every child
+    uint32_t n;
+};
+
+static_assert(sizeof(BLeaf) <= 512,"a leaf is one 512 byte slab block");
+static_assert(sizeof(BInner) <= 1024,"an inner node is one 1KB slab block");
+
+static BLeaf *leaf_new(){
+    BLeaf *leaf = (BLeaf *)slab_alloc(sizeof(BLeaf));
+    leaf->prev = leaf->next = NULL;
+    leaf->n = 0;
+    return leaf;
+}
+
+static BInner *inner_new(){
+    BInner *node = (BInner *)slab_alloc(sizeof(BInner));
+    node->n = 0;
+    return node;
+}
+
+//compare a member with the (score,name) key, <0 when the member goes first
+static int zcmp(double lscore,const ZNode *lhs,double score,const char *name,size_t len){
+    if(lscore != score) return lscore < score ? -1 : 1;
+    int rv = memcmp(lhs->name,name,lhs->len < len ? lhs->len : len);
+    if(rv != 0) return rv;
+    return lhs->len < len ? -1 : (lhs->len > len ? 1 : 0);
+}
+
+//the first position >= key
+static uint32_t leaf_lower(BLeaf *leaf,double score,const char *name,size_t len){
+    uint32_t lo = 0,hi = leaf->n;
+    while(lo<hi){
+        uint32_t mid = (lo+hi)/2;
+        if(zcmp(leaf->scores[mid],leaf->members[mid],score,name,len) < 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//the last child whose smallest member is <= key, the first one when the key is smaller than all of them
+static uint32_t inner_child(BInner *node,double score,const char *name,size_t len){
+    uint32_t lo = 1,hi = node->n;
+    while(lo<hi){
+        uint32_t mid = (lo+hi)/2;
+        if(zcmp(node->scores[mid],node->mins[mid],score,name,len) <= 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo-1;
+}
+
+//the nodes of a level are either all leaves (level 1) or all inner nodes
+static uint32_t node_n(void *ptr,uint32_t level){
+    return level == 1 ? ((BLeaf *)ptr)->n : ((BInner *)ptr)->n;
+}
+
+static uint32_t node_count(void *ptr,uint32_t level){
+    if(level == 1) return ((BLeaf *)ptr)->n;
+    BInner *node = (BInner *)ptr;
+    uint32_t cnt = 0;
+    for(uint32_t i=0;i<node->n;++i) cnt += node->cnts[i];
+    return cnt;
+}
+
+//copy the smallest member of the child i into its parent, level is the one of the child
+static void set_key(BInner *node,uint32_t i,uint32_t level){
+    if(level == 1){
+        BLeaf *kid = (BLeaf *)node->kids[i];
+        node->scores[i] = kid->scores[0];
+        node->mins[i] = kid->members[0];
+    }else{
+        BInner *kid = (BInner *)node->kids[i];
+        node->scores[i] = kid->scores[0];
+        node->mins[i] = kid->mins[0];
+    }
+}
+
+static void leaf_put(BLeaf *leaf,uint32_t pos,ZNode *znode){
+    uint32_t tail = leaf->n-pos;
+    memmove(&leaf->scores[pos+1],&leaf->scores[pos],tail*sizeof(double));
+    memmove(&leaf->members[pos+1],&leaf->members[pos],tail*sizeof(ZNode *));
+    leaf->scores[pos] = znode->score;
+    leaf->members[pos] = znode;
+    leaf->n++;
+}
+
+static void leaf_remove(BLeaf *leaf,uint32_t pos){
+    uint32_t tail = leaf->n-pos-1;
+    memmove(&leaf->scores[pos],&leaf->scores[pos+1],tail*sizeof(double));
+    memmove(&leaf->members[pos],&leaf->members[pos+1],tail*sizeof(ZNode *));
+    leaf->n--;
+}
+
+static void inner_put(BInner *node,uint32_t pos,void *kid,uint32_t cnt,uint32_t level){
+    uint32_t tail = node->n-pos;
+    memmove(&node->scores[pos+1],&node->scores[pos],tail*sizeof(double));
+    memmove(&node->mins[pos+1],&node->mins[pos],tail*sizeof(ZNode *));
+    memmove(&node->kids[pos+1],&node->kids[pos],tail*sizeof(void *));
+    memmove(&node->cnts[pos+1],&node->cnts[pos],tail*sizeof(uint32_t));
+    node->kids[pos] = kid;
+    node->cnts[pos] = cnt;
+    set_key(node,pos,level);
+    node->n++;
+}
+
+static void inner_remove(BInner *node,uint32_t pos){
+    uint32_t tail = node->n-pos-1;
+    memmove(&node->scores[pos],&node->scores[pos+1],tail*sizeof(double));
+    memmove(&node->mins[pos],&node->mins[pos+1],tail*sizeof(ZNode *));
+    memmove(&node->kids[pos],&node->kids[pos+1],tail*sizeof(void *));
+    memmove(&node->cnts[pos],&node->cnts[pos+1],tail*sizeof(uint32_t));
+    node->n--;
+}
+
+//move the entries from pos on to the empty node dst
+static void leaf_split(BLeaf *leaf,BLeaf *dst,uint32_t pos){
+    dst->n = leaf->n-pos;
+    memcpy(dst->scores,&leaf->scores[pos],dst->n*sizeof(double));
+    memcpy(dst->members,&leaf->members[pos],dst->n*sizeof(ZNode *));
+    leaf->n = pos;
+}
+
+static void inner_split(BInner *node,BInner *dst,uint32_t pos){
+    dst->n = node->n-pos;
+    memcpy(dst->scores,&node->scores[pos],dst->n*sizeof(double));
+    memcpy(dst->mins,&node->mins[pos],dst->n*sizeof(ZNode *));
+    memcpy(dst->kids,&node->kids[pos],dst->n*sizeof(void *));
+    memcpy(dst->cnts,&node->cnts[pos],dst->n*sizeof(uint32_t));
+    node->n = pos;
+}
+
+//insert into the subtree, returns the new right half when the node had to be split
+static void *node_insert(void *ptr,uint32_t level,ZNode *znode){
+    if(level == 1){
+        BLeaf *leaf = (BLeaf *)ptr;
+        uint32_t pos = leaf_lower(leaf,znode->score,znode->name,znode->len);
+        BLeaf *right = NULL;
+        if(leaf->n == k_leaf_cap){
+            right = leaf_new();
+            leaf_split(leaf,right,k_leaf_cap/2);
+            right->next = leaf->next;
+            if(right->next) right->next->prev = right;
+            right->prev = leaf;
+            leaf->next = right;
+            if(pos > leaf->n){
+                pos -= leaf->n;
+                leaf = right;
+            }
+        }
+        leaf_put(leaf,pos,znode);
+        return right;
+    }
+
+    BInner *node = (BInner *)ptr;
+    uint32_t i = inner_child(node,znode->score,znode->name,znode->len);
+    void *split = node_insert(node->kids[i],level-1,znode);
+    node->cnts[i]++;
+    set_key(node,i,level-1);
+    if(!split) return NULL;
+
+    uint32_t cnt = node_count(split,level-1);
+    node->cnts[i] -= cnt;
+    uint32_t pos = i+1;
+    BInner *right = NULL;
+    if(node->n == k_inner_cap){
+        right = inner_new();
+        inner_split(node,right,k_inner_cap/2);
+        if(pos > node->n){
+            pos -= node->n;
+            node = right;
+        }
+    }
+    inner_put(node,pos,split,cnt,level-1);
+    return right;
+}
+
+//remember the member at pos of the leaf and return it
+static ZNode *bt_found(BTree *tree,BLeaf *leaf,uint32_t pos,int64_t base){
+    tree->last_leaf = leaf;
+    tree->last_pos = pos;
+    tree->last_base = base;
+    return leaf->members[pos];
+}
+
+void bt_insert(BTree *tree,ZNode *znode){
+    tree->last_leaf = NULL;
+    if(!tree->root){
+        tree->root = leaf_new();
+        tree->height = 1;
+    }
+    void *split = node_insert(tree->root,tree->height,znode);
+    tree->size++;
+    if(split){
+        //grow a new root over the two halves
+        BInner *root = inner_new();
+        uint32_t cnt = node_count(split,tree->height);
+        inner_put(root,0,tree->root,(uint32_t)(tree->size-cnt),tree->height);
+        inner_put(root,1,split,cnt,tree->height);
+        tree->root = root;
+        tree->height++;
+    }
+}
+
+//append rhs to lhs and free it
+static void node_merge(void *lhs,void *rhs,uint32_t level){
+    if(level == 1){
+        BLeaf *l = (BLeaf *)lhs,*r = (BLeaf *)rhs;
+        memcpy(&l->scores[l->n],r->scores,r->n*sizeof(double));
+        memcpy(&l->members[l->n],r->members,r->n*sizeof(ZNode *));
+        l->n += r->n;
+        l->next = r->next;
+        if(l->next) l->next->prev = l;
+        slab_free(r);
+    }else{
+        BInner *l = (BInner *)lhs,*r = (BInner *)rhs;
+        memcpy(&l->scores[l->n],r->scores,r->n*sizeof(double));
+        memcpy(&l->mins[l->n],r->mins,r->n*sizeof(ZNode *));
+        memcpy(&l->kids[l->n],r->kids,r->n*sizeof(void *));
+        memcpy(&l->cnts[l->n],r->cnts,r->n*sizeof(uint32_t));
+        l->n += r->n;
+        slab_free(r);
+    }
+}
+
+//move one entry between two neighbours, returns the number of members moved
+static uint32_t node_borrow(void *lhs,void *rhs,uint32_t level,bool to_left){
+    if(level == 1){
+        BLeaf *l = (BLeaf *)lhs,*r = (BLeaf *)rhs;
+        if(to_left){
+            leaf_put(l,l->n,r->members[0]);
+            leaf_remove(r,0);
+        }else{
+            leaf_put(r,0,l->members[l->n-1]);
+            l->n--;
+        }
+        return 1;
+    }
+    BInner *l = (BInner *)lhs,*r = (BInner *)rhs;
+    uint32_t cnt = 0;
+    if(to_left){
+        cnt = r->cnts[0];
+        inner_put(l,l->n,r->kids[0],cnt,level-1);
+        inner_remove(r,0);
+    }else{
+        cnt = l->cnts[l->n-1];
+        inner_put(r,0,l->kids[l->n-1],cnt,level-1);
+        l->n--;
+    }
+    return cnt;
+}
+
+//the child i fell under the minimum, merge it with a neighbour when both fit into one node
+//and take one entry from the neighbour otherwise
+static void inner_fix(BInner *node,uint32_t i,uint32_t level){
+    uint32_t l = i>0 ? i-1 : i;
+    uint32_t r = l+1;
+    void *lhs = node->kids[l],*rhs = node->kids[r];
+    uint32_t cap = level == 1 ? k_leaf_cap : k_inner_cap;
+    if(node_n(lhs,level)+node_n(rhs,level) <= cap){
+        node_merge(lhs,rhs,level);
+        node->cnts[l] += node->cnts[r];
+        inner_remove(node,r);
+        set_key(node,l,level);
+        return;
+    }
+    uint32_t cnt = node_borrow(lhs,rhs,level,i == l);
+    if(i == l){
+        node->cnts[l] += cnt;
+        node->cnts[r] -= cnt;
+    }else{
+        node->cnts[l] -= cnt;
+        node->cnts[r] += cnt;
+    }
+    set_key(node,l,level);
+    set_key(node,r,level);
+}
+
+static void node_delete(void *ptr,uint32_t level,ZNode *znode){
+    if(level == 1){
+        BLeaf *leaf = (BLeaf *)ptr;
+        uint32_t pos = leaf_lower(leaf,znode->score,znode->name,znode->len);
+        assert(pos < leaf->n && leaf->members[pos] == znode);
+        leaf_remove(leaf,pos);
+        return;
+    }
+    BInner *node = (BInner *)ptr;
+    uint32_t i = inner_child(node,znode->score,znode->name,znode->len);
+    node_delete(node->kids[i],level-1,znode);
+    node->cnts[i]--;
+    uint32_t min = level-1 == 1 ? k_leaf_min : k_inner_min;
+    if(node_n(node->kids[i],level-1) < min) inner_fix(node,i,level-1);
+    else set_key(node,i,level-1);
+}
+
+void bt_delete(BTree *tree,ZNode *znode){
+    assert(tree->root);
+    tree->last_leaf = NULL;
+    node_delete(tree->root,tree->height,znode);
+    tree->size--;
+    //the root is the only node which may get down to one child or no members
+    if(tree->height == 1){
+        if(((BLeaf *)tree->root)->n == 0){
+            slab_free(tree->root);
+            tree->root = NULL;
+            tree->height = 0;
+        }
+    }else if(((BInner *)tree->root)->n == 1){
+        BInner *old = (BInner *)tree->root;
+        tree->root = old->kids[0];
+        tree->height--;
+        slab_free(old);
+    }
+}
+
+ZNode *bt_seekge(BTree *tree,double score,const char *name,size_t len){
+    if(!tree->root) return NULL;
+    int64_t base = 0;
+    void *ptr = tree->root;
+    for(uint32_t level = tree->height;level>1;--level){
+        BInner *node = (BInner *)ptr;
+        uint32_t i = inner_child(node,score,name,len);
+        for(uint32_t j=0;j<i;++j) base += node->cnts[j];
+        ptr = node->kids[i];
+    }
+    BLeaf *leaf = (BLeaf *)ptr;
+    uint32_t pos = leaf_lower(leaf,score,name,len);
+    if(pos < leaf->n) return bt_found(tree,leaf,pos,base);
+    //everything in the later leaves is greater than the key
+    return leaf->next ? bt_found(tree,leaf->next,0,base+leaf->n) : NULL;
+}
+
+//the leaf of the member and its position in it, base is the rank of the first member of the leaf
+static BLeaf *bt_locate(BTree *tree,ZNode *znode,uint32_t &pos,int64_t &base){
+    assert(tree->root);
+    BLeaf *last = (BLeaf *)tree->last_leaf;
+    if(last && tree->last_pos < last->n && last->members[tree->last_pos] == znode){
+        pos = tree->last_pos;
+        base = tree->last_base;
+        return last;
+    }
+    base = 0;
+    void *ptr = tree->root;
+    for(uint32_t level = tree->height;level>1;--level){
+        BInner *node = (BInner *)ptr;
+        uint32_t i = inner_child(node,znode->score,znode->name,znode->len);
+        for(uint32_t j=0;j<i;++j) base += node->cnts[j];
+        ptr = node->kids[i];
+    }
+    BLeaf *leaf = (BLeaf *)ptr;
+    pos = leaf_lower(leaf,znode->score,znode->name,znode->len);
+    assert(pos < leaf->n && leaf->members[pos] == znode);
+    return leaf;
+}
+
+int64_t bt_rank(BTree *tree,ZNode *znode){
+    uint32_t pos = 0;
+    int64_t base = 0;
+    bt_locate(tree,znode,pos,base);
+    return base+pos;
+}
+
+ZNode *bt_select(BTree *tree,int64_t rank){
+    if(rank < 0 || rank >= (int64_t)tree->size) return NULL;
+    int64_t pos = rank;
+    void *ptr = tree->root;
+    for(uint32_t level = tree->height;level>1;--level){
+        BInner *node = (BInner *)ptr;
+        uint32_t i = 0;
+        while(pos >= node->cnts[i]) pos -= node->cnts[i++];
+        ptr = node->kids[i];
+    }
+    return bt_found(tree,(BLeaf *)ptr,(uint32_t)pos,rank-pos);
+}
+
+ZNode *bt_offset(BTree *tree,ZNode *znode,int64_t offset){
+    uint32_t pos = 0;
+    int64_t base = 0;
+    BLeaf *leaf = bt_locate(tree,znode,pos,base);
+    int64_t target = (int64_t)pos+offset;
+    if(target >= 0 && target < (int64_t)leaf->n) return bt_found(tree,leaf,(uint32_t)target,base);
+    //the neighbour leaves are one pointer away, the rest goes through the counts
+    if(target == (int64_t)leaf->n && leaf->next) return bt_found(tree,leaf->next,0,base+leaf->n);
+    if(target == -1 && leaf->prev) return bt_found(tree,leaf->prev,leaf->prev->n-1,base-leaf->prev->n);
+    return bt_select(tree,base+target);
+}
+
+void bt_iter(BTree *tree,ZNode *znode,BTIter *it){
+    int64_t base = 0;
+    it->leaf = bt_locate(tree,znode,it->pos,base);
+}
+
+ZNode *bt_iter_next(BTIter *it){
+    BLeaf *leaf = (BLeaf *)it->leaf;
+    if(!leaf) return NULL;
+    if(++it->pos == leaf->n){
+        it->leaf = leaf = leaf->next;
+        it->pos = 0;
+    }
+    return leaf ? leaf->members[it->pos] : NULL;
+}
+
+ZNode *bt_iter_prev(BTIter *it){
+    BLeaf *leaf = (BLeaf *)it->leaf;
+    if(!leaf) return NULL;
+    if(it->pos == 0){
+        it->leaf = leaf = leaf->prev;
+        if(!leaf) return NULL;
+        it->pos = leaf->n;
+    }
+    return leaf->members[--it->pos];
+}
+
+static void node_dispose(void *ptr,uint32_t level,void (*del)(ZNode *)){
+    if(level == 1){
+        BLeaf *leaf = (BLeaf *)ptr;
+        if(del) for(uint32_t i=0;i<leaf->n;++i) del(leaf->members[i]);
+    }else{
+        BInner *node = (BInner *)ptr;
+        for(uint32_t i=0;i<node->n;++i) node_dispose(node->kids[i],level-1,del);
+    }
+    slab_free(ptr);
+}
+
+void bt_build(BTree *tree,ZNode **members,size_t n){
+    assert(!tree->root);
+    tree->last_leaf = NULL;
+    tree->size = n;
+    if(!n) return;
+    //the fewest leaves that hold them, the members are spread evenly so every leaf is at least half full
+    std::vector<void *> level((n+k_leaf_cap-1)/k_leaf_cap);
+    std::vector<uint32_t> cnts(level.size());
+    BLeaf *prev = NULL;
+    size_t pos = 0;
+    for(size_t i=0;i<level.size();++i){
+        uint32_t take = (uint32_t)((n-pos)/(level.size()-i));
+        BLeaf *leaf = leaf_new();
+        for(uint32_t k=0;k<take;++k){
+            leaf->scores[k] = members[pos+k]->score;
+            leaf->members[k] = members[pos+k];
+        }
+        leaf->n = take;
+        leaf->prev = prev;
+        if(prev) prev->next = leaf;
+        prev = leaf;
+        level[i] = leaf;
+        cnts[i] = take;
+        pos += take;
+    }
+    //then the inner levels the same way until one node is left
+    uint32_t height = 1;
+    while(level.size() > 1){
+        std::vector<void *> up((level.size()+k_inner_cap-1)/k_inner_cap);
+        std::vector<uint32_t> up_cnts(up.size());
+        pos = 0;
+        for(size_t i=0;i<up.size();++i){
+            uint32_t take = (uint32_t)((level.size()-pos)/(up.size()-i));
+            BInner *node = inner_new();
+            uint32_t cnt = 0;
+            for(uint32_t k=0;k<take;++k){
+                inner_put(node,k,level[pos+k],cnts[pos+k],height);
+                cnt += cnts[pos+k];
+            }
+            up[i] = node;
+            up_cnts[i] = cnt;
+            pos += take;
+        }
+        level.swap(up);
+        cnts.swap(up_cnts);
+        height++;
+    }
+    tree->root = level[0];
+    tree->height = height;
+}
+
+void bt_clear(BTree *tree,void (*del)(ZNode *)){
+    if(tree->root) node_dispose(tree->root,tree->height,del);
+    tree->root = NULL;
+    tree->height = 0;
+    tree->size = 0;
+    tree->last_leaf = NULL;
+}
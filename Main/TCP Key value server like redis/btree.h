@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// an order statistic B+tree of the zset members, ordered by (score,name)
+//  the leaves keep the scores and the member pointers in two arrays and are linked both ways,
+//  the inner nodes keep the smallest member and the member count of every child.
+//  A leaf is 512 bytes and an inner node 1KB, both come from the slab so they are cache line aligned
+
+struct ZNode;
+
+struct BTree{
+    void *root = NULL;
+    uint32_t height = 0;    //0 when empty, 1 when the root is a leaf
+    size_t size = 0;
+    //where the member returned last is, stepping on from it does not start at the root again.
+    // Any insert or delete drops it
+    void *last_leaf = NULL;
+    uint32_t last_pos = 0;
+    int64_t last_base = 0;  //the rank of the first member of last_leaf
+};
+
+//a position in the linked leaves
+struct BTIter{
+    void *leaf = NULL;
+    uint32_t pos = 0;
+};
+
+//the member must not be in the tree
+void    bt_insert(BTree *tree,ZNode *znode);
+//the member must be in the tree with its current score
+void    bt_delete(BTree *tree,ZNode *znode);
+//the first member >= (score,name)
+ZNode  *bt_seekge(BTree *tree,double score,const char *name,size_t len);
+//the position of the member from 0
+int64_t bt_rank(BTree *tree,ZNode *znode);
+//the member at a position, NULL when it is out of range
+ZNode  *bt_select(BTree *tree,int64_t rank);
+//the member offset positions away from znode
+ZNode  *bt_offset(BTree *tree,ZNode *znode,int64_t offset);
+//start an iterator at the member
+void    bt_iter(BTree *tree,ZNode *znode,BTIter *it);
+//step to the neighbour and return it, NULL past either end
+ZNode  *bt_iter_next(BTIter *it);
+ZNode  *bt_iter_prev(BTIter *it);
+//fill an empty tree with the members, which are in order, in O(n)
+void    bt_build(BTree *tree,ZNode **members,size_t n);
+//free the nodes, del is called on every member unless it is NULL
+void    bt_clear(BTree *tree,void (*del)(ZNode *));
@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+const size_t k_buf_min_cap = 4*1024;
+
+Buffer::~Buffer(){
+    free(buffer_begin);
+}
+
+uint8_t *buf_prepare(Buffer &buf,size_t len){
+    if((size_t)(buf.buffer_end - buf.data_end) >= len) return buf.data_end;
+
+    size_t size = buf_size(buf);
+    size_t cap = (size_t)(buf.buffer_end - buf.buffer_begin);
+    //slide the data to the front only if the consumed space is larger than the data,
+    //so each byte is moved at most once on average
+    if((size_t)(buf.data_begin - buf.buffer_begin) >= size && cap - size >= len){
+        memmove(buf.buffer_begin,buf.data_begin,size);
+        buf.data_begin = buf.buffer_begin;
+        buf.data_end = buf.buffer_begin + size;
+        return buf.data_end;
+    }
+    //otherwise grow, the data is compacted to the front by the copy
+    size_t new_cap = cap ? cap*2 : k_buf_min_cap;
+    while(new_cap < size + len) new_cap *= 2;
+    uint8_t *mem = (uint8_t *)malloc(new_cap);
+    assert(mem);
+    if(size) memcpy(mem,buf.data_begin,size);
+    free(buf.buffer_begin);
+    buf.buffer_begin = mem;
+    buf.buffer_end = mem + new_cap;
+    buf.data_begin = mem;
+    buf.data_end = mem + size;
+    return buf.data_end;
+}
+
+void buf_commit(Buffer &buf,size_t len){
+    assert(len <= (size_t)(buf.buffer_end - buf.data_end));
+    buf.data_end += len;
+}
+
+//append to the back 
+void buf_append(Buffer &buf,const uint8_t *data,size_t len){
+    if(!len) return;
+    memcpy(buf_prepare(buf,len),data,len);
+    buf.data_end += len;
+}
+
+//remove the data from the front so that it follows FIFO order, it is O(1)
+void buf_consume(Buffer &buf,size_t len){
+    assert(len <= buf_size(buf));
+    buf.data_begin += len;
+    //an empty buffer starts from the front again for free
+    if(buf.data_begin == buf.data_end) buf.data_begin = buf.data_end = buf.buffer_begin;
+}
+
+void buf_clear(Buffer &buf){
+    buf.data_begin = buf.data_end = buf.buffer_begin;
+}
+
+void buf_truncate(Buffer &buf,size_t len){
+    assert(len <= buf_size(buf));
+    buf.data_end = buf.data_begin + len;
+}
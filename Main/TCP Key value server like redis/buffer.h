@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//a FIFO byte buffer, consuming from the front only moves a cursor
+//  [buffer_begin, data_begin)   consumed, reclaimed by the occasional compaction
+//  [data_begin, data_end)       the data
+//  [data_end, buffer_end)       free space for the appends
+struct Buffer{
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer();
+};
+
+inline size_t buf_size(const Buffer &buf){
+    return (size_t)(buf.data_end - buf.data_begin);
+}
+inline uint8_t *buf_data(Buffer &buf){
+    return buf.data_begin;
+}
+
+//exchange the data of two buffers without copying it
+inline void buf_swap(Buffer &a,Buffer &b){
+    Buffer t;
+    t.buffer_begin = a.buffer_begin; t.buffer_end = a.buffer_end; t.data_begin = a.data_begin; t.data_end = a.data_end;
+    a.buffer_begin = b.buffer_begin; a.buffer_end = b.buffer_end; a.data_begin = b.data_begin; a.data_end = b.data_end;
+    b.buffer_begin = t.buffer_begin; b.buffer_end = t.buffer_end; b.data_begin = t.data_begin; b.data_end = t.data_end;
+    t.buffer_begin = t.buffer_end = t.data_begin = t.data_end = NULL;
+}
+
+void buf_append(Buffer &buf,const uint8_t *data,size_t len);
+void buf_consume(Buffer &buf,size_t len);
+void buf_clear(Buffer &buf);
+//drop the data after the first len bytes
+void buf_truncate(Buffer &buf,size_t len);
+//free space of at least len bytes at the back, data is written there directly and then committed
+uint8_t *buf_prepare(Buffer &buf,size_t len);
+void buf_commit(Buffer &buf,size_t len);
+
+inline void buf_append_u8(Buffer &buf,uint8_t data){
+    if(buf.data_end == buf.buffer_end) buf_prepare(buf,1);
+    *buf.data_end++ = data;
+}
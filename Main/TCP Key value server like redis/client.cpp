@@ -1,158 +1,45 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <cstring>
+#include <string_view>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <errno.h>
 #include <deque>
-
-#define MAX_MSG 65536
-
-void die(const char *msg) {
-    perror(msg);
-    exit(1);
-}
-
-void set_socket_timeout(int sock, int seconds) {
-    timeval tv;
-    tv.tv_sec = seconds;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-}
-
-int connect_to_server() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(sock);
-        return -1;
-    }
-
-    return sock;
-}
-
-bool write_full(int sock, const void *buf, size_t len) {
-    const uint8_t *p = (const uint8_t*)buf;
-    while (len > 0) {
-        ssize_t n = write(sock, p, len);
-        if (n <= 0) {
-            if (errno == ECONNRESET || errno == EPIPE || errno == EAGAIN || errno == EWOULDBLOCK) {
-                std::cerr << "[write_full] Disconnected or timed out.\n";
-                return false;
-            }
-            perror("write");
-            return false;
-        }
-        p += n;
-        len -= n;
-    }
-    return true;
-}
-
-bool read_full(int sock, void *buf, size_t len) {
-    uint8_t *p = (uint8_t*)buf;
-    while (len > 0) {
-        ssize_t n = read(sock, p, len);
-        if (n <= 0) {
-            if (errno == ECONNRESET || errno == EPIPE || errno == EAGAIN || errno == EWOULDBLOCK) {
-                std::cerr << "[read_full] Disconnected or timed out.\n";
-                return false;
-            }
-            perror("read");
-            return false;
-        }
-        p += n;
-        len -= n;
-    }
-    return true;
-}
-
-bool send_request(int sock, const std::vector<std::string> &args) {
-    uint8_t req[MAX_MSG];
-    size_t pos = 0;
-
-    uint32_t n = args.size();
-    memcpy(&req[pos], &n, 4); pos += 4;
-
-    for (const auto &arg : args) {
-        uint32_t len = arg.size();
-        memcpy(&req[pos], &len, 4); pos += 4;
-        memcpy(&req[pos], arg.data(), len); pos += len;
+#include "kvclient.h"
+
+const int k_timeout_ms = 10*1000;   // timeout: 10 seconds
+
+void print_value(const KVValue &val, int indent) {
+    std::cout << std::string(indent, ' ');
+    if (val.tag == KV_NIL) {
+        std::cout << "(nil)\n";
+    } else if (val.tag == KV_ERR) {
+        std::cout << "Error [" << val.code << "]: " << val.str << "\n";
+    } else if (val.tag == KV_STR) {
+        std::cout << "\"" << val.str << "\"\n";
+    } else if (val.tag == KV_INT) {
+        std::cout << val.ival << "\n";
+    } else if (val.tag == KV_DBL) {
+        std::cout << val.dval << "\n";
+    } else if (val.tag == KV_ARR) {
+        std::cout << "[Array of " << val.arr.size() << " elements]\n";
+        for (const KVValue &elem : val.arr)
+            print_value(elem, indent + 2);
     }
-
-    uint32_t msg_len = pos;
-    return write_full(sock, &msg_len, 4) && write_full(sock, req, msg_len);
-}
-
-bool receive_response(int sock) {
-    uint32_t len;
-    if (!read_full(sock, &len, 4)) return false;
-    if (len > MAX_MSG) {
-        std::cerr << "Response too long\n";
-        return false;
-    }
-    uint8_t buf[MAX_MSG];
-    if (!read_full(sock, buf, len)) return false;
-
-    size_t i = 0;
-    while (i < len) {
-        uint8_t type = buf[i++];
-        if (type == 0) {
-            std::cout << "(nil)\n";
-        } else if (type == 1) {
-            uint32_t code, msg_len;
-            memcpy(&code, &buf[i], 4); i += 4;
-            memcpy(&msg_len, &buf[i], 4); i += 4;
-            std::cout << "Error [" << code << "]: " << std::string((char*)&buf[i], msg_len) << "\n";
-            i += msg_len;
-        } else if (type == 2) {
-            uint32_t slen;
-            memcpy(&slen, &buf[i], 4); i += 4;
-            std::cout << "\"" << std::string((char*)&buf[i], slen) << "\"\n";
-            i += slen;
-        } else if (type == 3) {
-            int64_t val;
-            memcpy(&val, &buf[i], 8); i += 8;
-            std::cout << val << "\n";
-        } else if (type == 4) {
-            double val;
-            memcpy(&val, &buf[i], 8); i += 8;
-            std::cout << val << "\n";
-        } else if (type == 5) {
-            uint32_t n;
-            memcpy(&n, &buf[i], 4); i += 4;
-            std::cout << "[Array of " << (n / 2) << " elements]\n";
-        } else {
-            std::cerr << "Unknown response type: " << (int)type << "\n";
-            break;
-        }
-    }
-    return true;
 }
 
 int main() {
-    int sock = -1;
+    KVConn *conn = NULL;
     std::string line;
     std::deque<std::string> command_history;
 
     while (true) {
-        if (sock < 0) {
-            sock = connect_to_server();
-            if (sock < 0) {
+        if (!conn) {
+            conn = kv_connect("127.0.0.1", 1234, k_timeout_ms);
+            if (!conn) {
                 std::cerr << "[Retrying connection in 2s...]\n";
                 sleep(2);
                 continue;
             }
-            set_socket_timeout(sock, 10);  // timeout: 10 seconds
             std::cout << "[Connected to server]\n";
         }
 
@@ -191,14 +78,18 @@ int main() {
                 command_history.pop_front();
         }
 
-        if (!send_request(sock, args) || !receive_response(sock)) {
-            std::cerr << "[Lost connection. Reconnecting...]\n";
-            close(sock);
-            sock = -1;
+        std::vector<std::string_view> views(args.begin(), args.end());
+        KVValue res = kv_call(conn, views, k_timeout_ms);
+        if (res.tag == KV_ERR && res.code == KV_ERR_IO) {
+            std::cerr << "[" << res.str << ". Reconnecting...]\n";
+            kv_close(conn);
+            conn = NULL;
+            continue;
         }
+        print_value(res, 0);
     }
 
-    if (sock >= 0) close(sock);
+    kv_close(conn);
     std::cout << "Client exiting.\n";
     return 0;
 }
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "hash.h"
 
 
 // intrusive data structure
@@ -9,11 +10,7 @@
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) );})
 
-// FNV hash
+// the keyed 64 bit hash of hash.h, every key and member name goes through it
 inline uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
-    }
-    return h;
+    return hash_bytes(data, len);
 }
\ No newline at end of file
@@ -0,0 +1,370 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>     // rename
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#include "dump.h"
+
+const char k_dump_magic[8] = {'K','V','D','U','M','P','0','2'};
+const size_t k_dump_trailer = 1+8+4+8+4;    //without the segments
+const size_t k_dump_seg_entry = 8+8+4;
+const size_t k_dump_buf = 256*1024;     //the writes to the file are this big
+
+#ifdef __SSE4_2__
+uint32_t dump_crc(uint32_t crc,const void *data,size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c = ~crc;
+    for(;len>=8;len-=8,p+=8){
+        uint64_t v;
+        memcpy(&v,p,8);
+        c = _mm_crc32_u64(c,v);
+    }
+    for(;len;--len) c = _mm_crc32_u8((uint32_t)c,*p++);
+    return ~(uint32_t)c;
+}
+#else
+//slice by 8, table k holds the CRC of a byte followed by k zero bytes
+struct CrcTables{
+    uint32_t t[8][256];
+    CrcTables(){
+        for(uint32_t i=0;i<256;++i){
+            uint32_t c = i;
+            for(int k=0;k<8;++k) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for(uint32_t i=0;i<256;++i){
+            for(int k=1;k<8;++k) t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+        }
+    }
+};
+static const CrcTables g_crc;
+
+uint32_t dump_crc(uint32_t crc,const void *data,size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    const uint32_t (*t)[256] = g_crc.t;
+    uint32_t c = ~crc;
+    for(;len>=8;len-=8,p+=8){
+        uint32_t lo,hi;
+        memcpy(&lo,p,4);
+        memcpy(&hi,p+4,4);
+        lo ^= c;
+        c = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for(;len;--len) c = (c >> 8) ^ t[0][(c ^ *p++) & 0xFF];
+    return ~c;
+}
+#endif
+
+static bool write_all(int fd,const uint8_t *data,size_t len){
+    while(len){
+        ssize_t rv = write(fd,data,len);
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<=0) return false;
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+static void w_write(DumpWriter *w,const uint8_t *data,size_t len){
+    if(w->failed) return;
+    if(!write_all(w->fd,data,len)) w->failed = true;
+    w->bytes += len;
+}
+
+//the bytes of buf which are not in the checksum yet belong to the current segment
+static void w_crc(DumpWriter *w){
+    w->seg.crc = dump_crc(w->seg.crc,w->buf+w->crc_used,w->used-w->crc_used);
+    w->crc_used = w->used;
+}
+
+static void w_flush(DumpWriter *w){
+    w_crc(w);
+    w_write(w,w->buf,w->used);
+    w->used = 0;
+    w->crc_used = 0;
+}
+
+static void w_put(DumpWriter *w,const void *data,size_t len){
+    if(w->used + len > k_dump_buf){
+        w_flush(w);
+        //a long value goes to the file without the copy
+        if(len > k_dump_buf){
+            w->seg.crc = dump_crc(w->seg.crc,data,len);
+            return w_write(w,(const uint8_t *)data,len);
+        }
+    }
+    memcpy(w->buf+w->used,data,len);
+    w->used += len;
+}
+
+static void w_varint(DumpWriter *w,uint64_t v){
+    uint8_t tmp[10];
+    size_t n = 0;
+    for(;v>=0x80;v>>=7) tmp[n++] = (uint8_t)v | 0x80;
+    tmp[n++] = (uint8_t)v;
+    w_put(w,tmp,n);
+}
+
+static void w_u8(DumpWriter *w,uint8_t v){ w_put(w,&v,1); }
+static void w_u32(DumpWriter *w,uint32_t v){ w_put(w,&v,4); }
+static void w_u64(DumpWriter *w,uint64_t v){ w_put(w,&v,8); }
+
+static void w_bytes(DumpWriter *w,std::string_view s){
+    w_varint(w,s.size());
+    w_put(w,s.data(),s.size());
+}
+
+//the file offset of the next byte
+static uint64_t w_pos(DumpWriter *w){
+    return w->bytes + w->used;
+}
+
+static void w_seg_end(DumpWriter *w){
+    uint64_t pos = w_pos(w);
+    if(pos == w->seg.begin) return;
+    w_crc(w);
+    w->seg.end = pos;
+    w->segs.push_back(w->seg);
+    w->seg = DumpSeg{};
+    w->seg.begin = pos;
+}
+
+//the type byte, the deadline and the key. A record starts a new segment once the current one is big enough
+static void w_key(DumpWriter *w,uint32_t type,std::string_view key,uint64_t deadline_ms){
+    if(w_pos(w) - w->seg.begin >= k_dump_segment) w_seg_end(w);
+    w->seg.nkeys++;
+    w_u8(w,(uint8_t)type | (deadline_ms != k_dump_no_ttl ? k_dump_ttl : 0));
+    if(deadline_ms != k_dump_no_ttl) w_u64(w,deadline_ms);
+    w_bytes(w,key);
+    w->nkeys++;
+}
+
+bool dump_create(DumpWriter *w,const char *tmp_path,const DumpHeader &hdr){
+    *w = DumpWriter{};
+    w->fd = open(tmp_path,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    if(w->fd<0) return false;
+    w->buf = (uint8_t *)malloc(k_dump_buf);
+    assert(w->buf);
+    w_put(w,k_dump_magic,sizeof(k_dump_magic));
+    w_u32(w,hdr.shard);
+    w_u32(w,hdr.nshards);
+    w_u64(w,hdr.time_ms);
+    //the header is in the checksum of the trailer
+    memcpy(w->header,w->buf,k_dump_header);
+    w->crc_used = w->used;
+    w->seg.begin = k_dump_header;
+    return true;
+}
+
+void dump_put_str(DumpWriter *w,std::string_view key,std::string_view val,uint64_t deadline_ms){
+    w_key(w,DUMP_STR,key,deadline_ms);
+    w_bytes(w,val);
+}
+
+void dump_put_int(DumpWriter *w,std::string_view key,int64_t val,uint64_t deadline_ms){
+    w_key(w,DUMP_INT,key,deadline_ms);
+    w_varint(w,((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+void dump_put_zset(DumpWriter *w,std::string_view key,uint64_t n,uint64_t deadline_ms){
+    w_key(w,DUMP_ZSET,key,deadline_ms);
+    w_varint(w,n);
+}
+
+void dump_put_member(DumpWriter *w,double score,std::string_view name){
+    w_put(w,&score,8);
+    w_bytes(w,name);
+}
+
+static void t_put(std::vector<uint8_t> &out,const void *data,size_t len){
+    out.insert(out.end(),(const uint8_t *)data,(const uint8_t *)data+len);
+}
+
+bool dump_finish(DumpWriter *w,const char *tmp_path,const char *path){
+    w_seg_end(w);
+    w_flush(w);
+    //the trailer is made aside, its checksum covers the header as well
+    uint64_t trailer_pos = w->bytes;
+    uint32_t nsegs = (uint32_t)w->segs.size();
+    std::vector<uint8_t> trailer;
+    trailer.push_back(DUMP_EOF);
+    t_put(trailer,&w->nkeys,8);
+    t_put(trailer,&nsegs,4);
+    for(const DumpSeg &seg : w->segs){
+        t_put(trailer,&seg.end,8);
+        t_put(trailer,&seg.nkeys,8);
+        t_put(trailer,&seg.crc,4);
+    }
+    t_put(trailer,&trailer_pos,8);
+    uint32_t crc = dump_crc(dump_crc(0,w->header,k_dump_header),trailer.data(),trailer.size());
+    t_put(trailer,&crc,4);
+    w_write(w,trailer.data(),trailer.size());
+    if(!w->failed && fsync(w->fd)) w->failed = true;
+    if(close(w->fd)) w->failed = true;
+    free(w->buf);
+    w->buf = NULL;
+    w->fd = -1;
+    if(!w->failed && rename(tmp_path,path)) w->failed = true;
+    if(w->failed) unlink(tmp_path);
+    return !w->failed;
+}
+
+//the trailer and the segment table, the file is mapped already
+static bool dump_parse_trailer(DumpFile *f){
+    const uint8_t *data = f->data;
+    size_t size = f->size;
+    if(size < k_dump_header+k_dump_trailer || memcmp(data,k_dump_magic,sizeof(k_dump_magic))) return false;
+    uint64_t trailer_pos = 0;
+    uint32_t crc = 0,nsegs = 0;
+    memcpy(&trailer_pos,data+size-12,8);
+    memcpy(&crc,data+size-4,4);
+    if(trailer_pos < k_dump_header || trailer_pos > size-k_dump_trailer || data[trailer_pos] != DUMP_EOF) return false;
+    if(crc != dump_crc(dump_crc(0,data,k_dump_header),data+trailer_pos,size-4-trailer_pos)) return false;
+    memcpy(&f->nkeys,data+trailer_pos+1,8);
+    memcpy(&nsegs,data+trailer_pos+9,4);
+    if((uint64_t)nsegs*k_dump_seg_entry != size-k_dump_trailer-trailer_pos) return false;
+    const uint8_t *p = data+trailer_pos+13;
+    uint64_t begin = k_dump_header;
+    for(uint32_t i=0;i<nsegs;++i,p+=k_dump_seg_entry){
+        DumpSeg seg;
+        seg.begin = begin;
+        memcpy(&seg.end,p,8);
+        memcpy(&seg.nkeys,p+8,8);
+        memcpy(&seg.crc,p+16,4);
+        if(seg.end < seg.begin || seg.end > trailer_pos) return false;
+        f->segs.push_back(seg);
+        begin = seg.end;
+    }
+    if(begin != trailer_pos) return false;
+    memcpy(&f->hdr.shard,data+8,4);
+    memcpy(&f->hdr.nshards,data+12,4);
+    memcpy(&f->hdr.time_ms,data+16,8);
+    return true;
+}
+
+bool dump_open(DumpFile *f,const char *path){
+    *f = DumpFile{};
+    int fd = open(path,O_RDONLY | O_CLOEXEC);
+    if(fd<0) return false;
+    struct stat st;
+    if(fstat(fd,&st)){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = size ? mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0) : NULL;
+    int err = errno;
+    close(fd);
+    if(data == MAP_FAILED){
+        errno = err;
+        return false;
+    }
+    //the segments are read by several threads at once, have the kernel read the whole file ahead
+    if(size) madvise(data,size,MADV_WILLNEED);
+    f->data = (const uint8_t *)data;
+    f->size = size;
+    if(!dump_parse_trailer(f)){
+        dump_close(f);
+        errno = 0;
+        return false;
+    }
+    return true;
+}
+
+void dump_close(DumpFile *f){
+    if(f->data) munmap((void *)f->data,f->size);
+    *f = DumpFile{};
+}
+
+bool dump_seg_ok(const DumpFile *f,size_t i){
+    const DumpSeg &seg = f->segs[i];
+    return dump_crc(0,f->data+seg.begin,(size_t)(seg.end-seg.begin)) == seg.crc;
+}
+
+static bool r_varint(const uint8_t **p,const uint8_t *end,uint64_t *v){
+    uint64_t x = 0;
+    for(uint32_t shift=0;shift<64;shift+=7){
+        if(*p == end) return false;
+        uint8_t b = *(*p)++;
+        x |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)){
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool r_bytes(const uint8_t **p,const uint8_t *end,std::string_view *s){
+    uint64_t len = 0;
+    if(!r_varint(p,end,&len) || len > (uint64_t)(end - *p)) return false;
+    *s = std::string_view((const char *)*p,(size_t)len);
+    *p += len;
+    return true;
+}
+
+int dump_next(const DumpFile *f,size_t *pos,size_t seg_end,DumpRec *rec){
+    if(*pos >= seg_end) return 0;
+    const uint8_t *p = f->data + *pos;
+    const uint8_t *end = f->data + seg_end;
+    *rec = DumpRec{};
+    uint8_t tag = *p++;
+    rec->type = tag & ~k_dump_ttl;
+    if(tag & k_dump_ttl){
+        if(end - p < 8) return -1;
+        memcpy(&rec->deadline_ms,p,8);
+        p += 8;
+    }
+    if(!r_bytes(&p,end,&rec->key)) return -1;
+    uint64_t v = 0;
+    switch(rec->type){
+    case DUMP_STR:
+        if(!r_bytes(&p,end,&rec->val)) return -1;
+        break;
+    case DUMP_INT:
+        if(!r_varint(&p,end,&v)) return -1;
+        rec->ival = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        break;
+    case DUMP_ZSET:{
+        if(!r_varint(&p,end,&rec->nmembers)) return -1;
+        //the members are walked once to find the next record
+        const uint8_t *first = p;
+        std::string_view name;
+        for(uint64_t i=0;i<rec->nmembers;++i){
+            if(end - p < 8) return -1;
+            p += 8;
+            if(!r_bytes(&p,end,&name)) return -1;
+        }
+        rec->val = std::string_view((const char *)first,(size_t)(p - first));
+        break;
+    }
+    default:
+        return -1;
+    }
+    *pos = (size_t)(p - f->data);
+    return 1;
+}
+
+bool dump_next_member(DumpRec *rec,double *score,std::string_view *name){
+    if(!rec->nmembers) return false;
+    const uint8_t *p = (const uint8_t *)rec->val.data();
+    const uint8_t *end = p + rec->val.size();
+    if(end - p < 8) return false;
+    memcpy(score,p,8);
+    p += 8;
+    if(!r_bytes(&p,end,name)) return false;
+    rec->val.remove_prefix((size_t)(p - (const uint8_t *)rec->val.data()));
+    rec->nmembers--;
+    return true;
+}
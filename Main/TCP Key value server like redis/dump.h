@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+// the snapshot file of a shard, written by SAVE and BGSAVE and read at startup
+//  header:   "KVDUMP02", u32 shard, u32 shard count, u64 unix ms of the save
+//  segments: the records one after the other, cut into runs of about k_dump_segment bytes of whole records
+//            which have a checksum each, so a loader checks and decodes them in parallel
+//  records: u8 type, the 0x80 bit is set when an i64 unix ms deadline follows, then varint key length and key
+//           DUMP_STR   varint length and the bytes
+//           DUMP_INT   zigzag varint
+//           DUMP_ZSET  varint member count, then per member f64 score, varint length and the name, in (score,name) order
+//  trailer: u8 DUMP_EOF, u64 key count, u32 segment count, per segment u64 end offset, u64 key count and
+//           u32 CRC32C of its bytes, then u64 offset of DUMP_EOF and u32 CRC32C of the header and the trailer
+// The numbers are little endian. A file is written next to its final name and renamed when it is complete
+
+enum {
+    DUMP_STR = 1,
+    DUMP_INT = 2,
+    DUMP_ZSET = 3,
+    DUMP_EOF = 0x7F,
+};
+const uint8_t k_dump_ttl = 0x80;
+const size_t k_dump_header = 24;    //the first record starts here
+const size_t k_dump_segment = 4 << 20;
+const uint64_t k_dump_no_ttl = (uint64_t)-1;
+
+struct DumpHeader{
+    uint32_t shard = 0;
+    uint32_t nshards = 1;
+    uint64_t time_ms = 0;
+};
+
+//a run of whole records
+struct DumpSeg{
+    uint64_t begin = 0;     //the file offset of the first record
+    uint64_t end = 0;       //past the last one
+    uint64_t nkeys = 0;
+    uint32_t crc = 0;       //CRC32C of [begin,end)
+};
+
+//a buffered writer, the first error sticks and dump_finish() reports it
+struct DumpWriter{
+    int fd = -1;
+    bool failed = false;
+    uint64_t nkeys = 0;
+    uint64_t bytes = 0;     //written to the file so far
+    uint8_t *buf = NULL;
+    size_t used = 0;
+    size_t crc_used = 0;    //the part of buf which is in seg.crc already
+    uint8_t header[k_dump_header];
+    DumpSeg seg;            //the segment being written
+    std::vector<DumpSeg> segs;
+};
+
+bool dump_create(DumpWriter *w,const char *tmp_path,const DumpHeader &hdr);
+//deadline_ms is unix ms or k_dump_no_ttl
+void dump_put_str(DumpWriter *w,std::string_view key,std::string_view val,uint64_t deadline_ms);
+void dump_put_int(DumpWriter *w,std::string_view key,int64_t val,uint64_t deadline_ms);
+//the n members follow with dump_put_member()
+void dump_put_zset(DumpWriter *w,std::string_view key,uint64_t n,uint64_t deadline_ms);
+void dump_put_member(DumpWriter *w,double score,std::string_view name);
+//write the trailer, fsync and rename to path, false if anything failed on the way. The writer is closed either way
+bool dump_finish(DumpWriter *w,const char *tmp_path,const char *path);
+
+//a file mapped into memory, the header and the trailer are verified when it is opened
+// and each segment with dump_seg_ok() before it is read
+struct DumpFile{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    DumpHeader hdr;
+    uint64_t nkeys = 0;     //from the trailer
+    std::vector<DumpSeg> segs;
+};
+
+//a record, val is the string or the encoded members for dump_next_member()
+struct DumpRec{
+    uint32_t type = 0;
+    uint64_t deadline_ms = k_dump_no_ttl;
+    std::string_view key;
+    std::string_view val;
+    int64_t ival = 0;
+    uint64_t nmembers = 0;
+};
+
+//false with errno set when it cannot be read, or with errno 0 when it is not a complete dump file
+bool dump_open(DumpFile *f,const char *path);
+void dump_close(DumpFile *f);
+//the checksum of segment i, any thread may check any segment
+bool dump_seg_ok(const DumpFile *f,size_t i);
+//the record at *pos, 1 and *pos moves past it, 0 at end, -1 if the file is malformed. A segment
+// is read from its begin to its end
+int  dump_next(const DumpFile *f,size_t *pos,size_t seg_end,DumpRec *rec);
+//take one member off rec->val, false once there are none or they are malformed
+bool dump_next_member(DumpRec *rec,double *score,std::string_view *name);
+//CRC32C, with the SSE4.2 instruction when the build allows it
+uint32_t dump_crc(uint32_t crc,const void *data,size_t len);
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// a seeded 64 bit hash for the keys, the seed is random per process so the
+// clients can not pick the keys which collide
+//  short keys: the wyhash construction (a 64x64->128 multiply folds 16 bytes)
+//  long keys:  8 lanes of 32x32->64 multiply accumulate over 64 byte stripes
+//              like xxh3, 2 AVX2 or 4 SSE2 registers wide, the scalar loop gives the same result
+
+const uint64_t k_hash_p0 = 0x2d358dccaa6c78a5ull;
+const uint64_t k_hash_p1 = 0x8bb84b93962eacc9ull;
+const uint64_t k_hash_p2 = 0x4b33a62ed433d4a3ull;
+const uint64_t k_hash_p3 = 0x4d5a2da51de1aa47ull;
+
+const size_t k_hash_stripe = 64;            //bytes per accumulate step
+const size_t k_hash_block_stripes = 16;     //stripes between the scrambles
+#if defined(__AVX2__)
+const size_t k_hash_long = 512;             //keys above this take the stripe path
+#else
+//with 128 bit multiplies the stripes never caught up with the 64x64 multiplies of
+//hash_mum in bench_hash, so without AVX2 (-mavx2, -march=native) every key takes hash_mum
+const size_t k_hash_long = SIZE_MAX;
+#endif
+const size_t k_hash_secret = 8 + k_hash_block_stripes + 8;  //u64, a stripe key slides over it
+
+struct HashKey{
+    uint64_t seed = 0;
+    uint64_t short_seed = 0;    //the seed premixed for the short keys
+    //hash_mum xors both multiply operands with these. A public constant there would let a key zero
+    // the product, and every key doing so would hash the same under every seed
+    uint64_t mum[4] = {};
+    alignas(16) uint64_t secret[k_hash_secret] = {};
+};
+
+inline uint64_t hash_mix(uint64_t a,uint64_t b){
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t hash_r8(const uint8_t *p){ uint64_t v; memcpy(&v,p,8); return v; }
+inline uint64_t hash_r4(const uint8_t *p){ uint32_t v; memcpy(&v,p,4); return v; }
+
+//the secret is derived from the seed, so one seed fixes every hash value
+inline HashKey hash_key_make(uint64_t seed){
+    HashKey key;
+    key.seed = seed;
+    key.short_seed = seed ^ hash_mix(seed ^ k_hash_p0,k_hash_p1);
+    uint64_t s = seed;
+    for(size_t i=0;i<k_hash_secret;++i){
+        s += 0x9E3779B97F4A7C15ull;     //splitmix64
+        uint64_t z = s;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        key.secret[i] = z ^ (z >> 31);
+    }
+    for(size_t i=0;i<4;++i){
+        s += 0x9E3779B97F4A7C15ull;
+        uint64_t z = s;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        key.mum[i] = z ^ (z >> 31);
+    }
+    return key;
+}
+
+//set by hash_init() before the threads start and read only afterwards, the programs which do not call it get a fixed seed
+inline HashKey g_hash_key = hash_key_make(k_hash_p0);
+
+//a random seed for this process
+inline void hash_init(){
+    uint64_t seed = 0;
+    if(getrandom(&seed,sizeof(seed),GRND_NONBLOCK) != (ssize_t)sizeof(seed)){
+        struct timespec tv = {0,0};
+        clock_gettime(CLOCK_MONOTONIC,&tv);
+        seed = hash_mix((uint64_t)tv.tv_nsec ^ k_hash_p0,(uint64_t)getpid() ^ ((uint64_t)tv.tv_sec << 20) ^ k_hash_p1);
+    }
+    g_hash_key = hash_key_make(seed);
+}
+
+//the 8 lanes of the stripe path, kept in registers
+struct HashAcc{
+#if defined(__AVX2__)
+    __m256i v[2];
+#elif defined(__SSE2__)
+    __m128i v[4];
+#else
+    uint64_t v[8];
+#endif
+};
+
+#if defined(__AVX2__)
+//4 of the lanes, the same steps as the SSE2 ones below
+inline __m256i hash_accumulate4(__m256i acc,const uint8_t *p,const uint64_t *key){
+    __m256i d = _mm256_loadu_si256((const __m256i *)p);
+    __m256i dk = _mm256_xor_si256(d,_mm256_loadu_si256((const __m256i *)key));
+    __m256i prod = _mm256_mul_epu32(dk,_mm256_shuffle_epi32(dk,_MM_SHUFFLE(0,3,0,1)));
+    __m256i swap = _mm256_shuffle_epi32(d,_MM_SHUFFLE(1,0,3,2));
+    return _mm256_add_epi64(acc,_mm256_add_epi64(prod,swap));
+}
+
+inline __m256i hash_scramble4(__m256i a,const uint64_t *key,__m256i prime){
+    a = _mm256_xor_si256(a,_mm256_srli_epi64(a,47));
+    a = _mm256_xor_si256(a,_mm256_loadu_si256((const __m256i *)key));
+    __m256i lo = _mm256_mul_epu32(a,prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(a,_MM_SHUFFLE(2,3,0,1)),prime);
+    return _mm256_add_epi64(lo,_mm256_slli_epi64(hi,32));
+}
+#elif defined(__SSE2__)
+//2 of the lanes, written out 4 times below so the accumulators stay in registers
+inline __m128i hash_accumulate2(__m128i acc,const uint8_t *p,const uint64_t *key){
+    __m128i d = _mm_loadu_si128((const __m128i *)p);
+    __m128i dk = _mm_xor_si128(d,_mm_loadu_si128((const __m128i *)key));
+    __m128i prod = _mm_mul_epu32(dk,_mm_shuffle_epi32(dk,_MM_SHUFFLE(0,3,0,1)));
+    __m128i swap = _mm_shuffle_epi32(d,_MM_SHUFFLE(1,0,3,2));
+    return _mm_add_epi64(acc,_mm_add_epi64(prod,swap));
+}
+
+inline __m128i hash_scramble2(__m128i a,const uint64_t *key,__m128i prime){
+    a = _mm_xor_si128(a,_mm_srli_epi64(a,47));
+    a = _mm_xor_si128(a,_mm_loadu_si128((const __m128i *)key));
+    __m128i lo = _mm_mul_epu32(a,prime);
+    __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a,_MM_SHUFFLE(2,3,0,1)),prime);
+    return _mm_add_epi64(lo,_mm_slli_epi64(hi,32));
+}
+#endif
+
+//acc[i] += lo32(d^k) * hi32(d^k), and the neighbour lane gets the raw data
+inline void hash_accumulate(HashAcc &acc,const uint8_t *p,const uint64_t *key){
+#if defined(__AVX2__)
+    acc.v[0] = hash_accumulate4(acc.v[0],p,key);
+    acc.v[1] = hash_accumulate4(acc.v[1],p + 32,key + 4);
+#elif defined(__SSE2__)
+    acc.v[0] = hash_accumulate2(acc.v[0],p,key);
+    acc.v[1] = hash_accumulate2(acc.v[1],p + 16,key + 2);
+    acc.v[2] = hash_accumulate2(acc.v[2],p + 32,key + 4);
+    acc.v[3] = hash_accumulate2(acc.v[3],p + 48,key + 6);
+#else
+    for(size_t i=0;i<8;++i){
+        uint64_t d = hash_r8(p + 8*i);
+        uint64_t dk = d ^ key[i];
+        acc.v[i^1] += d;
+        acc.v[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+#endif
+}
+
+//keep the high bits moving into the low ones so the 32 bit multiplies see them
+inline void hash_scramble(HashAcc &acc,const uint64_t *key){
+    const uint32_t k_prime = 0x9E3779B1u;
+#if defined(__AVX2__)
+    const __m256i prime = _mm256_set1_epi32((int)k_prime);
+    acc.v[0] = hash_scramble4(acc.v[0],key,prime);
+    acc.v[1] = hash_scramble4(acc.v[1],key + 4,prime);
+#elif defined(__SSE2__)
+    const __m128i prime = _mm_set1_epi32((int)k_prime);
+    acc.v[0] = hash_scramble2(acc.v[0],key,prime);
+    acc.v[1] = hash_scramble2(acc.v[1],key + 2,prime);
+    acc.v[2] = hash_scramble2(acc.v[2],key + 4,prime);
+    acc.v[3] = hash_scramble2(acc.v[3],key + 6,prime);
+#else
+    for(size_t i=0;i<8;++i){
+        uint64_t a = acc.v[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc.v[i] = a * k_prime;
+    }
+#endif
+}
+
+//len >= k_hash_stripe
+inline uint64_t hash_stripes(const uint8_t *p,size_t len,const HashKey &key){
+    alignas(16) uint64_t lanes[8] = {
+        k_hash_p0,k_hash_p1,k_hash_p2,k_hash_p3,
+        k_hash_p0 ^ key.seed,k_hash_p1 ^ key.seed,k_hash_p2 ^ key.seed,k_hash_p3 ^ key.seed,
+    };
+    HashAcc acc;
+    memcpy(&acc,lanes,sizeof(lanes));
+    const size_t k_block = k_hash_stripe * k_hash_block_stripes;
+    size_t nblocks = (len-1) / k_block;
+    for(size_t b=0;b<nblocks;++b){
+        for(size_t s=0;s<k_hash_block_stripes;++s){
+            hash_accumulate(acc,p + b*k_block + s*k_hash_stripe,key.secret + s);
+        }
+        hash_scramble(acc,key.secret + k_hash_block_stripes);
+    }
+    //the last partial block, then the last 64 bytes which may overlap it
+    size_t nstripes = ((len-1) - nblocks*k_block) / k_hash_stripe;
+    for(size_t s=0;s<nstripes;++s){
+        hash_accumulate(acc,p + nblocks*k_block + s*k_hash_stripe,key.secret + s);
+    }
+    hash_accumulate(acc,p + len - k_hash_stripe,key.secret + k_hash_block_stripes + 1);
+
+    memcpy(lanes,&acc,sizeof(lanes));
+    uint64_t h = len * k_hash_p0 ^ key.seed;
+    for(size_t i=0;i<8;i+=2){
+        h += hash_mix(lanes[i] ^ key.secret[i],lanes[i+1] ^ key.secret[i+1]);
+    }
+    return hash_mix(h ^ k_hash_p2,h ^ (h >> 29) ^ k_hash_p3);
+}
+
+//any length, it is the faster one up to k_hash_long
+inline uint64_t hash_mum(const uint8_t *p,size_t len,const HashKey &key){
+    uint64_t seed = key.short_seed;
+    uint64_t a = 0,b = 0;
+    if(len <= 16){
+        if(len >= 4){
+            //two overlapping reads from each end cover 4..16 bytes
+            size_t off = (len >> 3) << 2;
+            a = (hash_r4(p) << 32) | hash_r4(p + off);
+            b = (hash_r4(p + len - 4) << 32) | hash_r4(p + len - 4 - off);
+        }else if(len > 0){
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len-1];
+        }
+    }else{
+        size_t i = len;
+        if(i > 48){
+            uint64_t see1 = seed,see2 = seed;
+            do{
+                seed = hash_mix(hash_r8(p) ^ key.mum[1],hash_r8(p+8) ^ seed);
+                see1 = hash_mix(hash_r8(p+16) ^ key.mum[2],hash_r8(p+24) ^ see1);
+                see2 = hash_mix(hash_r8(p+32) ^ key.mum[3],hash_r8(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            }while(i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while(i > 16){
+            seed = hash_mix(hash_r8(p) ^ key.mum[1],hash_r8(p+8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_r8(p + i - 16);
+        b = hash_r8(p + i - 8);
+    }
+    a ^= key.mum[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mix(a ^ key.mum[0] ^ len,b ^ key.mum[1]);
+}
+
+inline uint64_t hash_bytes(const uint8_t *p,size_t len,const HashKey &key = g_hash_key){
+    return len > k_hash_long ? hash_stripes(p,len,key) : hash_mum(p,len,key);
+}
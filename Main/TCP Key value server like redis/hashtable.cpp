@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include "hashtable.h"
 
+#ifndef USE_SWISS
+
 //now the initialisation of the hash table and also teh n must be the pwoer of 2
 static void h_init(HTab *htab,size_t n){
     assert(n>0 && ((n-1)&n)==0);
@@ -99,6 +101,15 @@ HNode *hm_delete(HMap *hmap,HNode *key,bool (* eq)(HNode *,HNode *)){
     return NULL;
 }
 
+void hm_reserve(HMap *hmap,size_t n){
+    if(hm_size(hmap) || hmap->older.tab) return;
+    size_t nbuckets = 4;
+    while(nbuckets*k_max_load_factor <= n) nbuckets *= 2;
+    if(hmap->newer.tab && hmap->newer.mask+1 >= nbuckets) return;
+    free(hmap->newer.tab);
+    h_init(&hmap->newer,nbuckets);
+}
+
 void hm_clear(HMap *hmap){
     free(hmap->older.tab);
     free(hmap->newer.tab);
@@ -120,4 +131,317 @@ static bool h_foreach(HTab *htab,bool (* f)(HNode *,void *),void *args){
 
 void hm_foreach(HMap *hmap,bool (* f)(HNode *,void *),void *args){
     h_foreach(&hmap->newer,f,args) &&h_foreach(&hmap->older,f,args);
-}
\ No newline at end of file
+}
+
+static uint64_t h_rev(uint64_t v){
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+//the buckets are visited in the order of the reversed bits of their index, so the buckets a bucket splits
+// into when the table doubles come right after each other and a cursor stays good across the sizes
+static uint64_t h_scan_next(uint64_t cursor,size_t mask){
+    cursor |= ~(uint64_t)mask;
+    return h_rev(h_rev(cursor)+1);
+}
+
+static size_t h_scan_bucket(HTab *htab,size_t pos,void (* f)(HNode *,void *),void *args){
+    size_t n = 0;
+    for(HNode *node = htab->tab[pos];node!= NULL;node=node->next,++n) f(node,args);
+    return n;
+}
+
+//a node is in the bucket of its hcode in either table, the rehashing moves it from older[b] to one
+// of the newer buckets which end with the bits of b
+uint64_t hm_scan(HMap *hmap,uint64_t cursor,size_t count,void (* f)(HNode *,void *),void *args){
+    if(!hmap->newer.tab) return 0;
+    size_t seen = 0,buckets = 0;
+    do{
+        if(!hmap->older.tab){
+            size_t m = hmap->newer.mask;
+            seen += h_scan_bucket(&hmap->newer,cursor & m,f,args);
+            buckets++;
+            cursor = h_scan_next(cursor,m);
+        }else{
+            //the bucket of the smaller older table, then the newer buckets it splits into
+            size_t m0 = hmap->older.mask,m1 = hmap->newer.mask;
+            seen += h_scan_bucket(&hmap->older,cursor & m0,f,args);
+            do{
+                seen += h_scan_bucket(&hmap->newer,cursor & m1,f,args);
+                buckets++;
+                cursor = h_scan_next(cursor,m1);
+            }while(cursor & (m0 ^ m1));
+        }
+        //a sparse table does not make a step long either
+    }while(cursor != 0 && seen < count && buckets < count*10);
+    return cursor;
+}
+
+#else   //USE_SWISS
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const size_t k_group = 16;          //control bytes probed at once
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;    //both special values have the top bit set, a full slot has it clear
+
+//the hcode may be a weak hash, spread it before taking the slot and the tag bits. The multiplier is not
+// the one the server picks the shard with, or the keys of a shard would all have their homes in one part
+static uint64_t h_mix(uint64_t hcode){
+    uint64_t h = hcode * 0xBF58476D1CE4E5B9ull;
+    return h ^ (h >> 29);
+}
+static uint8_t h_tag(uint64_t h){ return (uint8_t)(h & 0x7F); }
+
+//the home slot is the top bits of the hash, so the slots are in hash order and doubling the table
+// splits a slot into the two next to each other
+static uint32_t h_shift(const HTab *htab){ return (uint32_t)__builtin_clzll(htab->mask); }
+static size_t h_home(const HTab *htab,uint64_t h){ return (size_t)(h >> h_shift(htab)); }
+
+//bit i is set if ctrl[i] matches
+#ifdef __SSE2__
+static uint32_t g_match(const uint8_t *ctrl,uint8_t tag){
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g,_mm_set1_epi8((char)tag)));
+}
+//the empty and the deleted slots
+static uint32_t g_match_free(const uint8_t *ctrl){
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+static uint32_t g_match(const uint8_t *ctrl,uint8_t tag){
+    uint32_t bits = 0;
+    for(size_t i=0;i<k_group;++i) bits |= (uint32_t)(ctrl[i] == tag) << i;
+    return bits;
+}
+static uint32_t g_match_free(const uint8_t *ctrl){
+    uint32_t bits = 0;
+    for(size_t i=0;i<k_group;++i) bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    return bits;
+}
+#endif
+
+//n is the power of 2 and at least one group
+static void h_init(HTab *htab,size_t n){
+    assert(n>=k_group && ((n-1)&n)==0);
+    //one allocation, the slots do not need to be zeroed
+    uint8_t *mem = (uint8_t *)malloc(n*sizeof(HNode *) + n + k_group);
+    assert(mem);
+    htab->slots = (HNode **)mem;
+    htab->ctrl = mem + n*sizeof(HNode *);
+    memset(htab->ctrl,k_ctrl_empty,n + k_group);
+    htab->mask = n-1;
+    htab->size = 0;
+    htab->deleted = 0;
+}
+
+static void h_free(HTab *htab){
+    free(htab->slots);
+    *htab = HTab{};
+}
+
+//keep the copy of the first group in sync
+static void h_set_ctrl(HTab *htab,size_t i,uint8_t v){
+    htab->ctrl[i] = v;
+    htab->ctrl[((i - k_group) & htab->mask) + k_group] = v;
+}
+
+//7/8 of the slots, full or deleted, then it grows
+static size_t h_capacity(HTab *htab){
+    return htab->slots ? (htab->mask+1) - (htab->mask+1)/8 : 0;
+}
+
+//the caller makes sure there is a free slot
+static void h_insert(HTab *htab,HNode *node){
+    uint64_t h = h_mix(node->hcode);
+    size_t pos = h_home(htab,h);
+    //linear probing a group at a time, a node stays in the run of full slots from its home on
+    for(;;){
+        uint32_t free_bits = g_match_free(&htab->ctrl[pos]);
+        if(free_bits){
+            size_t i = (pos + __builtin_ctz(free_bits)) & htab->mask;
+            if(htab->ctrl[i] == k_ctrl_deleted) htab->deleted--;
+            h_set_ctrl(htab,i,h_tag(h));
+            htab->slots[i] = node;
+            htab->size++;
+            return;
+        }
+        pos = (pos + k_group) & htab->mask;
+    }
+}
+
+//the slot index or -1
+static size_t h_lookup(HTab *htab,HNode *key,bool (* eq)(HNode *,HNode *)){
+    if(!htab->slots) return (size_t)-1;
+    uint64_t h = h_mix(key->hcode);
+    uint8_t tag = h_tag(h);
+    size_t pos = h_home(htab,h);
+    for(;;){
+        const uint8_t *group = &htab->ctrl[pos];
+        for(uint32_t bits = g_match(group,tag);bits;bits &= bits-1){
+            size_t i = (pos + __builtin_ctz(bits)) & htab->mask;
+            HNode *cur = htab->slots[i];
+            if(cur->hcode == key->hcode && eq(cur,key)) return i;
+        }
+        //an empty slot ends the probe sequence
+        if(g_match(group,k_ctrl_empty)) return (size_t)-1;
+        pos = (pos + k_group) & htab->mask;
+    }
+}
+
+static HNode *h_detach(HTab *htab,size_t i){
+    HNode *node = htab->slots[i];
+    //a slot can go back to empty if no probe sequence ever saw a full group around it
+    size_t before = (i - k_group) & htab->mask;
+    uint32_t empty_after = g_match(&htab->ctrl[i],k_ctrl_empty);
+    uint32_t empty_before = g_match(&htab->ctrl[before],k_ctrl_empty);
+    bool was_never_full = empty_before && empty_after &&
+        (size_t)(__builtin_ctz(empty_after) + __builtin_clz(empty_before << 16)) < k_group;
+    if(was_never_full){
+        h_set_ctrl(htab,i,k_ctrl_empty);
+    }else{
+        h_set_ctrl(htab,i,k_ctrl_deleted);
+        htab->deleted++;
+    }
+    htab->size--;
+    return node;
+}
+
+const size_t k_rehashing_work = 128;    //the nodes moved per call
+const size_t k_rehashing_scan = 128*16; //the slots looked at per call, most are empty on a sparse table
+
+static void hm_help_rehashing(HMap *hmap){
+    size_t nwork = 0,nscan = 0;
+    while(nwork < k_rehashing_work && nscan < k_rehashing_scan && hmap->older.size>0){
+        size_t i = hmap->migrate_pos++;
+        nscan++;
+        if(hmap->older.ctrl[i] & 0x80) continue;    //empty or deleted
+        h_insert(&hmap->newer,hmap->older.slots[i]);
+        //the older table is never probed for inserts, it is enough to drop the slot
+        h_set_ctrl(&hmap->older,i,k_ctrl_deleted);
+        hmap->older.size--;
+        nwork++;
+    }
+    //discard the older table if done 
+    if(hmap->older.size==0 && hmap->older.slots) h_free(&hmap->older);
+}
+
+static void hm_trigger_rehashing(HMap *hmap){
+    //each insert migrates far more than it adds, so the last migration is long done
+    assert(hmap->older.slots == NULL);
+    hmap->older = hmap->newer;
+    //double unless it is mostly tombstones, then a table of the same size cleans them up
+    size_t n = hmap->older.mask+1;
+    if(hmap->older.size*2 >= n) n *= 2;
+    h_init(&hmap->newer,n);
+    hmap->migrate_pos = 0;
+}
+
+HNode *hm_lookup(HMap *hmap,HNode *key,bool (* eq)(HNode *,HNode *)){
+    hm_help_rehashing(hmap);
+    size_t i = h_lookup(&hmap->newer,key,eq);
+    if(i != (size_t)-1) return hmap->newer.slots[i];
+    i = h_lookup(&hmap->older,key,eq);
+    return i != (size_t)-1 ? hmap->older.slots[i] : NULL;
+}
+
+void hm_insert(HMap *hmap,HNode  *node){
+    if(!hmap->newer.slots) h_init(&hmap->newer,k_group);
+    if(hmap->newer.size + hmap->newer.deleted + 1 > h_capacity(&hmap->newer)) hm_trigger_rehashing(hmap);
+    h_insert(&hmap->newer,node);    // always insert the new node to the new table 
+    hm_help_rehashing(hmap); //migrate some keys
+}
+
+HNode *hm_delete(HMap *hmap,HNode *key,bool (* eq)(HNode *,HNode *)){
+    hm_help_rehashing(hmap);
+    size_t i = h_lookup(&hmap->newer,key,eq);
+    if(i != (size_t)-1) return h_detach(&hmap->newer,i);
+    i = h_lookup(&hmap->older,key,eq);
+    if(i != (size_t)-1) return h_detach(&hmap->older,i);
+    return NULL;
+}
+
+void hm_reserve(HMap *hmap,size_t n){
+    if(hm_size(hmap) || hmap->older.slots) return;
+    size_t nslots = k_group;
+    while(nslots - nslots/8 < n) nslots *= 2;
+    if(hmap->newer.slots && hmap->newer.mask+1 >= nslots) return;
+    h_free(&hmap->newer);
+    h_init(&hmap->newer,nslots);
+}
+
+void hm_clear(HMap *hmap){
+    h_free(&hmap->older);
+    h_free(&hmap->newer);
+    *hmap = HMap{};
+}
+
+size_t hm_size(HMap *hmap){
+    return hmap->newer.size + hmap->older.size;
+}
+
+static bool h_foreach(HTab *htab,bool (* f)(HNode *,void *),void *args){
+    for(size_t i=0;htab->slots && i<=htab->mask;++i){
+        if(htab->ctrl[i] & 0x80) continue;
+        if(!f(htab->slots[i],args)) return false;
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap,bool (* f)(HNode *,void *),void *args){
+    h_foreach(&hmap->newer,f,args) &&h_foreach(&hmap->older,f,args);
+}
+
+//the scan goes through the hash values in order and the cursor is the top k_hm_scan_bits of the next one.
+// A node is in the run of full slots which starts at its home and the homes are in hash order in every
+// table, so the nodes below the cursor stay below it whatever rehashes in between and none is seen twice
+static uint64_t h_scan_key(HNode *node){
+    return h_mix(node->hcode) >> (64 - k_hm_scan_bits);
+}
+
+//visit the nodes of htab with lo <= key < hi. They are in the slots from the home of lo up to the group
+// which holds the first empty slot from the home of hi-1 on, a probe never goes past that group
+static size_t h_scan_range(HTab *htab,uint64_t lo,uint64_t hi,void (* f)(HNode *,void *),void *args,size_t *nslots){
+    uint32_t shift = h_shift(htab) - (64 - k_hm_scan_bits);
+    size_t first = (size_t)(lo >> shift),last = (size_t)((hi-1) >> shift);
+    size_t seen = 0,end = (size_t)-1,i = first;
+    //a run can wrap around the end, it never takes more than the table
+    for(size_t n=0;n<=htab->mask && i<end;++n,++i){
+        size_t pos = i & htab->mask;
+        uint8_t c = htab->ctrl[pos];
+        if(c == k_ctrl_empty){
+            if(i >= last && end == (size_t)-1) end = i + k_group;
+            continue;
+        }
+        if(c & 0x80) continue;
+        uint64_t key = h_scan_key(htab->slots[pos]);
+        if(key >= lo && key < hi){
+            f(htab->slots[pos],args);
+            seen++;
+        }
+    }
+    *nslots += i - first;
+    return seen;
+}
+
+uint64_t hm_scan(HMap *hmap,uint64_t cursor,size_t count,void (* f)(HNode *,void *),void *args){
+    if(!hmap->newer.slots) return 0;
+    const uint64_t k_end = 1ull << k_hm_scan_bits;
+    //a step is the keys of a group of the newer table homes, the older table is never the larger one
+    uint64_t step = (uint64_t)k_group << (h_shift(&hmap->newer) - (64 - k_hm_scan_bits));
+    size_t seen = 0,slots = 0;
+    do{
+        uint64_t hi = (cursor | (step-1)) + 1;
+        if(hmap->older.slots) seen += h_scan_range(&hmap->older,cursor,hi,f,args,&slots);
+        seen += h_scan_range(&hmap->newer,cursor,hi,f,args,&slots);
+        cursor = hi;
+    }while(cursor < k_end && seen < count && slots < count*10);
+    return cursor < k_end ? cursor : 0;
+}
+
+#endif  //USE_SWISS
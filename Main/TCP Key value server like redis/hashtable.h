@@ -6,10 +6,23 @@
 
 //hastable node
 struct HNode{
+#ifndef USE_SWISS
     HNode *next = NULL;
+#endif
     uint64_t hcode = 0;
 };
 
+#ifdef USE_SWISS
+// an open addressing table, the slots are probed a group of 16 control bytes at a time
+//  ctrl[i] is k_ctrl_empty, k_ctrl_deleted or the low 7 bits of the hash of slots[i]
+struct HTab{
+    uint8_t *ctrl = NULL;   //mask+1 bytes and a copy of the first group so a group load never wraps
+    HNode **slots = NULL;
+    size_t mask = 0;
+    size_t size = 0;
+    size_t deleted = 0;     //the tombstones also use up the free slots
+};
+#else
 // a simple fixed size hashtable and it uses 2 hashtable for the look up 
 struct HTab{
     HNode **tab = NULL;
@@ -17,6 +30,7 @@ struct HTab{
     size_t size = 0;
 
 };
+#endif
 
 //the real hash map which consists of two hash trab;e for the look up and can do the prograssive rehahsing work 
 struct HMap{
@@ -25,11 +39,21 @@ struct HMap{
     size_t migrate_pos = 0;
 };
 
+//hm_scan() cursors fit in this many bits
+const uint32_t k_hm_scan_bits = 56;
+
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
+// size the table of an empty map for n nodes so they go in without a rehash, a map with nodes grows as usual
+void   hm_reserve(HMap *hmap, size_t n);
 size_t hm_size(HMap *hmap);
 // invoke the callback on each node until it returns false
 void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// invoke the callback on the nodes from the cursor on, about count of them, and return the cursor to go on
+// from. 0 starts a scan and is returned at the end. A node which is in the map for the whole scan is visited
+// at least once however the map grows and rehashes in between, and the cursor only moves forward so a scan
+// ends however busy the map is. f must not change the map
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, size_t count, void (*f)(HNode *, void *), void *arg);
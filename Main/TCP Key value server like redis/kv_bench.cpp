@@ -0,0 +1,426 @@
+// load generator for the server, it measures the throughput and the latency of pipelined requests
+//   g++ -std=gnu++17 -O2 -o kv_bench kv_bench.cpp kvclient.cpp buffer.cpp -lpthread
+//   ./kv_bench --conns 50 --pipeline 16 --requests 1000000 --mix get:80,set:20 --keys 100000 --dist zipf
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "kvclient.h"
+
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+//the command mix
+enum {
+    OP_GET, OP_SET, OP_DEL, OP_ZADD, OP_ZQUERY, OP_PEXPIRE, OP_INCR,
+    OP_COUNT,
+};
+static const char *k_op_names[OP_COUNT] = {"get","set","del","zadd","zquery","pexpire","incr"};
+
+const uint64_t k_zsets = 100;       //zadd and zquery spread over this many sorted sets
+
+struct Options{
+    uint16_t port = 1234;
+    size_t conns = 50;
+    size_t threads = 1;
+    size_t pipeline = 1;            //requests in flight per connection
+    uint64_t requests = 1000*1000;  //ignored when the duration is set
+    double duration = 0;            //seconds
+    uint32_t weights[OP_COUNT] = {80,20,0,0,0,0,0};
+    uint64_t keys = 100*1000;
+    bool zipf = false;
+    double zipf_theta = 0.99;
+    size_t value_size = 16;
+    bool preload = false;           //set every key before the run
+    bool json = false;
+};
+
+//a log linear histogram, 64 sub buckets per power of 2 keep the error under 1.6%
+const uint32_t k_sub_bits = 6;
+const uint32_t k_sub = 1u << k_sub_bits;
+const size_t k_hist_size = (64-k_sub_bits+1)*k_sub;
+
+struct Histogram{
+    std::vector<uint64_t> counts = std::vector<uint64_t>(k_hist_size);
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+static size_t hist_index(uint64_t v){
+    if(v < k_sub) return (size_t)v;
+    uint32_t e = 63-__builtin_clzll(v);     //e >= k_sub_bits
+    return (size_t)(e-k_sub_bits+1)*k_sub + ((v >> (e-k_sub_bits)) & (k_sub-1));
+}
+
+//the lowest value of the bucket
+static uint64_t hist_value(size_t idx){
+    if(idx < k_sub) return idx;
+    uint32_t e = (uint32_t)(idx/k_sub) + k_sub_bits - 1;
+    return (k_sub + idx%k_sub) << (e-k_sub_bits);
+}
+
+static void hist_add(Histogram &h,uint64_t v){
+    h.counts[hist_index(v)]++;
+    h.total++;
+    if(v > h.max) h.max = v;
+}
+
+static void hist_merge(Histogram &dst,const Histogram &src){
+    for(size_t i=0;i<k_hist_size;++i) dst.counts[i] += src.counts[i];
+    dst.total += src.total;
+    if(src.max > dst.max) dst.max = src.max;
+}
+
+static uint64_t hist_percentile(const Histogram &h,double p){
+    if(!h.total) return 0;
+    uint64_t rank = (uint64_t)ceil(p/100*h.total);
+    if(rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for(size_t i=0;i<k_hist_size;++i){
+        seen += h.counts[i];
+        if(seen >= rank) return hist_value(i) < h.max ? hist_value(i) : h.max;
+    }
+    return h.max;
+}
+
+//xorshift64*, one per thread
+static uint64_t rng_next(uint64_t &s){
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 0x2545F4914F6CDD1Dull;
+}
+static double rng_double(uint64_t &s){
+    return (rng_next(s) >> 11) * (1.0/9007199254740992.0);
+}
+
+//the zipfian generator of Gray et al. "Quickly generating billion-record synthetic databases", also used by YCSB
+struct Zipf{
+    uint64_t n = 0;
+    double theta = 0,alpha = 0,zetan = 0,eta = 0;
+};
+
+static void zipf_init(Zipf &z,uint64_t n,double theta){
+    z.n = n;
+    z.theta = theta;
+    z.zetan = 0;
+    for(uint64_t i=1;i<=n;++i) z.zetan += 1.0/pow((double)i,theta);
+    double zeta2 = 1.0 + 1.0/pow(2.0,theta);
+    z.alpha = 1.0/(1.0-theta);
+    z.eta = (1.0-pow(2.0/n,1.0-theta)) / (1.0-zeta2/z.zetan);
+}
+
+//0 is the most popular key
+static uint64_t zipf_next(const Zipf &z,double u){
+    double uz = u*z.zetan;
+    if(uz < 1.0) return 0;
+    if(uz < 1.0+pow(0.5,z.theta)) return 1;
+    uint64_t v = (uint64_t)(z.n * pow(z.eta*u - z.eta + 1.0,z.alpha));
+    return v < z.n ? v : z.n-1;
+}
+
+struct Worker;
+
+//a connection of a worker with the state of its pipeline
+struct BenchConn{
+    Worker *w = NULL;
+    KVConn *conn = NULL;
+};
+
+struct Worker{
+    const Options *opt = NULL;
+    const Zipf *zipf = NULL;
+    uint64_t rng = 0;
+    uint64_t quota = 0;         //the requests this worker sends, UINT64_MAX with a duration
+    uint64_t deadline_ns = 0;   //0 without a duration
+    uint64_t sent = 0;
+    uint64_t done = 0;
+    uint64_t errors = 0;        //KV_ERR replies from the server
+    bool failed = false;        //an I/O error, the run is aborted
+    uint32_t weight_sum = 0;
+    std::string value;
+    KVPool pool;
+    std::vector<BenchConn> conns;
+    Histogram hist[OP_COUNT];
+};
+
+static uint64_t pick_key(Worker &w){
+    if(w.opt->zipf) return zipf_next(*w.zipf,rng_double(w.rng));
+    return rng_next(w.rng) % w.opt->keys;
+}
+
+static uint32_t pick_op(Worker &w){
+    uint32_t r = (uint32_t)(rng_next(w.rng) % w.weight_sum);
+    for(uint32_t op=0;op<OP_COUNT;++op){
+        if(r < w.opt->weights[op]) return op;
+        r -= w.opt->weights[op];
+    }
+    return OP_GET;
+}
+
+static bool worker_should_send(Worker &w){
+    if(w.failed || w.sent >= w.quota) return false;
+    return !w.deadline_ns || get_monotonic_nsec() < w.deadline_ns;
+}
+
+//send one random request, its callback sends the next one so the pipeline depth stays the same
+static void issue(BenchConn *bc){
+    Worker &w = *bc->w;
+    uint32_t op = pick_op(w);
+    uint64_t key = pick_key(w);
+    //the request is encoded by kv_send(), the views only have to live until then
+    char kbuf[32],abuf[32],bbuf[32];
+    std::vector<std::string_view> args;
+    args.push_back(k_op_names[op]);
+    switch(op){
+    case OP_GET:
+    case OP_DEL:
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"key:%llu",(unsigned long long)key)));
+        break;
+    case OP_SET:
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"key:%llu",(unsigned long long)key)));
+        args.push_back(w.value);
+        break;
+    case OP_PEXPIRE:
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"key:%llu",(unsigned long long)key)));
+        args.push_back(std::string_view(abuf,snprintf(abuf,sizeof(abuf),"%llu",(unsigned long long)(60*1000 + rng_next(w.rng)%60000))));
+        break;
+    case OP_ZADD:
+        //zadd zset score name
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"zset:%llu",(unsigned long long)(key%k_zsets))));
+        args.push_back(std::string_view(abuf,snprintf(abuf,sizeof(abuf),"%llu",(unsigned long long)(rng_next(w.rng)%1000000))));
+        args.push_back(std::string_view(bbuf,snprintf(bbuf,sizeof(bbuf),"m:%llu",(unsigned long long)key)));
+        break;
+    case OP_ZQUERY:
+        //zquery zset score name offset limit
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"zset:%llu",(unsigned long long)(key%k_zsets))));
+        args.push_back(std::string_view(abuf,snprintf(abuf,sizeof(abuf),"%llu",(unsigned long long)(rng_next(w.rng)%1000000))));
+        args.push_back("");
+        args.push_back("0");
+        args.push_back("10");
+        break;
+    case OP_INCR:
+        //the counters have keys of their own, a SET value is not always an integer
+        args.push_back(std::string_view(kbuf,snprintf(kbuf,sizeof(kbuf),"ctr:%llu",(unsigned long long)key)));
+        break;
+    }
+    w.sent++;
+    uint64_t start = get_monotonic_nsec();
+    kv_send(bc->conn,args,[bc,op,start](KVValue &val){
+        Worker &w = *bc->w;
+        if(val.tag == KV_ERR && val.code == KV_ERR_IO){
+            if(!w.failed) fprintf(stderr,"connection error: %s\n",val.str.c_str());
+            w.failed = true;    //no new request, kv_send() would call back right away
+            return;
+        }
+        hist_add(w.hist[op],get_monotonic_nsec()-start);
+        w.done++;
+        if(val.tag == KV_ERR) w.errors++;
+        if(worker_should_send(w)) issue(bc);
+    });
+}
+
+static void worker_run(Worker *w){
+    for(BenchConn &bc : w->conns){
+        for(size_t i=0;i<w->opt->pipeline && worker_should_send(*w);++i) issue(&bc);
+    }
+    while(!w->failed && w->done < w->sent){
+        if(kv_pool_poll(&w->pool,100)<0) w->failed = true;
+        for(KVConn *conn : w->pool.conns){
+            if(conn->broken) w->failed = true;
+        }
+    }
+}
+
+//pipelined SET of the whole key space so the GETs hit
+static bool preload(const Options &opt){
+    KVConn *conn = kv_connect("127.0.0.1",opt.port,1000);
+    if(!conn) return false;
+    std::string value(opt.value_size,'x');
+    const uint64_t k_batch = 10000;
+    char kbuf[32];
+    for(uint64_t i=0;i<opt.keys;++i){
+        std::string_view key(kbuf,snprintf(kbuf,sizeof(kbuf),"key:%llu",(unsigned long long)i));
+        kv_send(conn,{"set",key,value},[](KVValue &){});
+        if((i+1)%k_batch == 0 && kv_wait_all(conn,10*1000)<0) break;
+    }
+    bool ok = kv_wait_all(conn,10*1000) == 0;
+    kv_close(conn);
+    return ok;
+}
+
+static bool parse_mix(const char *s,Options &opt){
+    for(uint32_t op=0;op<OP_COUNT;++op) opt.weights[op] = 0;
+    std::string mix = s;
+    size_t pos = 0;
+    while(pos < mix.size()){
+        size_t end = mix.find(',',pos);
+        if(end == std::string::npos) end = mix.size();
+        std::string item = mix.substr(pos,end-pos);
+        size_t colon = item.find(':');
+        if(colon == std::string::npos) return false;
+        std::string name = item.substr(0,colon);
+        uint32_t op = 0;
+        while(op<OP_COUNT && name != k_op_names[op]) ++op;
+        if(op == OP_COUNT) return false;
+        opt.weights[op] = (uint32_t)atoi(item.c_str()+colon+1);
+        pos = end+1;
+    }
+    uint32_t sum = 0;
+    for(uint32_t op=0;op<OP_COUNT;++op) sum += opt.weights[op];
+    return sum > 0;
+}
+
+static void usage(){
+    fprintf(stderr,
+        "usage: kv_bench [options]\n"
+        "  --port N          server port on 127.0.0.1 (1234)\n"
+        "  --conns N         concurrent connections (50)\n"
+        "  --threads N       client threads, the connections are split between them (1)\n"
+        "  --pipeline N      requests in flight per connection (1)\n"
+        "  --requests N      total requests (1000000)\n"
+        "  --duration S      run for S seconds instead of a request count\n"
+        "  --mix LIST        command weights, e.g. get:80,set:20 (get set del zadd zquery pexpire incr)\n"
+        "  --keys N          key space size (100000)\n"
+        "  --dist D          uniform or zipf (uniform)\n"
+        "  --zipf-theta T    skew of the zipf distribution, 0 < T < 1 (0.99)\n"
+        "  --value-size N    bytes per SET value (16)\n"
+        "  --preload         SET every key before the run\n"
+        "  --json            print the report as JSON\n");
+    exit(2);
+}
+
+static bool parse_args(int argc,char **argv,Options &opt){
+    for(int i=1;i<argc;++i){
+        const char *a = argv[i];
+        const char *v = i+1<argc ? argv[i+1] : NULL;
+        bool has_val = true;
+        if(!strcmp(a,"--preload")){ opt.preload = true; has_val = false; }
+        else if(!strcmp(a,"--json")){ opt.json = true; has_val = false; }
+        else if(!v) return false;
+        else if(!strcmp(a,"--port")) opt.port = (uint16_t)atoi(v);
+        else if(!strcmp(a,"--conns")) opt.conns = strtoull(v,NULL,10);
+        else if(!strcmp(a,"--threads")) opt.threads = strtoull(v,NULL,10);
+        else if(!strcmp(a,"--pipeline")) opt.pipeline = strtoull(v,NULL,10);
+        else if(!strcmp(a,"--requests")) opt.requests = strtoull(v,NULL,10);
+        else if(!strcmp(a,"--duration")) opt.duration = atof(v);
+        else if(!strcmp(a,"--mix")){ if(!parse_mix(v,opt)) return false; }
+        else if(!strcmp(a,"--keys")) opt.keys = strtoull(v,NULL,10);
+        else if(!strcmp(a,"--dist")){
+            if(!strcmp(v,"zipf")) opt.zipf = true;
+            else if(!strcmp(v,"uniform")) opt.zipf = false;
+            else return false;
+        }
+        else if(!strcmp(a,"--zipf-theta")) opt.zipf_theta = atof(v);
+        else if(!strcmp(a,"--value-size")) opt.value_size = strtoull(v,NULL,10);
+        else return false;
+        if(has_val) ++i;
+    }
+    if(!opt.conns || !opt.threads || !opt.pipeline || !opt.keys) return false;
+    if(opt.zipf_theta <= 0 || opt.zipf_theta >= 1) return false;
+    if(opt.threads > opt.conns) opt.threads = opt.conns;
+    return true;
+}
+
+static void report(const Options &opt,const Histogram *hist,uint64_t done,uint64_t errors,double secs){
+    Histogram all;
+    for(uint32_t op=0;op<OP_COUNT;++op) hist_merge(all,hist[op]);
+    double ops = secs > 0 ? done/secs : 0;
+    //the latencies are in microseconds
+    auto us = [](uint64_t ns){ return ns/1000.0; };
+    if(opt.json){
+        printf("{\"conns\":%zu,\"threads\":%zu,\"pipeline\":%zu,\"keys\":%llu,\"dist\":\"%s\",\"value_size\":%zu,",
+            opt.conns,opt.threads,opt.pipeline,(unsigned long long)opt.keys,opt.zipf ? "zipf" : "uniform",opt.value_size);
+        printf("\"requests\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,",
+            (unsigned long long)done,(unsigned long long)errors,secs,ops);
+        printf("\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f,\"max\":%.1f},\"commands\":{",
+            us(hist_percentile(all,50)),us(hist_percentile(all,99)),us(hist_percentile(all,99.9)),us(all.max));
+        bool first = true;
+        for(uint32_t op=0;op<OP_COUNT;++op){
+            const Histogram &h = hist[op];
+            if(!h.total) continue;
+            printf("%s\"%s\":{\"requests\":%llu,\"p50\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f,\"max\":%.1f}",first ? "" : ",",
+                k_op_names[op],(unsigned long long)h.total,us(hist_percentile(h,50)),us(hist_percentile(h,99)),
+                us(hist_percentile(h,99.9)),us(h.max));
+            first = false;
+        }
+        printf("}}\n");
+        return;
+    }
+    printf("connections %zu, threads %zu, pipeline %zu, keys %llu (%s), value %zu bytes\n",
+        opt.conns,opt.threads,opt.pipeline,(unsigned long long)opt.keys,opt.zipf ? "zipf" : "uniform",opt.value_size);
+    printf("%llu requests in %.3f s, %llu errors\n",(unsigned long long)done,secs,(unsigned long long)errors);
+    printf("throughput: %.0f ops/sec\n",ops);
+    printf("%-10s %12s %10s %10s %10s %10s\n","latency us","requests","p50","p99","p99.9","max");
+    for(uint32_t op=0;op<OP_COUNT;++op){
+        const Histogram &h = hist[op];
+        if(!h.total) continue;
+        printf("%-10s %12llu %10.1f %10.1f %10.1f %10.1f\n",k_op_names[op],(unsigned long long)h.total,
+            us(hist_percentile(h,50)),us(hist_percentile(h,99)),us(hist_percentile(h,99.9)),us(h.max));
+    }
+    printf("%-10s %12llu %10.1f %10.1f %10.1f %10.1f\n","all",(unsigned long long)all.total,
+        us(hist_percentile(all,50)),us(hist_percentile(all,99)),us(hist_percentile(all,99.9)),us(all.max));
+}
+
+int main(int argc,char **argv){
+    Options opt;
+    if(!parse_args(argc,argv,opt)) usage();
+
+    if(opt.preload && !preload(opt)){
+        fprintf(stderr,"preload failed\n");
+        return 1;
+    }
+    Zipf zipf;
+    if(opt.zipf) zipf_init(zipf,opt.keys,opt.zipf_theta);
+
+    std::vector<Worker> workers(opt.threads);
+    for(size_t t=0;t<opt.threads;++t){
+        Worker &w = workers[t];
+        w.opt = &opt;
+        w.zipf = &zipf;
+        w.rng = 0x9E3779B97F4A7C15ull * (t+1);
+        w.value.assign(opt.value_size,'x');
+        for(uint32_t op=0;op<OP_COUNT;++op) w.weight_sum += opt.weights[op];
+        //split the connections and the requests evenly
+        size_t nconn = opt.conns/opt.threads + (t < opt.conns%opt.threads ? 1 : 0);
+        w.quota = opt.duration > 0 ? UINT64_MAX : opt.requests/opt.threads + (t < opt.requests%opt.threads ? 1 : 0);
+        if(!kv_pool_init(&w.pool,"127.0.0.1",opt.port,nconn,1000)){
+            fprintf(stderr,"cannot connect to 127.0.0.1:%u\n",opt.port);
+            return 1;
+        }
+        w.conns.resize(nconn);
+        for(size_t i=0;i<nconn;++i) w.conns[i] = BenchConn{&w,w.pool.conns[i]};
+    }
+
+    uint64_t start = get_monotonic_nsec();
+    for(Worker &w : workers){
+        if(opt.duration > 0) w.deadline_ns = start + (uint64_t)(opt.duration*1e9);
+    }
+    std::vector<std::thread> threads;
+    for(Worker &w : workers) threads.emplace_back(worker_run,&w);
+    for(std::thread &th : threads) th.join();
+    double secs = (get_monotonic_nsec()-start)/1e9;
+
+    Histogram hist[OP_COUNT];
+    uint64_t done = 0,errors = 0;
+    bool failed = false;
+    for(Worker &w : workers){
+        for(uint32_t op=0;op<OP_COUNT;++op) hist_merge(hist[op],w.hist[op]);
+        done += w.done;
+        errors += w.errors;
+        failed = failed || w.failed;
+        kv_pool_close(&w.pool);
+    }
+    report(opt,hist,done,errors,secs);
+    return failed ? 1 : 0;
+}
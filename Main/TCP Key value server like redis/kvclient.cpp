@@ -0,0 +1,364 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <memory>
+#include <utility>
+#include "kvclient.h"
+
+const size_t k_max_msg = 32<<20;    //the same limit as the server
+const size_t k_read_size = 64*1024;
+const int k_max_depth = 64;         //the nesting of the arrays in a response
+
+static uint64_t get_monotonic_msec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000 + tv.tv_nsec/1000/1000;
+}
+
+static KVValue kv_error(uint32_t code,const char *msg){
+    KVValue val;
+    val.tag = KV_ERR;
+    val.code = code;
+    val.str = msg;
+    return val;
+}
+
+//a broken connection fails everything in flight, the responses could not be matched anymore
+static void kv_fail(KVConn *conn,const char *msg){
+    conn->broken = true;
+    buf_clear(conn->outgoing);
+    buf_clear(conn->incoming);
+    std::deque<kv_callback> inflight;
+    inflight.swap(conn->inflight);   //the callbacks may send new requests
+    for(kv_callback &cb : inflight){
+        KVValue err = kv_error(KV_ERR_IO,msg);
+        cb(err);
+    }
+}
+
+KVConn *kv_connect(const char *host,uint16_t port,int timeout_ms){
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET,host,&addr.sin_addr) != 1) return NULL;
+
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+    if(fd<0) return NULL;
+    int val = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&val,sizeof(val));   //the pipelining does the batching
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0) | O_NONBLOCK);
+
+    int rv = connect(fd,(const struct sockaddr *)&addr,sizeof(addr));
+    if(rv<0 && errno == EINPROGRESS){
+        struct pollfd pfd = {fd,POLLOUT,0};
+        rv = poll(&pfd,1,timeout_ms);
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(rv == 1 && getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len) == 0 && err == 0) rv = 0;
+        else rv = -1;
+    }
+    if(rv<0){
+        close(fd);
+        return NULL;
+    }
+    KVConn *conn = new KVConn();
+    conn->fd = fd;
+    return conn;
+}
+
+void kv_close(KVConn *conn){
+    if(!conn) return;
+    kv_fail(conn,"connection closed");
+    if(conn->fd>=0) close(conn->fd);
+    delete conn;
+}
+
+void kv_send(KVConn *conn,const std::vector<std::string_view> &args,kv_callback cb){
+    if(conn->broken){
+        KVValue err = kv_error(KV_ERR_IO,"connection is broken");
+        return cb(err);
+    }
+    size_t len = 4;
+    for(std::string_view arg : args) len += 4+arg.size();
+    if(len > k_max_msg){
+        KVValue err = kv_error(KV_ERR_IO,"request too big");
+        return cb(err);
+    }
+    //[len][nstr][len][str][len][str]...
+    uint8_t *p = buf_prepare(conn->outgoing,4+len);
+    uint32_t u32 = (uint32_t)len;
+    memcpy(p,&u32,4);
+    u32 = (uint32_t)args.size();
+    memcpy(p+4,&u32,4);
+    p += 8;
+    for(std::string_view arg : args){
+        u32 = (uint32_t)arg.size();
+        memcpy(p,&u32,4);
+        memcpy(p+4,arg.data(),arg.size());
+        p += 4+arg.size();
+    }
+    buf_commit(conn->outgoing,4+len);
+    conn->inflight.push_back(std::move(cb));
+}
+
+std::future<KVValue> kv_send_future(KVConn *conn,const std::vector<std::string_view> &args){
+    //std::function needs a copyable callable
+    std::shared_ptr<std::promise<KVValue>> promise = std::make_shared<std::promise<KVValue>>();
+    std::future<KVValue> future = promise->get_future();
+    kv_send(conn,args,[promise](KVValue &val){ promise->set_value(std::move(val)); });
+    return future;
+}
+
+int kv_flush(KVConn *conn){
+    if(conn->broken) return -1;
+    while(buf_size(conn->outgoing)>0){
+        ssize_t rv = send(conn->fd,buf_data(conn->outgoing),buf_size(conn->outgoing),MSG_NOSIGNAL);
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<0 && errno == EAGAIN) break;
+        if(rv<0){
+            kv_fail(conn,strerror(errno));
+            return -1;
+        }
+        buf_consume(conn->outgoing,(size_t)rv);
+    }
+    return 0;
+}
+
+static bool read_u32(const uint8_t *&cur,const uint8_t *end,uint32_t &out){
+    if(end-cur < 4) return false;
+    memcpy(&out,cur,4);
+    cur += 4;
+    return true;
+}
+
+static bool kv_decode(const uint8_t *&cur,const uint8_t *end,KVValue &out,int depth){
+    if(cur == end || depth > k_max_depth) return false;
+    out.tag = *cur++;
+    uint32_t len = 0;
+    switch(out.tag){
+    case KV_NIL:
+        return true;
+    case KV_ERR:
+        if(!read_u32(cur,end,out.code)) return false;
+        //the message is encoded like a string
+        [[fallthrough]];
+    case KV_STR:
+        if(!read_u32(cur,end,len) || (size_t)(end-cur) < len) return false;
+        out.str.assign((const char *)cur,len);
+        cur += len;
+        return true;
+    case KV_INT:
+        if(end-cur < 8) return false;
+        memcpy(&out.ival,cur,8);
+        cur += 8;
+        return true;
+    case KV_DBL:
+        if(end-cur < 8) return false;
+        memcpy(&out.dval,cur,8);
+        cur += 8;
+        return true;
+    case KV_ARR:
+        if(!read_u32(cur,end,len)) return false;
+        if((size_t)(end-cur) < len) return false;   //each element is at least 1 byte
+        out.arr.resize(len);
+        for(uint32_t i=0;i<len;++i){
+            if(!kv_decode(cur,end,out.arr[i],depth+1)) return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+//decode the complete responses in the read buffer
+static int kv_process_responses(KVConn *conn){
+    int n = 0;
+    while(!conn->broken && buf_size(conn->incoming)>=4){
+        uint32_t len = 0;
+        memcpy(&len,buf_data(conn->incoming),4);
+        if(len > k_max_msg){
+            kv_fail(conn,"response too big");
+            return -1;
+        }
+        if(4+(size_t)len > buf_size(conn->incoming)) break;
+
+        KVValue val;
+        const uint8_t *cur = buf_data(conn->incoming)+4;
+        const uint8_t *end = cur+len;
+        if(conn->inflight.empty() || !kv_decode(cur,end,val,0) || cur != end){
+            kv_fail(conn,"bad response");
+            return -1;
+        }
+        buf_consume(conn->incoming,4+len);
+        kv_callback cb = std::move(conn->inflight.front());
+        conn->inflight.pop_front();
+        cb(val);
+        n++;
+    }
+    return conn->broken ? -1 : n;
+}
+
+//read until the socket is drained
+static int kv_read(KVConn *conn){
+    while(true){
+        uint8_t *p = buf_prepare(conn->incoming,k_read_size);
+        ssize_t rv = read(conn->fd,p,k_read_size);
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<0 && errno == EAGAIN) break;
+        if(rv<0){
+            kv_fail(conn,strerror(errno));
+            return -1;
+        }
+        if(rv == 0){
+            kv_fail(conn,"connection closed by the server");
+            return -1;
+        }
+        buf_commit(conn->incoming,(size_t)rv);
+        if((size_t)rv < k_read_size) break;
+    }
+    return kv_process_responses(conn);
+}
+
+static short kv_poll_events(KVConn *conn){
+    short events = 0;
+    if(!conn->inflight.empty()) events |= POLLIN;
+    if(buf_size(conn->outgoing)>0) events |= POLLOUT;
+    return events;
+}
+
+//the work after poll() returned
+static int kv_handle_events(KVConn *conn,short revents){
+    if(revents & POLLOUT){
+        if(kv_flush(conn)<0) return -1;
+    }
+    if(revents & (POLLIN | POLLERR | POLLHUP)) return kv_read(conn);
+    return 0;
+}
+
+int kv_poll(KVConn *conn,int timeout_ms){
+    //most of the time the socket takes the whole batch without waiting
+    if(kv_flush(conn)<0) return -1;
+    struct pollfd pfd = {conn->fd,kv_poll_events(conn),0};
+    if(!pfd.events) return 0;
+    int rv = poll(&pfd,1,timeout_ms);
+    if(rv<0 && errno != EINTR){
+        kv_fail(conn,strerror(errno));
+        return -1;
+    }
+    if(rv<=0) return 0;
+    return kv_handle_events(conn,pfd.revents);
+}
+
+//the time left until the deadline, -1 for no deadline
+static int kv_time_left(uint64_t deadline,int timeout_ms){
+    if(timeout_ms<0) return -1;
+    uint64_t now = get_monotonic_msec();
+    return now >= deadline ? 0 : (int)(deadline-now);
+}
+
+int kv_wait_all(KVConn *conn,int timeout_ms){
+    uint64_t deadline = get_monotonic_msec() + (timeout_ms<0 ? 0 : timeout_ms);
+    while(!conn->inflight.empty()){
+        if(conn->broken) return -1;
+        int left = kv_time_left(deadline,timeout_ms);
+        if(left == 0){
+            kv_fail(conn,"timed out");
+            return -1;
+        }
+        if(kv_poll(conn,left)<0) return -1;
+    }
+    return conn->broken ? -1 : 0;
+}
+
+KVValue kv_call(KVConn *conn,const std::vector<std::string_view> &args,int timeout_ms){
+    KVValue out;
+    bool done = false;
+    kv_send(conn,args,[&](KVValue &val){
+        out = std::move(val);
+        done = true;
+    });
+    //a timeout fails the connection, so the callback always runs before this returns
+    uint64_t deadline = get_monotonic_msec() + (timeout_ms<0 ? 0 : timeout_ms);
+    while(!done){
+        int left = kv_time_left(deadline,timeout_ms);
+        if(left == 0) kv_fail(conn,"timed out");
+        else kv_poll(conn,left);
+    }
+    return out;
+}
+
+bool kv_pool_init(KVPool *pool,const char *host,uint16_t port,size_t n,int timeout_ms){
+    for(size_t i=0;i<n;++i){
+        KVConn *conn = kv_connect(host,port,timeout_ms);
+        if(!conn){
+            kv_pool_close(pool);
+            return false;
+        }
+        pool->conns.push_back(conn);
+    }
+    return true;
+}
+
+void kv_pool_close(KVPool *pool){
+    for(KVConn *conn : pool->conns) kv_close(conn);
+    pool->conns.clear();
+}
+
+KVConn *kv_pool_get(KVPool *pool){
+    assert(!pool->conns.empty());
+    KVConn *best = NULL;
+    for(KVConn *conn : pool->conns){
+        if(conn->broken) continue;
+        if(!best || conn->inflight.size() < best->inflight.size()) best = conn;
+    }
+    //every connection is broken, the request fails through its callback
+    return best ? best : pool->conns[0];
+}
+
+int kv_pool_poll(KVPool *pool,int timeout_ms){
+    std::vector<struct pollfd> pfds;
+    std::vector<KVConn *> ready;
+    for(KVConn *conn : pool->conns){
+        if(kv_flush(conn)<0) continue;
+        short events = kv_poll_events(conn);
+        if(!events) continue;
+        pfds.push_back({conn->fd,events,0});
+        ready.push_back(conn);
+    }
+    if(pfds.empty()) return 0;
+    int rv = poll(pfds.data(),(nfds_t)pfds.size(),timeout_ms);
+    if(rv<0 && errno != EINTR) return -1;
+    int n = 0;
+    for(size_t i=0;rv>0 && i<pfds.size();++i){
+        if(!pfds[i].revents) continue;
+        int handled = kv_handle_events(ready[i],pfds[i].revents);
+        if(handled>0) n += handled;
+    }
+    return n;
+}
+
+int kv_pool_wait_all(KVPool *pool,int timeout_ms){
+    uint64_t deadline = get_monotonic_msec() + (timeout_ms<0 ? 0 : timeout_ms);
+    while(true){
+        bool busy = false,broken = false;
+        for(KVConn *conn : pool->conns){
+            broken = broken || conn->broken;
+            busy = busy || !conn->inflight.empty();
+        }
+        if(!busy) return broken ? -1 : 0;
+        int left = kv_time_left(deadline,timeout_ms);
+        if(left == 0){
+            for(KVConn *conn : pool->conns) kv_fail(conn,"timed out");
+            return -1;
+        }
+        if(kv_pool_poll(pool,left)<0) return -1;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "buffer.h"
+
+//the response tags of the protocol, the same values as in server.cpp
+enum {
+    KV_NIL = 0,
+    KV_ERR = 1,
+    KV_STR = 2,
+    KV_INT = 3,
+    KV_DBL = 4,
+    KV_ARR = 5,
+};
+
+//the error code of the failures on the client side, the server codes are small numbers
+const uint32_t KV_ERR_IO = 1000;
+
+//a decoded response
+struct KVValue{
+    uint32_t tag = KV_NIL;
+    uint32_t code = 0;          //KV_ERR
+    std::string str;            //KV_STR, the message of KV_ERR
+    int64_t ival = 0;           //KV_INT
+    double dval = 0;            //KV_DBL
+    std::vector<KVValue> arr;   //KV_ARR
+};
+
+typedef std::function<void(KVValue &)> kv_callback;
+
+//one connection, the requests are pipelined and the responses come back in the same order
+struct KVConn{
+    int fd = -1;
+    bool broken = false;                //an I/O or protocol error, every later request fails
+    Buffer outgoing;                    //the encoded requests which are not written yet
+    Buffer incoming;                    //the response bytes which are not decoded yet
+    std::deque<kv_callback> inflight;   //one per request which has no response yet
+};
+
+//a non blocking socket connected to host:port, NULL on failure or after the timeout
+KVConn *kv_connect(const char *host,uint16_t port,int timeout_ms);
+//the callbacks of the requests in flight get a KV_ERR_IO error
+void kv_close(KVConn *conn);
+
+//encode a request into the write buffer, nothing is sent until kv_flush() or kv_poll()
+void kv_send(KVConn *conn,const std::vector<std::string_view> &args,kv_callback cb);
+//the future is ready once kv_poll() has read the response
+std::future<KVValue> kv_send_future(KVConn *conn,const std::vector<std::string_view> &args);
+
+//write as much as the socket takes, -1 if the connection is broken
+int kv_flush(KVConn *conn);
+//wait up to timeout_ms for the socket, then write the pending requests and run the callbacks of the responses
+//-1 if the connection is broken, otherwise the number of responses handled
+int kv_poll(KVConn *conn,int timeout_ms);
+//poll until nothing is in flight, -1 on error or timeout
+int kv_wait_all(KVConn *conn,int timeout_ms);
+
+//send one request and wait for its response, errors are returned as KV_ERR_IO values
+KVValue kv_call(KVConn *conn,const std::vector<std::string_view> &args,int timeout_ms);
+
+//a fixed set of connections to the same server, the requests go to the least loaded one
+struct KVPool{
+    std::vector<KVConn *> conns;
+};
+
+//false if any of the connections failed
+bool kv_pool_init(KVPool *pool,const char *host,uint16_t port,size_t n,int timeout_ms);
+void kv_pool_close(KVPool *pool);
+KVConn *kv_pool_get(KVPool *pool);
+//one poll() over all the connections, the broken ones are skipped since their requests already failed
+int kv_pool_poll(KVPool *pool,int timeout_ms);
+//-1 on timeout or if any connection is broken
+int kv_pool_wait_all(KVPool *pool,int timeout_ms);
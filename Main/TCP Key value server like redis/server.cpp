@@ -3,28 +3,55 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>    // strncasecmp
 #include <stdio.h>
 #include <errno.h>
 #include <math.h>   // isnan
+#include <malloc.h> // malloc_usable_size
 // system
 #include <time.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
+#ifndef USE_POLL
+#include <sys/epoll.h>
+#endif
+#ifdef USE_URING
+#include "uring.h"
+#endif
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
 // C++
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include <new>
 //this are teh predefined headers
 #include "common.h"
 #include "avl.h"
 #include "hashtable.h"
 #include "zset.h"
 #include "list.h"
+#ifdef USE_TTL_HEAP
 #include "heap.h"
+#else
+#include "twheel.h"
+#endif
 #include "threads.h"
+#include "spsc.h"
+#include "buffer.h"
+#include "slab.h"
+#include "dump.h"
 
 static void msg(const char *s){
     fprintf(stderr," %s \n",s);
@@ -45,6 +72,19 @@ static uint64_t get_monotonic_msec(){
     return uint64_t(tv.tv_sec) *1000 + tv.tv_nsec/1000 /1000;
 }
 
+static uint64_t get_monotonic_nsec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC,&tv);
+    return uint64_t(tv.tv_sec)*1000*1000*1000 + tv.tv_nsec;
+}
+
+//the wall clock, only for what outlives the process like the TTLs in a dump file
+static uint64_t get_realtime_msec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_REALTIME,&tv);
+    return uint64_t(tv.tv_sec)*1000 + tv.tv_nsec/1000/1000;
+}
+
 //sets the connection file discriptor to the non blocking mode
 
 static void fd_set_nb(int fd){
@@ -67,17 +107,6 @@ static void fd_set_nb(int fd){
 
 const size_t k_max_msg = 32<<20; //this is the buffer and it is likely larger than the kernel buffer
 
-using Buffer = std::vector<uint8_t>;
-//append to the back 
-static void buf_append(Buffer &buf,const uint8_t *data,size_t len){
-    buf.insert(buf.end(),data,data+len);
-}
-
-//remove the data from the front so that it follows FIFO order
-static void buf_consume(Buffer &buf,size_t len){
-    buf.erase(buf.begin(),buf.begin()+len);
-}
-
 // a structure conection which consists of all teh members required for making the connection
 struct Conn{
     int fd = -1;
@@ -85,27 +114,117 @@ struct Conn{
     bool want_close = false;
     bool want_read = false;
     bool want_write= false;
+    //the interest that is currently registered with epoll
+    uint32_t events = 0;
+    //io_uring operations that still point at this connection
+    uint32_t inflight = 0;
+    //a request forwarded to the other shards, the pipeline waits until its response is written
+    bool fwd_active = false;
+    bool fwd_gather = false;    //the replies are merged into one array
+    uint32_t fwd_pending = 0;   //replies which have not arrived yet
+    uint32_t fwd_nelem = 0;
+    Buffer fwd_out;
     //the buffers for teh incoming and the outgoing data
     Buffer incoming;
     Buffer outgoing;
+    //the parsed arguments of the current request, kept to reuse the capacity
+    std::vector<std::string_view> args;
     //the data members for the timers 
     uint64_t last_active_ms = 0;
     DList idle_node;
 };
 
-//global data bases 
-static struct {
+static_assert(sizeof(Conn) <= k_slab_max,"Conn comes from the slab");
+
+//the time an expiry cycle may take, it doubles while the cycles cannot keep up with the keys expiring
+// and halves back once they can
+const uint64_t k_expire_budget_min_ns = 250*1000;
+const uint64_t k_expire_budget_max_ns = 2*1000*1000;
+
+//global data bases, each shard thread has its own copy so nothing here is shared
+static thread_local struct {
+    uint32_t shard_id = 0;
+    uint32_t nshards = 1;   //a SCAN cursor goes on to the next shard
     HMap db;
     //a map of all client conection keyed by the fd
     std::vector<Conn *> fd2conn;
     //timers for the idle connections
     DList idle_list;
     //timers for the TTLs
+#ifdef USE_TTL_HEAP
     std::vector<HeapItem > heap ;
-    //the thread pool
-    ThreadPool thread_pool;
+#else
+    TWheel wheel;
+#endif
+    //the time the next expiry cycle may take, see process_timers()
+    uint64_t expire_budget_ns = k_expire_budget_min_ns;
+    //the child writing the dump file of BGSAVE, -1 when there is none
+    pid_t save_pid = -1;
+    uint64_t save_start_ms = 0;
+    //the append only log, -1 when it is off. The writes of a loop iteration collect in aof_buf and
+    // aof_flush() hands them to the file in one write() before the loop sleeps
+    int aof_fd = -1;
+    Buffer aof_buf;
+    bool aof_dirty = false;         //written but not fsynced yet
+    uint64_t aof_sync_ms = 0;       //the last fsync of appendfsync everysec
+    uint32_t aof_sync_busy = 0;     //the thread pool is still running it
+    //forwarded requests whose replies wait for the fsync of appendfsync always
+    std::vector<struct ShardMsg *> aof_replies;
+    //the child of BGREWRITEAOF, -1 when there is none. The writes made meanwhile also go to aof_rewrite_buf
+    pid_t rewrite_pid = -1;
+    uint64_t rewrite_start_ms = 0;
+    Buffer aof_rewrite_buf;
+    //the thread pool appends aof_rewrite_buf to the file of the child, NULL when it does not
+    struct AofTail *rewrite_tail = NULL;
+    //the epoll instance, the interest set lives in the kernel across the iterations
+    int epfd = -1;
+#ifdef USE_URING
+    //NULL when the kernel has no io_uring support
+    URing *uring = NULL;
+    UBufRing bufring;
+#endif
+    //wakes up the loop when the other shards send messages, -1 with a single shard
+    int efd = -1;
+    //messages that did not fit into a full queue, with the destination shard
+    std::deque<std::pair<uint32_t,struct ShardMsg *>> outbox;
+    //the parsed arguments of a forwarded request, reused like Conn::args
+    std::vector<std::string_view> shard_args;
 }g_data;
 
+//the thread pool is shared by all the shards
+static ThreadPool g_thread_pool;
+
+#ifndef USE_POLL
+//translate the application intention into the epoll flags
+static uint32_t conn_events(Conn *conn){
+    uint32_t events = 0;    //EPOLLERR is always reported
+    if(conn->want_read) events |= EPOLLIN;
+    if(conn->want_write) events |= EPOLLOUT;
+    return events;
+}
+
+//only make the syscall when the intention has actually changed
+static void conn_update_events(Conn *conn){
+    uint32_t events = conn_events(conn);
+    if(events == conn->events) return;
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    if(epoll_ctl(g_data.epfd,EPOLL_CTL_MOD,conn->fd,&ev) <0){
+        msg_errno("epoll_ctl() error");
+        conn->want_close = true;
+        return;
+    }
+    conn->events = events;
+}
+#endif
+
+static void conn_destroy(Conn *conn);
+#ifdef USE_URING
+static void uring_conn_arm(Conn *conn);
+#endif
+
 //the function for the application call back when the socket is ready
 static int32_t handle_accept(int fd){
     //accept the conection 
@@ -113,8 +232,8 @@ static int32_t handle_accept(int fd){
     socklen_t addr_len = sizeof(client_addr);
     int connfd  =accept(fd,(struct sockaddr *)&client_addr,&addr_len);
     if(connfd<0){
-        //error handling of the accept
-        msg_errno("accept() error");
+        //an empty accept queue is not an error, the caller just stops draining it
+        if(errno != EAGAIN) msg_errno("accept() error");
         return -1;
     }
     uint32_t ip = client_addr.sin_addr.s_addr;
@@ -127,7 +246,7 @@ static int32_t handle_accept(int fd){
     fd_set_nb(connfd);
 
     //craete a struct Con
-    Conn *conn = new Conn();
+    Conn *conn = new (slab_alloc(sizeof(Conn))) Conn();
     conn->fd = connfd;
     conn->want_read = true;
     conn->last_active_ms = get_monotonic_msec();
@@ -139,15 +258,52 @@ static int32_t handle_accept(int fd){
     }
     assert(!g_data.fd2conn[conn->fd]);
     g_data.fd2conn[conn->fd] = conn;
+
+#ifdef USE_URING
+    if(g_data.uring){
+        //the completion based loop has no interest set, just queue the first recv
+        uring_conn_arm(conn);
+        return 0;
+    }
+#endif
+#ifndef USE_POLL
+    //register the interest once, later only the changes are sent to the kernel
+    struct epoll_event ev = {};
+    ev.events = conn->events = conn_events(conn);
+    ev.data.fd = conn->fd;
+    if(epoll_ctl(g_data.epfd,EPOLL_CTL_ADD,conn->fd,&ev) <0){
+        msg_errno("epoll_ctl() error");
+        conn_destroy(conn);
+        return 0;   //keep draining the accept queue
+    }
+#endif
     return 0;
 }
 
 
+//a destroyed conn is freed once the io_uring operations and the other shards no longer point at it
+static void conn_try_free(Conn *conn){
+    if(!conn->inflight && !conn->fwd_pending){
+        conn->~Conn();
+        slab_free(conn);
+    }
+}
+
 static void conn_destroy(Conn *conn){
+#ifdef USE_URING
+    //shutdown() completes the pending recv or send, close() alone would leave them hanging
+    if(conn->inflight) (void)shutdown(conn->fd,SHUT_RDWR);
+#endif
+#ifndef USE_POLL
+    //close() alone does not take it out of the interest set while the child of a BGSAVE or a
+    // BGREWRITEAOF still has the socket, its events would come in for the next conn with this fd
+    if(g_data.epfd >= 0) (void)epoll_ctl(g_data.epfd,EPOLL_CTL_DEL,conn->fd,NULL);
+#endif
     (void)close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
     dlist_detach(&conn->idle_node);
-    delete conn;
+    conn->fd = -1;
+    conn_try_free(conn);
 }
 
 const size_t k_max_args = 200*1000;
@@ -159,16 +315,19 @@ static bool read_u32(const uint8_t *&cur,const uint8_t *end,uint32_t &out){
     return true;
 }
 
-static bool read_str(const uint8_t *&cur,const uint8_t *end,size_t n,std::string &out){
-    if(cur+n > end) return false;
-    
-    out.assign(cur,cur+n);
+//no copy, the view points into the receive buffer and is valid until the request is consumed
+static bool read_str(const uint8_t *&cur,const uint8_t *end,size_t n,std::string_view &out){
+    if(n > (size_t)(end-cur)) return false;
+
+    out = std::string_view((const char *)cur,n);
     cur+=n;
     return true;
 }
 
-static int32_t parse_req(const uint8_t *data,size_t size,std::vector<std::string> &out){
+//the caller reuses the out vector, so once its capacity is there parsing does not allocate
+static int32_t parse_req(const uint8_t *data,size_t size,std::vector<std::string_view> &out){
     const uint8_t *end = data+size;
+    out.clear();
     uint32_t nstr = 0; //this keeps the track of number of string in the request 
     if(!read_u32(data,end,nstr)) return -1;
 
@@ -178,7 +337,7 @@ static int32_t parse_req(const uint8_t *data,size_t size,std::vector<std::string
         uint32_t len = 0 ;
         if(!read_u32(data,end,len))return -1;
 
-        out.push_back(std::string());
+        out.push_back(std::string_view());
         if(!read_str(data,end,len,out.back())) return -1;
     }
     if(data != end) return -1; //because that indicates that there is atrailing garbage 
@@ -191,6 +350,7 @@ enum {
     ERR_TOO_BIG = 2,    // response too big
     ERR_BAD_TYP = 3,    // unexpected value type
     ERR_BAD_ARG = 4,    // bad arguments
+    ERR_IO = 5,         // the server failed at it, like a save
 };
 
 
@@ -205,9 +365,6 @@ enum{
 };
 
 //helper functions for the serialisation 
-static void buf_append_u8(Buffer &out,uint8_t data){
-    out.push_back(data);
-}
 static void buf_append_u32(Buffer &buf,uint32_t data){
     buf_append(buf,(const uint8_t *)&data,4);
 }
@@ -237,7 +394,7 @@ static void out_dbl(Buffer &buf,double val){
     buf_append_u8(buf,TAG_DBL);
     buf_append_dbl(buf,val);
 }
-static void out_err(Buffer &buf,uint32_t code,const std::string &msg){
+static void out_err(Buffer &buf,uint32_t code,std::string_view msg){
     buf_append_u8(buf,TAG_ERR);
     buf_append_u32(buf,code);
     buf_append_u32(buf,(uint32_t )msg.size());
@@ -249,13 +406,57 @@ static void out_arr(Buffer &buf,uint32_t n){
 }
 
 static size_t out_begin_arr(Buffer &out){
-    out.push_back(TAG_ARR);
+    buf_append_u8(out,TAG_ARR);
     buf_append_u32(out,0);
-    return out.size()-4;    //this si the ctx argument of the next function
+    return buf_size(out)-4;    //this si the ctx argument of the next function
 }
 static void out_end_arr(Buffer &out,size_t ctx,uint32_t n){
-    assert(out[ctx-1] == TAG_ARR);
-    memcpy(&out[ctx],&n,4);
+    assert(buf_data(out)[ctx-1] == TAG_ARR);
+    memcpy(buf_data(out)+ctx,&n,4);
+}
+
+//the views are not null terminated, short numbers are copied to the stack for strtoll()
+const size_t k_max_num_len = 64;
+
+static bool str2int(std::string_view s,int64_t &val){
+    char buf[k_max_num_len];
+    if(s.size() >= sizeof(buf)) return false;
+    memcpy(buf,s.data(),s.size());
+    buf[s.size()] = '\0';
+    char *endP = NULL;
+    errno = 0;
+    val = strtoll(buf,&endP,10);
+    return endP == buf+s.size() && errno != ERANGE;    //strtoll() clamps the overflows
+}
+
+static bool str2dbl(std::string_view s,double &out){
+    char buf[k_max_num_len];
+    if(s.size() >= sizeof(buf)) return false;
+    memcpy(buf,s.data(),s.size());
+    buf[s.size()] = '\0';
+    char *endP = NULL;
+    out = strtod(buf,&endP);
+    return endP == buf+s.size() && !isnan(out);
+}
+
+//the decimal form, buf needs k_max_num_len bytes
+static std::string_view int2str(int64_t val,char *buf){
+    char *end = std::to_chars(buf,buf+k_max_num_len,val).ptr;
+    return std::string_view(buf,end-buf);
+}
+
+//the shortest of %.15g and %.17g which reads back as the same double
+static std::string_view dbl2str(double val,char *buf){
+    int n = snprintf(buf,k_max_num_len,"%.15g",val);
+    if(strtod(buf,NULL) != val) n = snprintf(buf,k_max_num_len,"%.17g",val);
+    return std::string_view(buf,(size_t)n);
+}
+
+//true when s is exactly what int2str() prints for val, such a value can be kept as the integer
+static bool str2int_exact(std::string_view s,int64_t &val){
+    if(s.empty() || s.size() > 20 || !(s[0] == '-' || (s[0]>='0' && s[0]<='9'))) return false;
+    char buf[k_max_num_len];
+    return str2int(s,val) && int2str(val,buf) == s;
 }
 
 //the enum for the value types
@@ -265,31 +466,139 @@ enum {
     T_ZSET = 2, //this is the type for the zset
 };
 
+//how a T_STR value is kept
+enum {
+    ENC_RAW = 0,    //the bytes, after the key or in str.ptr
+    ENC_INT = 1,    //a value which str2int_exact() accepts, GET prints it back
+};
+
 //KV PAIR for the top level hashtable
+// one allocation holds the header, the key bytes and (for a string) the value right after the key,
+// the union only has the fields of the type so a small string key costs 48 bytes plus its data.
+// The block comes from the slab unless the key alone is too long for it
 struct Entry{
     struct HNode node; //this is the hahs table node
-    std::string key;
     //for the TTL (TIME TO LIVE)
+#ifdef USE_TTL_HEAP
     size_t heap_idx  =-1; //this is the reference to the cooresponding heap index
-    //value 
-    uint32_t type = 0;
-    //one of the following 
-    std::string str;
-    ZSet zset;     
+#else
+    struct EntryTTL *ttl = NULL;    //the timer on the wheel, only a key with a TTL has one
+#endif
+    uint32_t klen = 0;  //the key is data[0..klen)
+    uint16_t type = 0;
+    uint16_t enc = 0;   //ENC_RAW or ENC_INT for a T_STR
+    //value, one of the following
+    union{
+        struct{
+            uint32_t len;   //the value is data[klen..klen+len) when ptr is NULL
+            uint32_t cap;   //the size of ptr
+            char *ptr;      //a value too long for the space after the key
+        }str;
+        int64_t ival;
+        ZSet *zset;
+    };
+    char data[0];
 };
 
-static Entry *entry_new(uint32_t type){
-    Entry *ent = new Entry();
-    ent->type  = type;
+static std::string_view entry_key(const Entry *ent){
+    return std::string_view(ent->data,ent->klen);
+}
+
+//an integer is printed into buf (k_max_num_len bytes)
+static std::string_view entry_str(const Entry *ent,char *buf){
+    if(ent->enc == ENC_INT) return int2str(ent->ival,buf);
+    return std::string_view(ent->str.ptr ? ent->str.ptr : ent->data+ent->klen,ent->str.len);
+}
+
+static bool entry_in_slab(size_t klen){
+    return sizeof(Entry)+klen <= k_slab_max;
+}
+
+//the size of the block of ent, the value can use what is left after the key
+static size_t entry_block_size(const Entry *ent){
+    return entry_in_slab(ent->klen) ? slab_size(ent) : malloc_usable_size((void *)ent);
+}
+
+//vlen is the space reserved after the key for a string value, it is left out when it does not fit into a slab block
+static Entry *entry_new(uint32_t type,std::string_view key,uint64_t hcode,size_t vlen){
+    size_t size = sizeof(Entry)+key.size();
+    Entry *ent = NULL;
+    if(entry_in_slab(key.size())){
+        ent = (Entry *)slab_alloc(size+vlen <= k_slab_max ? size+vlen : size);
+    }else{
+        ent = (Entry *)malloc(size+vlen);
+        if(!ent) die("out of memory");
+    }
+    ent->node = HNode{};
+    ent->node.hcode = hcode;
+#ifdef USE_TTL_HEAP
+    ent->heap_idx = -1;
+#else
+    ent->ttl = NULL;
+#endif
+    ent->klen = (uint32_t)key.size();
+    ent->type = (uint16_t)type;
+    ent->enc = ENC_RAW;
+    memcpy(ent->data,key.data(),key.size());
+    if(type == T_ZSET){
+        ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+    }else{
+        ent->str.len = ent->str.cap = 0;
+        ent->str.ptr = NULL;
+    }
     return ent;
 }
 
+static void entry_set_int(Entry *ent,int64_t val){
+    if(ent->enc == ENC_RAW) free(ent->str.ptr);
+    ent->enc = ENC_INT;
+    ent->ival = val;
+}
+
+//the value stays after the key when it fits in the block (the size class or malloc rounds it up), a longer one gets its own buffer
+static void entry_set_str(Entry *ent,std::string_view val){
+    int64_t ival = 0;
+    if(str2int_exact(val,ival)) return entry_set_int(ent,ival);
+    if(ent->enc == ENC_INT){
+        ent->enc = ENC_RAW;
+        ent->str.len = ent->str.cap = 0;
+        ent->str.ptr = NULL;
+    }
+    size_t inline_cap = entry_block_size(ent) - sizeof(Entry) - ent->klen;
+    char *dst = ent->data + ent->klen;
+    if(val.size() > inline_cap){
+        if(!ent->str.ptr || val.size() > ent->str.cap){
+            free(ent->str.ptr);
+            ent->str.ptr = (char *)malloc(val.size());
+            if(!ent->str.ptr) die("out of memory");
+            ent->str.cap = (uint32_t)val.size();
+        }
+        dst = ent->str.ptr;
+    }else if(ent->str.ptr){
+        //it is short again
+        free(ent->str.ptr);
+        ent->str.ptr = NULL;
+        ent->str.cap = 0;
+    }
+    memcpy(dst,val.data(),val.size());
+    ent->str.len = (uint32_t)val.size();
+}
+
 
 static void entry_set_ttl(Entry *ent,int64_t ttl_ms);
+static uint64_t entry_expire_at(const Entry *ent);
 
 static void entry_del_sync(Entry *ent){
-    if(ent->type == T_ZSET) zset_clear(&ent->zset);
-    delete ent;
+    if(ent->type == T_ZSET){
+        zset_clear(ent->zset);
+        ent->zset->~ZSet();
+        slab_free(ent->zset);
+    }else if(ent->enc == ENC_RAW){
+        free(ent->str.ptr);
+    }
+    //this can run on the thread pool, slab_free() hands the block back to the shard which allocated it
+    if(entry_in_slab(ent->klen)) slab_free(ent);
+    else free(ent);
 }
 static void entry_del_func(void *args){
     entry_del_sync((Entry *)args);
@@ -297,76 +606,169 @@ static void entry_del_func(void *args){
 
 static void entry_del(Entry *ent){
     //unlink it from any other data structures before removifn it 
-    entry_set_ttl(ent,-1); //it removes the ttl and unlink it from the heap
+    entry_set_ttl(ent,-1); //it removes the ttl and unlink it from the timers
     //now run the destructor in a threadpool for large data structures deleting 
-    size_t set_size = (ent->type==T_ZSET ) ? hm_size(&ent->zset.hmap) : 0;
+    size_t set_size = (ent->type==T_ZSET ) ? zset_size(ent->zset) : 0;
     const size_t k_large_container_size = 1000;
-    if(set_size > k_large_container_size) thread_pool_queue(&g_data.thread_pool,&entry_del_func,ent);
+    if(set_size > k_large_container_size) thread_pool_queue(&g_thread_pool,&entry_del_func,ent);
     else entry_del_sync(ent); //this willl avoidthe context switches
 }
 //for the easiest way of looking for the key in the db
 struct LookupKey{
     struct HNode node; //this is the hash table node
-    std::string key;
+    std::string_view key;   //points into the request, it is only copied when a new entry is created
 };
 
 //equality comparison for the top level hash table 
 static bool entry_eq(HNode *node,HNode *key){
     struct Entry *ent = container_of(node,struct Entry,node);
     struct LookupKey *keydata = container_of(key,struct LookupKey,node);
-    return ent->key == keydata->key;
+    return entry_key(ent) == keydata->key;
+}
+
+static bool hnode_same(HNode *node,HNode *key){
+    return node==key;
+}
+
+//a key past its deadline is removed when it is looked up, so no command sees it before the timers get to it
+static HNode *db_lookup(LookupKey *key){
+    HNode *node = hm_lookup(&g_data.db,&key->node,&entry_eq);
+    if(!node) return NULL;
+    Entry *ent = container_of(node,Entry,node);
+    uint64_t expire_at = entry_expire_at(ent);
+    //only a key with a TTL reads the clock
+    if(expire_at == (uint64_t)-1 || expire_at > get_monotonic_msec()) return node;
+    hm_delete(&g_data.db,node,&hnode_same);
+    entry_del(ent);
+    return NULL;
 }
 
 //now processing the logci for the execution of the commands
-static void do_get(std::vector<std::string> &cmd,Buffer &out){
+static void do_get(std::vector<std::string_view> &cmd,Buffer &out){
     //the usage of the dummy structure for the look up 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
     //now looking for the node in the hash table 
-    HNode *node = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *node = db_lookup(&key);
     if(!node) return out_nil(out);
     //if the key is there then copy its bvalue 
     Entry *ent = container_of(node,Entry,node);
     if(ent->type!=T_STR){
         return out_err(out,ERR_BAD_TYP,"Not a string value");
     }
-    return out_str(out,ent->str.data(),ent->str.size());
+    char buf[k_max_num_len];
+    std::string_view val = entry_str(ent,buf);
+    return out_str(out,val.data(),val.size());
 }
-static void do_set(std::vector<std::string>&cmd,Buffer &out){
+static void do_set(std::vector<std::string_view> &cmd,Buffer &out){
     //a dummy structure for the  lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
     //look for the key in the hash table 
-    HNode *node  = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *node  = db_lookup(&key);
     if(node){
         //if the key sis foud then update the key value   
         Entry *ent = container_of(node,Entry,node);
         if(ent->type != T_STR) return out_err(out,ERR_BAD_TYP,"a non string value exists");
-        ent->str.swap(cmd[2]); //if it is a string value then swap it 
+        entry_set_str(ent,cmd[2]); //the value is the only thing copied out of the request
 
     }else{
-        //if ot foudn then create and allocate space for it 
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
+        //if ot foudn then create and allocate space for it, the key and the value in one block
+        Entry *ent = entry_new(T_STR,key.key,key.node.hcode,cmd[2].size());
+        entry_set_str(ent,cmd[2]);
         hm_insert(&g_data.db,&ent->node);
     }
     return out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd,Buffer &out){
+static void do_del(std::vector<std::string_view> &cmd,Buffer &out){
     //a dummy structure for the lookup 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
-    //delet it from hash table 
-    HNode *node = hm_delete(&g_data.db,&key.node,&entry_eq);
-    if(node) entry_del(container_of(node,Entry,node)); //deallocate the pair 
+    //delet it from hash table, an expired key is gone already
+    HNode *node = db_lookup(&key);
+    if(node){
+        hm_delete(&g_data.db,node,&hnode_same);
+        entry_del(container_of(node,Entry,node)); //deallocate the pair 
+    }
     return out_int(out,node ? 1: 0);
 }
+
+//the counters: a missing key starts from 0, the value is changed in place and the TTL is kept
+static void incr_by(std::string_view k,int64_t delta,Buffer &out){
+    LookupKey key;
+    key.key = k;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = NULL;
+    int64_t val = 0;
+    if(node){
+        ent = container_of(node,Entry,node);
+        if(ent->type != T_STR) return out_err(out,ERR_BAD_TYP,"a non string value exists");
+        //every integer is stored as ENC_INT, so a raw value is never one
+        if(ent->enc != ENC_INT) return out_err(out,ERR_BAD_ARG,"value is not an integer");
+        val = ent->ival;
+    }
+    if(__builtin_add_overflow(val,delta,&val)) return out_err(out,ERR_BAD_ARG,"increment or decrement would overflow");
+    if(!ent){
+        ent = entry_new(T_STR,key.key,key.node.hcode,0);
+        hm_insert(&g_data.db,&ent->node);
+    }
+    entry_set_int(ent,val);
+    return out_int(out,val);
+}
+
+//INCR key, DECR key
+static void do_incr(std::vector<std::string_view> &cmd,Buffer &out){
+    return incr_by(cmd[1],1,out);
+}
+static void do_decr(std::vector<std::string_view> &cmd,Buffer &out){
+    return incr_by(cmd[1],-1,out);
+}
+
+//INCRBY key delta, DECRBY key delta
+static void do_incrby(std::vector<std::string_view> &cmd,Buffer &out){
+    int64_t delta = 0;
+    if(!str2int(cmd[2],delta)) return out_err(out,ERR_BAD_ARG,"expect int 64");
+    return incr_by(cmd[1],delta,out);
+}
+static void do_decrby(std::vector<std::string_view> &cmd,Buffer &out){
+    int64_t delta = 0;
+    if(!str2int(cmd[2],delta) || delta == INT64_MIN) return out_err(out,ERR_BAD_ARG,"expect int 64");
+    return incr_by(cmd[1],-delta,out);
+}
+
+//INCRBYFLOAT key delta, the result is stored as its text (or as an integer when it is one) and returned as a string
+static void do_incrbyfloat(std::vector<std::string_view> &cmd,Buffer &out){
+    double delta = 0;
+    if(!str2dbl(cmd[2],delta)) return out_err(out,ERR_BAD_ARG,"expect float");
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = NULL;
+    double val = 0;
+    char buf[k_max_num_len];
+    if(node){
+        ent = container_of(node,Entry,node);
+        if(ent->type != T_STR) return out_err(out,ERR_BAD_TYP,"a non string value exists");
+        if(ent->enc == ENC_INT) val = (double)ent->ival;
+        else if(!str2dbl(entry_str(ent,buf),val)) return out_err(out,ERR_BAD_ARG,"value is not a float");
+    }
+    val += delta;
+    if(!isfinite(val)) return out_err(out,ERR_BAD_ARG,"increment would produce NaN or Infinity");
+    std::string_view res = dbl2str(val,buf);
+    if(!ent){
+        ent = entry_new(T_STR,key.key,key.node.hcode,res.size());
+        hm_insert(&g_data.db,&ent->node);
+    }
+    entry_set_str(ent,res);
+    return out_str(out,res.data(),res.size());
+}
+#ifdef USE_TTL_HEAP
 static void heap_delete(std::vector<HeapItem> &a,size_t pos){
     //swap the erased item with the last item 
     a[pos] = a.back();
@@ -388,6 +790,7 @@ static void entry_set_ttl(Entry *ent,int64_t ttl_ms){
     if(ttl_ms<0 && ent->heap_idx != (size_t)-1){
         //here setting the negative ttl means removing the ttl
         heap_delete(g_data.heap,ent->heap_idx);
+        ent->heap_idx = -1;
     }else if(ttl_ms>=0){
         //then add or update the heap structure 
         uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
@@ -396,21 +799,53 @@ static void entry_set_ttl(Entry *ent,int64_t ttl_ms){
     }
 }
 
-static bool str2int(const std::string &s,int64_t &val){
-    char *endP = NULL;
-    val = strtoll(s.c_str(),&endP,10);
-    return endP == s.c_str()+s.size();
+//the deadline of the TTL, -1 when there is none
+static uint64_t entry_expire_at(const Entry *ent){
+    if(ent->heap_idx == (size_t)-1) return (uint64_t)-1;
+    return g_data.heap[ent->heap_idx].val;
+}
+#else
+//the timer of a key, it comes from the slab when the key gets a TTL so the keys without one do not pay for it
+struct EntryTTL{
+    TWNode timer;
+    Entry *ent = NULL;
+};
+
+//set or remove the TTL, both are O(1)
+static void entry_set_ttl(Entry *ent,int64_t ttl_ms){
+    if(ttl_ms<0){
+        if(!ent->ttl) return;
+        tw_del(&g_data.wheel,&ent->ttl->timer);
+        slab_free(ent->ttl);
+        ent->ttl = NULL;
+        return;
+    }
+    if(!ent->ttl){
+        ent->ttl = new (slab_alloc(sizeof(EntryTTL))) EntryTTL();
+        ent->ttl->ent = ent;
+    }
+    tw_add(&g_data.wheel,&ent->ttl->timer,get_monotonic_msec() + (uint64_t)ttl_ms);
+}
+
+static uint64_t entry_expire_at(const Entry *ent){
+    return ent->ttl ? ent->ttl->timer.expire_ms : (uint64_t)-1;
 }
+#endif
+
 //PEXPIRE key ttl_ms
-static void do_expire(std::vector<std::string> &cmd,Buffer &out){
-    int64_t ttl_ms = 0;
+static void do_expire(std::vector<std::string_view> &cmd,Buffer &out){
+    int64_t ttl_ms = 0,at_ms = 0;
     if(!str2int(cmd[2],ttl_ms)) return out_err(out,ERR_BAD_ARG,"expect int 64");
+    //the log keeps the wall clock deadline, it must fit in int64
+    if(ttl_ms >= 0 && __builtin_add_overflow((int64_t)get_realtime_msec(),ttl_ms,&at_ms)){
+        return out_err(out,ERR_BAD_ARG,"invalid expire time");
+    }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *node = db_lookup(&key);
     if(node){
         Entry *ent = container_of(node,Entry,node);
         entry_set_ttl(ent,ttl_ms);
@@ -418,57 +853,280 @@ static void do_expire(std::vector<std::string> &cmd,Buffer &out){
     return out_int(out,node ? 1 : 0);
 }
 
+//PEXPIREAT key unix_ms, the append only log keeps PEXPIRE in this form. A deadline in the past deletes the key
+static void do_pexpireat(std::vector<std::string_view> &cmd,Buffer &out){
+    int64_t at_ms = 0;
+    if(!str2int(cmd[2],at_ms)) return out_err(out,ERR_BAD_ARG,"expect int 64");
+
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if(node){
+        Entry *ent = container_of(node,Entry,node);
+        //compare first, a deadline far in the past would overflow the difference
+        int64_t now_ms = (int64_t)get_realtime_msec();
+        if(at_ms > now_ms){
+            entry_set_ttl(ent,at_ms - now_ms);
+        }else{
+            hm_delete(&g_data.db,node,&hnode_same);
+            entry_del(ent);
+        }
+    }
+    return out_int(out,node ? 1 : 0);
+}
+
 //PTTL KEY
-static void do_ttl(std::vector<std::string> &cmd,Buffer &out){
+static void do_ttl(std::vector<std::string_view> &cmd,Buffer &out){
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *node = db_lookup(&key);
     if(!node){
         return out_int(out,-2); //not found
     }
 
     Entry *ent = container_of(node,Entry,node);
-    if(ent->heap_idx == (size_t)-1) return out_int(out,-1) ;//null or no ttl exists
+    uint64_t expire_at = entry_expire_at(ent);
+    if(expire_at == (uint64_t)-1) return out_int(out,-1) ;//null or no ttl exists
 
-    uint64_t expire_at =g_data.heap[ent->heap_idx].val;
     uint64_t now_ms = get_monotonic_msec();
     return out_int(out,expire_at > now_ms ? (expire_at-now_ms) : 0);
 }
+struct KeysCtx{
+    Buffer *out = NULL;
+    uint64_t now_ms = 0;
+    uint32_t n = 0;
+};
+
 static bool cb_keys(HNode *node,void *args){
-    Buffer &out = *(Buffer *)args;
-    const std::string &key = container_of(node,Entry,node)->key;
-    out_str(out,key.data(),key.size());
+    KeysCtx &ctx = *(KeysCtx *)args;
+    Entry *ent = container_of(node,Entry,node);
+    //an expired key the timers have not got to yet is left out, it cannot be removed in the middle of the walk
+    if(entry_expire_at(ent) <= ctx.now_ms) return true;
+    std::string_view key = entry_key(ent);
+    out_str(*ctx.out,key.data(),key.size());
+    ctx.n++;
     return true;
 }
 
-static void do_keys(std::vector<std::string> &,Buffer &out){
-    out_arr(out,(uint32_t)hm_size((&g_data.db)));
-    hm_foreach(&g_data.db,&cb_keys,(void *)&out);
+static void do_keys(std::vector<std::string_view> &,Buffer &out){
+    KeysCtx ctx;
+    ctx.out = &out;
+    ctx.now_ms = get_monotonic_msec();
+    size_t arr = out_begin_arr(out);
+    hm_foreach(&g_data.db,&cb_keys,(void *)&ctx);
+    out_end_arr(out,arr,ctx.n);
 }
 
-static bool str2dbl(const std::string &s,double &out){
-    char *endP = NULL;
-    out = strtod(s.c_str(),&endP);
-    return endP ==s.c_str()+s.size() && isnan(out);
+//MEMSTATS, one line per slab size class in use and a total per shard
+static void do_memstats(std::vector<std::string_view> &,Buffer &out){
+    SlabStats stats[k_slab_nclass];
+    slab_collect();     //count what the thread pool freed so far
+    slab_stats(stats);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    uint64_t pages = 0,used_bytes = 0;
+    char line[256];
+    for(const SlabStats &c : stats){
+        if(!c.pages) continue;
+        int len = snprintf(line,sizeof(line),"shard %u size %u: pages %llu used %llu allocs %llu frees %llu remote_frees %llu",
+            g_data.shard_id,c.size,(unsigned long long)c.pages,(unsigned long long)c.used,
+            (unsigned long long)c.allocs,(unsigned long long)c.frees,(unsigned long long)c.remote_frees);
+        out_str(out,line,(size_t)len);
+        n++;
+        pages += c.pages;
+        used_bytes += c.used*c.size;
+    }
+    int len = snprintf(line,sizeof(line),"shard %u total: slab_bytes %llu used_bytes %llu",
+        g_data.shard_id,(unsigned long long)(pages*k_slab_page),(unsigned long long)used_bytes);
+    out_str(out,line,(size_t)len);
+    out_end_arr(out,ctx,n+1);
+}
+
+//a case insensitive match of an option like WITHSCORES
+static bool arg_is(std::string_view arg,const char *word){
+    return arg.size() == strlen(word) && !strncasecmp(arg.data(),word,arg.size());
+}
+
+//a glob pattern element at pat[p] against one character, p moves past the element.
+// ? is any character, [abc] [^a-z] a class and a backslash takes the next character as it is
+static bool glob_one(std::string_view pat,size_t &p,uint8_t c){
+    uint8_t pc = pat[p++];
+    if(pc == '?') return true;
+    if(pc == '\\' && p < pat.size()) return (uint8_t)pat[p++] == c;
+    if(pc != '[') return pc == c;
+    bool neg = p < pat.size() && pat[p] == '^';
+    if(neg) p++;
+    bool hit = false;
+    while(p < pat.size() && pat[p] != ']'){
+        if(pat[p] == '\\' && p+1 < pat.size()) p++;
+        uint8_t lo = pat[p++],hi = lo;
+        if(p+1 < pat.size() && pat[p] == '-' && pat[p+1] != ']'){
+            p++;
+            if(pat[p] == '\\' && p+1 < pat.size()) p++;
+            hi = pat[p++];
+            if(lo > hi) std::swap(lo,hi);
+        }
+        if(c >= lo && c <= hi) hit = true;
+    }
+    if(p < pat.size()) p++;    //the ]
+    return hit != neg;
+}
+
+//the glob patterns of SCAN MATCH, a * goes back to the last star only so it is O(n*m) at worst
+static bool glob_match(std::string_view pat,std::string_view str){
+    size_t p = 0,s = 0;
+    size_t star_p = std::string_view::npos,star_s = 0;
+    while(s < str.size()){
+        if(p < pat.size() && pat[p] == '*'){
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        size_t next = p;
+        if(p < pat.size() && glob_one(pat,next,(uint8_t)str[s])){
+            p = next;
+            s++;
+            continue;
+        }
+        //let the last star take one more character
+        if(star_p == std::string_view::npos) return false;
+        p = star_p;
+        s = ++star_s;
+    }
+    while(p < pat.size() && pat[p] == '*') p++;
+    return p == pat.size();
+}
+
+//the options of SCAN and ZSCAN
+struct ScanOpts{
+    bool match = false;
+    std::string_view pattern;
+    size_t count = 10;      //the entries to look at, the reply can have fewer or a few more
+};
+
+//a COUNT above this is taken as this, hm_scan() looks at up to 10 times as many slots
+const int64_t k_scan_max_count = 1 << 20;
+
+static bool scan_opts(std::vector<std::string_view> &cmd,size_t pos,ScanOpts &opts){
+    for(;pos+1<cmd.size();pos+=2){
+        if(arg_is(cmd[pos],"match")){
+            opts.match = true;
+            opts.pattern = cmd[pos+1];
+        }else if(arg_is(cmd[pos],"count")){
+            int64_t count = 0;
+            if(!str2int(cmd[pos+1],count) || count < 1) return false;
+            opts.count = (size_t)std::min(count,k_scan_max_count);
+        }else{
+            return false;
+        }
+    }
+    return pos == cmd.size();
+}
+
+//the shard of a SCAN cursor is in the bits above k_hm_scan_bits and the hm_scan() cursor of that shard below
+static bool scan_cursor(std::string_view arg,uint64_t &cursor){
+    int64_t val = 0;
+    if(!str2int(arg,val) || val < 0) return false;
+    cursor = (uint64_t)val;
+    return (cursor >> k_hm_scan_bits) < g_data.nshards;
+}
+
+struct ScanCtx{
+    const ScanOpts *opts = NULL;
+    uint64_t now_ms = 0;
+    std::vector<Entry *> found;
+};
+
+static void cb_scan(HNode *node,void *arg){
+    ScanCtx &ctx = *(ScanCtx *)arg;
+    Entry *ent = container_of(node,Entry,node);
+    //an expired key is left out but not removed, the table must not change under hm_scan()
+    if(entry_expire_at(ent) <= ctx.now_ms) return;
+    if(ctx.opts->match && !glob_match(ctx.opts->pattern,entry_key(ent))) return;
+    ctx.found.push_back(ent);
+}
+
+//scan cursor [match pattern] [count n]
+// replies the next cursor and the keys, a key present for the whole scan is returned at least once.
+// The shards are gone through one after the other, the cursor is forwarded to the shard it names
+static void do_scan(std::vector<std::string_view> &cmd,Buffer &out){
+    uint64_t cursor = 0;
+    ScanOpts opts;
+    if(!scan_cursor(cmd[1],cursor)) return out_err(out,ERR_BAD_ARG,"invalid cursor");
+    if(!scan_opts(cmd,2,opts)) return out_err(out,ERR_BAD_ARG,"syntax error");
+    uint32_t shard = (uint32_t)(cursor >> k_hm_scan_bits);
+    if(shard != g_data.shard_id) return out_err(out,ERR_BAD_ARG,"invalid cursor");
+
+    ScanCtx ctx;
+    ctx.opts = &opts;
+    ctx.now_ms = get_monotonic_msec();
+    uint64_t local = cursor & ((1ull << k_hm_scan_bits)-1);
+    uint64_t next = hm_scan(&g_data.db,local,opts.count,&cb_scan,&ctx);
+    if(next) next |= (uint64_t)shard << k_hm_scan_bits;
+    else if(shard+1 < g_data.nshards) next = (uint64_t)(shard+1) << k_hm_scan_bits;
+
+    out_arr(out,2);
+    out_int(out,(int64_t)next);
+    out_arr(out,(uint32_t)ctx.found.size());
+    for(Entry *ent : ctx.found){
+        std::string_view key = entry_key(ent);
+        out_str(out,key.data(),key.size());
+    }
 }
 
-//zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd,Buffer &out){
-    double score =0;
-    if(!str2dbl(cmd[2],score)) return out_err(out,ERR_BAD_ARG,"expected float value for the score ");
+//the options of ZADD
+enum {
+    ZADD_NX = 1,        //only add new members
+    ZADD_XX = 2,        //only update the existing ones
+    ZADD_GT = 4,        //only update when the new score is greater
+    ZADD_LT = 8,        //only update when the new score is less
+    ZADD_CH = 16,       //reply with the members added or changed instead of the ones added
+    ZADD_INCR = 32,     //add the score to the old one, one member only, reply with the new score
+};
+
+//zadd zset [nx|xx] [gt|lt] [ch] [incr] score name [score name ...]
+// the new members are collected and added in one batch at the end, see zset_add_new()
+static void do_zadd(std::vector<std::string_view> &cmd,Buffer &out){
+    uint32_t flags = 0;
+    size_t pos = 2;
+    for(;pos<cmd.size();++pos){
+        if(arg_is(cmd[pos],"nx")) flags |= ZADD_NX;
+        else if(arg_is(cmd[pos],"xx")) flags |= ZADD_XX;
+        else if(arg_is(cmd[pos],"gt")) flags |= ZADD_GT;
+        else if(arg_is(cmd[pos],"lt")) flags |= ZADD_LT;
+        else if(arg_is(cmd[pos],"ch")) flags |= ZADD_CH;
+        else if(arg_is(cmd[pos],"incr")) flags |= ZADD_INCR;
+        else break;
+    }
+    size_t npairs = (cmd.size()-pos)/2;
+    if(npairs == 0 || (cmd.size()-pos)%2) return out_err(out,ERR_BAD_ARG,"syntax error");
+    if((flags & ZADD_NX) && (flags & (ZADD_XX|ZADD_GT|ZADD_LT))) return out_err(out,ERR_BAD_ARG,"NX is not compatible with XX, GT or LT");
+    if((flags & ZADD_GT) && (flags & ZADD_LT)) return out_err(out,ERR_BAD_ARG,"GT and LT are not compatible");
+    if((flags & ZADD_INCR) && npairs > 1) return out_err(out,ERR_BAD_ARG,"INCR takes one score and member");
+
+    //every score is checked before anything changes
+    std::vector<ZAdd> pairs(npairs);
+    for(size_t i=0;i<npairs;++i){
+        if(!str2dbl(cmd[pos+2*i],pairs[i].score)) return out_err(out,ERR_BAD_ARG,"expected float value for the score ");
+        pairs[i].name = cmd[pos+2*i+1].data();
+        pairs[i].len = cmd[pos+2*i+1].size();
+    }
+
     //Look up for the key else create a new key
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = cmd[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *hnode = db_lookup(&key);
 
     Entry *ent = NULL;
     if(!hnode){
-        ent= entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+        //XX never adds, so there is nothing to create
+        if(flags & ZADD_XX) return (flags & ZADD_INCR) ? out_nil(out) : out_int(out,0);
+        ent= entry_new(T_ZSET,key.key,key.node.hcode,0);
         hm_insert(&g_data.db,&ent->node);
     }else{
         ent = container_of(hnode,Entry,node);
@@ -477,52 +1135,151 @@ static void do_zadd(std::vector<std::string> &cmd,Buffer &out){
             return out_err(out,ERR_BAD_TYP,"expect zset");
         }
     }
-    //add or update the tuple 
-    const std::string &name = cmd[3];
-    bool added =  zset_insert(&ent->zset,name.data(),name.size(),score);
-    return out_int(out,(int64_t)added);
+
+    //the members which are not in the zset yet, a name seen twice in the request is an update the second time
+    std::vector<ZAdd> fresh;
+    std::unordered_map<std::string_view,size_t> fresh_idx;
+    int64_t added = 0,changed = 0;
+    double result = 0;
+    bool aborted = true;    //INCR replies nil when the member was left alone
+    for(ZAdd &p : pairs){
+        std::string_view name(p.name,p.len);
+        double *cur = NULL;
+        ZNode *znode = NULL;
+        if(!fresh.empty()){
+            auto it = fresh_idx.find(name);
+            if(it != fresh_idx.end()) cur = &fresh[it->second].score;
+        }
+        if(!cur){
+            znode = zset_lookup(ent->zset,p.name,p.len);
+            if(znode) cur = &znode->score;
+        }
+
+        if(!cur){
+            if(flags & ZADD_XX) continue;
+            if(npairs > 1) fresh_idx[name] = fresh.size();
+            fresh.push_back(p);
+            added++;
+            result = p.score;
+            aborted = false;
+            continue;
+        }
+        if(flags & ZADD_NX) continue;
+        double score = (flags & ZADD_INCR) ? *cur+p.score : p.score;
+        if(isnan(score)) return out_err(out,ERR_BAD_ARG,"resulting score is not a number");
+        if(((flags & ZADD_GT) && score <= *cur) || ((flags & ZADD_LT) && score >= *cur)) continue;
+        result = score;
+        aborted = false;
+        if(score == *cur) continue;
+        changed++;
+        //a pending member only needs its score changed, an existing one moves in the tree
+        if(znode) zset_insert(ent->zset,p.name,p.len,score);
+        else *cur = score;
+    }
+    if(!fresh.empty()) zset_add_new(ent->zset,fresh.data(),fresh.size());
+
+    if(flags & ZADD_INCR) return aborted ? out_nil(out) : out_dbl(out,result);
+    return out_int(out,(flags & ZADD_CH) ? added+changed : added);
 }
 static const ZSet k_empty_zset;
 
-static ZSet *expect_zset(std::string &s){
+static ZSet *expect_zset(std::string_view s){
     LookupKey key;
-    key.key.swap(s);
+    key.key = s;
     key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
 
-    HNode *hnode = hm_lookup(&g_data.db,&key.node,&entry_eq);
+    HNode *hnode = db_lookup(&key);
     if(!hnode) return (ZSet *)&k_empty_zset; //always a nin empty key is  treated as a non empty zset
     Entry *ent  = container_of(hnode,Entry,node);
-    return ent->type == T_ZSET ? &ent->zset :  NULL;
+    return ent->type == T_ZSET ? ent->zset :  NULL;
 }
 
 //zrem zset name
-static void do_zrem(std::vector<std::string> &cmd,Buffer &out){
-    ZSet *zset = expect_zset(cmd[1]);
-    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset,name.data(),name.size());
-    if(znode) zset_delete(zset,znode);
-    return out_int(out,znode ? 1: 0);
+static void do_zrem(std::vector<std::string_view> &cmd,Buffer &out){
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(),key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if(!hnode) return out_int(out,0);
+    Entry *ent = container_of(hnode,Entry,node);
+    if(ent->type != T_ZSET) return out_err(out,ERR_BAD_TYP,"expect zset");
+
+    std::string_view name = cmd[2];
+    ZNode *znode = zset_lookup(ent->zset,name.data(),name.size());
+    if(!znode) return out_int(out,0);
+    zset_delete(ent->zset,znode);
+    //a zset never stays around empty, the key goes with its last member
+    if(zset_size(ent->zset) == 0){
+        hm_delete(&g_data.db,hnode,&hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out,1);
 }
 
 //zscore zset name
-static void do_zscore(std::vector<std::string> &cmd,Buffer &out){
+static void do_zscore(std::vector<std::string_view> &cmd,Buffer &out){
     ZSet *zset = expect_zset(cmd[1]);
     if(!zset) return out_err(out,ERR_BAD_TYP,"Expect zset");
 
-    const std::string &name = cmd[2];
+    std::string_view name = cmd[2];
     ZNode *znode = zset_lookup(zset,name.data(),name.size());
     return znode ? out_dbl(out,znode->score) : out_nil(out);
 }
 
+//the name and optionally the score of a member, as out_str() and out_dbl() would write them
+// but with one size check for both
+static void out_zmember(Buffer &out,const ZNode *znode,bool withscore){
+    size_t size = 1+4+znode->len + (withscore ? 1+8 : 0);
+    uint8_t *p = buf_prepare(out,size);
+    uint32_t len = (uint32_t)znode->len;
+    p[0] = TAG_STR;
+    memcpy(p+1,&len,4);
+    memcpy(p+5,znode->name,znode->len);
+    if(withscore){
+        p += 5+znode->len;
+        p[0] = TAG_DBL;
+        memcpy(p+1,&znode->score,8);
+    }
+    buf_commit(out,size);
+}
+
+struct ZScanCtx{
+    const ScanOpts *opts = NULL;
+    std::vector<ZNode *> found;
+};
+
+static void cb_zscan(ZNode *znode,void *arg){
+    ZScanCtx &ctx = *(ZScanCtx *)arg;
+    if(ctx.opts->match && !glob_match(ctx.opts->pattern,std::string_view(znode->name,znode->len))) return;
+    ctx.found.push_back(znode);
+}
+
+//zscan zset cursor [match pattern] [count n]
+// replies the next cursor and the members with their scores
+static void do_zscan(std::vector<std::string_view> &cmd,Buffer &out){
+    int64_t cursor = 0;
+    ScanOpts opts;
+    if(!str2int(cmd[2],cursor) || cursor < 0 || (uint64_t)cursor >> k_hm_scan_bits) return out_err(out,ERR_BAD_ARG,"invalid cursor");
+    if(!scan_opts(cmd,3,opts)) return out_err(out,ERR_BAD_ARG,"syntax error");
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
+
+    ZScanCtx ctx;
+    ctx.opts = &opts;
+    uint64_t next = zset_scan(zset,(uint64_t)cursor,opts.count,&cb_zscan,&ctx);
+    out_arr(out,2);
+    out_int(out,(int64_t)next);
+    out_arr(out,(uint32_t)ctx.found.size()*2);
+    for(ZNode *znode : ctx.found) out_zmember(out,znode,true);
+}
+
 //zquery zset zscore name offset limit
-static void do_zquery(std::vector<std::string> &cmd,Buffer &out){
+static void do_zquery(std::vector<std::string_view> &cmd,Buffer &out){
     //parsing the arguments 
     double score = 0;
     if(!str2dbl(cmd[2],score)) return  out_err(out,ERR_BAD_ARG,"Expected float number ");
 
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t offset = 0,limit = 0;
     if(!str2int(cmd[4],offset)|| !str2int(cmd[5],limit)) return out_err(out,ERR_BAD_ARG,"expect int");
 
@@ -534,130 +1291,1007 @@ static void do_zquery(std::vector<std::string> &cmd,Buffer &out){
     if(limit <=0) return out_arr(out,0);
 
     ZNode *znode = zset_seekge(zset,score,name.data(),name.size());
-    znode = znode_offset(znode,offset);
+    znode = znode_offset(zset,znode,offset);
 
     //output 
     size_t ctx = out_begin_arr(out);
     int64_t n =0;
-    while(znode && n<limit){
-        out_str(out,znode->name,znode->len);
-        out_dbl(out,znode->score);
-        znode = znode_offset(znode,+1);
+    ZIter it;
+    for(zset_iter(zset,znode,&it);it.node && n<limit;zset_iter_next(&it)){
+        out_zmember(out,it.node,true);
         n+=2;
     }
     out_end_arr(out,ctx,(uint32_t)n);
 }
-static void do_request(std::vector<std::string> &cmd,Buffer &out){
-     if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
-    } else {
-        return out_err(out, ERR_UNKNOWN, "unknown command.");
-    }
-}
-static void response_begin(Buffer &out,size_t *header){
-    *header = out.size() ; //message header postion
-    buf_append_u32(out,0); //reserving the space for the header length
-}
 
-static size_t response_size(Buffer &out,size_t header){
-    return out.size()-header-4;
+//the score bound of ZCOUNT and ZRANGEBYSCORE, "(" in front makes it exclusive, strtod() reads -inf and +inf
+static bool str2bound(std::string_view s,double &val,bool &excl){
+    excl = !s.empty() && s[0] == '(';
+    if(excl) s.remove_prefix(1);
+    return str2dbl(s,val);
 }
-static void response_end(Buffer &out,size_t header){
-    size_t msg_size = response_size(out, header);
-    if(msg_size>k_max_msg){
-        out.resize(header+4);
-        out_err(out,ERR_TOO_BIG,"response too big");
-        msg_size = response_size(out,header);
+
+//the rank of the first member with a score >= bound (> bound when excl), the size when there is none
+static int64_t zset_bound_rank(ZSet *zset,double bound,bool excl){
+    if(excl){
+        if(bound == INFINITY) return (int64_t)zset_size(zset);
+        bound = nextafter(bound,INFINITY);
     }
-    //message header [position]
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header],&len,4);
+    //the empty name goes before every member with that score
+    ZNode *znode = zset_seekge(zset,bound,"",0);
+    return znode ? zset_rank(zset,znode) : (int64_t)zset_size(zset);
 }
 
-//process one request one at a time 
-static bool try_one_request(Conn *conn){
-    //try to parese the request by following the protocol
-    if(conn->incoming.size()<4) return false;   //this means the size of incoming buffer is less than 1 byte 
-
-    uint32_t len = 0;
-    memcpy(&len,conn->incoming.data(),4); 
-    if(len>k_max_msg){
-        msg("too long ");
-        conn->want_close = true;
-        return false;
+//the members at the ranks [begin,end), from end-1 down when rev
+static void out_zrange(Buffer &out,ZSet *zset,int64_t begin,int64_t end,bool rev,bool withscores){
+    if(begin >= end) return out_arr(out,0);
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    ZIter it;
+    zset_iter(zset,zset_select(zset,rev ? end-1 : begin),&it);
+    for(int64_t i=begin;it.node && i<end;++i){
+        out_zmember(out,it.node,withscores);
+        n += withscores ? 2 : 1;
+        if(rev) zset_iter_prev(&it);
+        else zset_iter_next(&it);
     }
-    //message body 
-    if(4+len > conn->incoming.size()) return false;
+    out_end_arr(out,ctx,n);
+}
 
-    const uint8_t *request = &conn->incoming[4];
-     //assumption of got one requet now doing the applicaitom logic 
-    std::vector<std::string> cmd;
-    if(parse_req(request,len,cmd) <0){
-        msg("bad request ");
-        conn->want_close = true;
-        return false;
-    }
+//zrank zset name, zrevrank zset name
+static void zrank(std::vector<std::string_view> &cmd,Buffer &out,bool rev){
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
 
-    size_t header_pos = 0;
-    response_begin(conn->outgoing,&header_pos);
-    do_request(cmd,conn->outgoing);
-    response_end(conn->outgoing,header_pos);
+    ZNode *znode = zset_lookup(zset,cmd[2].data(),cmd[2].size());
+    if(!znode) return out_nil(out);
+    int64_t rank = zset_rank(zset,znode);
+    return out_int(out,rev ? (int64_t)zset_size(zset)-1-rank : rank);
+}
 
-    //the logic is done now removinng the request from teh buffer
-    buf_consume(conn->incoming,4+len);
+static void do_zrank(std::vector<std::string_view> &cmd,Buffer &out){
+    zrank(cmd,out,false);
+}
 
-    return true;
+static void do_zrevrank(std::vector<std::string_view> &cmd,Buffer &out){
+    zrank(cmd,out,true);
 }
 
-//now the call back of the application when the soket is writable 
-static void handle_write(Conn *conn){
-    assert(conn->outgoing.size() >0);
-    ssize_t rv = write(conn->fd,&conn->outgoing[0],conn->outgoing.size());
+//zcount zset min max, two seeks and two ranks whatever the count is
+static void do_zcount(std::vector<std::string_view> &cmd,Buffer &out){
+    double min = 0,max = 0;
+    bool min_excl = false,max_excl = false;
+    if(!str2bound(cmd[2],min,min_excl) || !str2bound(cmd[3],max,max_excl)) return out_err(out,ERR_BAD_ARG,"min or max is not a float");
 
-    if(rv<0 && errno == EAGAIN){
-        return;
-    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
 
-    if(rv <0){
-        msg_errno("write() error");
-        conn->want_close =true;
-        return ;
+    int64_t begin = zset_bound_rank(zset,min,min_excl);
+    int64_t end = zset_bound_rank(zset,max,!max_excl);
+    return out_int(out,end > begin ? end-begin : 0);
+}
 
+//zrange zset start stop [withscores], zrevrange zset start stop [withscores]
+// negative positions count from the end, -1 is the last member
+static void zrange(std::vector<std::string_view> &cmd,Buffer &out,bool rev){
+    int64_t start = 0,stop = 0;
+    if(!str2int(cmd[2],start) || !str2int(cmd[3],stop)) return out_err(out,ERR_BAD_ARG,"expect int");
+    bool withscores = false;
+    for(size_t i=4;i<cmd.size();++i){
+        if(arg_is(cmd[i],"withscores")) withscores = true;
+        else return out_err(out,ERR_BAD_ARG,"syntax error");
     }
-    //remove the written buffer from the outgoing 
-    buf_consume(conn->outgoing,(size_t)rv);
 
-    //now update the readiness intention
-    if(conn->outgoing.size() == 0){
-        //all data is written 
-        conn->want_read = true;
-        conn->want_write = false;
-    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
+
+    int64_t size = (int64_t)zset_size(zset);
+    if(start < 0) start += size;
+    if(stop < 0) stop += size;
+    if(start < 0) start = 0;
+    if(stop >= size) stop = size-1;
+    if(start > stop) return out_arr(out,0);
+    //the positions of zrevrange count from the highest score
+    if(rev) return out_zrange(out,zset,size-1-stop,size-start,true,withscores);
+    return out_zrange(out,zset,start,stop+1,false,withscores);
+}
+
+static void do_zrange(std::vector<std::string_view> &cmd,Buffer &out){
+    zrange(cmd,out,false);
+}
+
+static void do_zrevrange(std::vector<std::string_view> &cmd,Buffer &out){
+    zrange(cmd,out,true);
+}
+
+//zrangebyscore zset min max [withscores] [limit offset count]
+//zrevrangebyscore zset max min [withscores] [limit offset count]
+static void zrangebyscore(std::vector<std::string_view> &cmd,Buffer &out,bool rev){
+    double min = 0,max = 0;
+    bool min_excl = false,max_excl = false;
+    std::string_view smin = rev ? cmd[3] : cmd[2];
+    std::string_view smax = rev ? cmd[2] : cmd[3];
+    if(!str2bound(smin,min,min_excl) || !str2bound(smax,max,max_excl)) return out_err(out,ERR_BAD_ARG,"min or max is not a float");
+
+    bool withscores = false;
+    int64_t offset = 0,count = -1;     //a negative count is no limit
+    for(size_t i=4;i<cmd.size();++i){
+        if(arg_is(cmd[i],"withscores")){
+            withscores = true;
+        }else if(arg_is(cmd[i],"limit") && i+2<cmd.size()){
+            if(!str2int(cmd[i+1],offset) || !str2int(cmd[i+2],count)) return out_err(out,ERR_BAD_ARG,"expect int");
+            i += 2;
+        }else{
+            return out_err(out,ERR_BAD_ARG,"syntax error");
+        }
+    }
+
+    ZSet *zset = expect_zset(cmd[1]);
+    if(!zset) return out_err(out,ERR_BAD_TYP,"expect zset");
+    if(offset < 0) return out_arr(out,0);
+
+    int64_t begin = zset_bound_rank(zset,min,min_excl);
+    int64_t end = zset_bound_rank(zset,max,!max_excl);
+    //the limit applies in the order of the reply
+    if(rev){
+        end -= offset;
+        if(count >= 0 && end-begin > count) begin = end-count;
+    }else{
+        begin += offset;
+        if(count >= 0 && end-begin > count) end = begin+count;
+    }
+    return out_zrange(out,zset,begin,end,rev,withscores);
+}
+
+static void do_zrangebyscore(std::vector<std::string_view> &cmd,Buffer &out){
+    zrangebyscore(cmd,out,false);
+}
+
+static void do_zrevrangebyscore(std::vector<std::string_view> &cmd,Buffer &out){
+    zrangebyscore(cmd,out,true);
+}
+//SAVE and BGSAVE write the keys of every shard to a file of its own, <prefix>-<shard>.kdb
+static const char *g_dump_prefix = "dump";
+
+static void dump_path(char *buf,size_t size,uint32_t shard,bool tmp){
+    snprintf(buf,size,"%s-%u.kdb%s",g_dump_prefix,shard,tmp ? ".tmp" : "");
+}
+
+struct SnapCtx{
+    DumpWriter *w = NULL;
+    uint64_t now_ms = 0;
+    uint64_t unix_ms = 0;
+};
+
+static bool cb_snap(HNode *node,void *arg){
+    SnapCtx &ctx = *(SnapCtx *)arg;
+    Entry *ent = container_of(node,Entry,node);
+    uint64_t expire_at = entry_expire_at(ent);
+    uint64_t deadline_ms = k_dump_no_ttl;
+    if(expire_at != (uint64_t)-1){
+        if(expire_at <= ctx.now_ms) return true;
+        //the monotonic clock starts again at boot, the file keeps the deadline in the wall clock
+        deadline_ms = ctx.unix_ms + (expire_at - ctx.now_ms);
+    }
+    //an empty zset has nothing to restore, the loader would only drop it
+    if(ent->type == T_ZSET && zset_size(ent->zset) == 0) return true;
+    std::string_view key = entry_key(ent);
+    if(ent->type == T_ZSET){
+        dump_put_zset(ctx.w,key,zset_size(ent->zset),deadline_ms);
+        ZIter it;
+        for(zset_iter(ent->zset,zset_select(ent->zset,0),&it);it.node;zset_iter_next(&it)){
+            dump_put_member(ctx.w,it.node->score,std::string_view(it.node->name,it.node->len));
+        }
+    }else if(ent->enc == ENC_INT){
+        dump_put_int(ctx.w,key,ent->ival,deadline_ms);
+    }else{
+        char buf[k_max_num_len];
+        dump_put_str(ctx.w,key,entry_str(ent,buf),deadline_ms);
+    }
+    return !ctx.w->failed;
+}
+
+//write the file of this shard, false with errno set when it failed. It only reads the data
+// so the child of BGSAVE runs it on its copy of the memory
+static bool snap_write(uint64_t *nkeys){
+    char path[256],tmp[256];
+    dump_path(path,sizeof(path),g_data.shard_id,false);
+    dump_path(tmp,sizeof(tmp),g_data.shard_id,true);
+    DumpHeader hdr;
+    hdr.shard = g_data.shard_id;
+    hdr.nshards = g_data.nshards;
+    hdr.time_ms = get_realtime_msec();
+    DumpWriter w;
+    if(!dump_create(&w,tmp,hdr)) return false;
+    SnapCtx ctx;
+    ctx.w = &w;
+    ctx.now_ms = get_monotonic_msec();
+    ctx.unix_ms = hdr.time_ms;
+    hm_foreach(&g_data.db,&cb_snap,&ctx);
+    *nkeys = w.nkeys;
+    return dump_finish(&w,tmp,path);
+}
+
+//save, every shard writes its file and the loop waits for it. One line per shard
+static void do_save(std::vector<std::string_view> &,Buffer &out){
+    size_t arr = out_begin_arr(out);
+    char line[256];
+    uint64_t nkeys = 0,start_ms = get_monotonic_msec();
+    if(g_data.save_pid > 0){
+        out_err(out,ERR_IO,"a background save is running");
+    }else if(!snap_write(&nkeys)){
+        int len = snprintf(line,sizeof(line),"shard %u: save failed: %s",g_data.shard_id,strerror(errno));
+        out_err(out,ERR_IO,std::string_view(line,(size_t)len));
+    }else{
+        int len = snprintf(line,sizeof(line),"shard %u: saved %llu keys in %llu ms",g_data.shard_id,
+            (unsigned long long)nkeys,(unsigned long long)(get_monotonic_msec()-start_ms));
+        out_str(out,line,(size_t)len);
+    }
+    out_end_arr(out,arr,1);
+}
+
+//bgsave, every shard forks and the child writes the file from the memory as it was at the fork
+// while the shard goes on serving. The pages it changes meanwhile are copied by the kernel
+static void do_bgsave(std::vector<std::string_view> &,Buffer &out){
+    size_t arr = out_begin_arr(out);
+    char line[256];
+    if(g_data.save_pid > 0 || g_data.rewrite_pid > 0){
+        out_err(out,ERR_IO,"a background save or log rewrite is running");
+        return out_end_arr(out,arr,1);
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        //the child has only this thread, it writes the file and leaves without running any exit handler
+        uint64_t nkeys = 0;
+        _exit(snap_write(&nkeys) ? 0 : 1);
+    }
+    if(pid < 0){
+        int len = snprintf(line,sizeof(line),"shard %u: fork failed: %s",g_data.shard_id,strerror(errno));
+        out_err(out,ERR_IO,std::string_view(line,(size_t)len));
+    }else{
+        g_data.save_pid = pid;
+        g_data.save_start_ms = get_monotonic_msec();
+        int len = snprintf(line,sizeof(line),"shard %u: background save started",g_data.shard_id);
+        out_str(out,line,(size_t)len);
+    }
+    out_end_arr(out,arr,1);
+}
+
+//reap the child of BGSAVE once it is done
+static void snap_check(){
+    if(g_data.save_pid <= 0) return;
+    int status = 0;
+    pid_t rv = waitpid(g_data.save_pid,&status,WNOHANG);
+    if(rv == 0) return;
+    bool ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fprintf(stderr,"shard %u: background save %s in %llu ms\n",g_data.shard_id,ok ? "done" : "failed",
+        (unsigned long long)(get_monotonic_msec()-g_data.save_start_ms));
+    g_data.save_pid = -1;
+}
+
+//the append only log, one file per shard with the write commands in the request format
+enum {
+    AOF_FSYNC_NO,           //the kernel writes it back when it likes
+    AOF_FSYNC_EVERYSEC,     //the thread pool runs an fsync once a second
+    AOF_FSYNC_ALWAYS,       //the replies wait for the fsync, one per loop iteration for all of them
+};
+static bool g_aof_on = false;
+static uint32_t g_aof_fsync = AOF_FSYNC_EVERYSEC;
+static const char *g_aof_prefix = "appendonly";
+
+const uint64_t k_aof_sync_ms = 1000;
+const size_t k_aof_chunk = 256*1024;    //the rewrite writes the file in pieces of this size
+const size_t k_aof_zadd_batch = 1000;   //members per ZADD of a rewrite
+
+//every start writes the logs again as a new generation, <prefix>-<gen>-<shard>.aof, and <prefix>.manifest
+// names the one to replay. It is written once all the files of a generation are there, so a crash in
+// between leaves the last complete set. The generation 0 is the files of a server from before the manifest
+static uint64_t g_aof_gen = 0;          //the generation this run writes, fixed before the shards start
+static uint64_t g_aof_load_gen = 0;     //the one the manifest names
+static uint32_t g_aof_load_nfiles = 0;
+
+static void aof_path(char *buf,size_t size,uint64_t gen,uint32_t shard,bool tmp){
+    if(gen == 0) snprintf(buf,size,"%s-%u.aof%s",g_aof_prefix,shard,tmp ? ".tmp" : "");
+    else snprintf(buf,size,"%s-%llu-%u.aof%s",g_aof_prefix,(unsigned long long)gen,shard,tmp ? ".tmp" : "");
+}
+
+static void aof_manifest_path(char *buf,size_t size,bool tmp){
+    snprintf(buf,size,"%s.manifest%s",g_aof_prefix,tmp ? ".tmp" : "");
+}
+
+static bool write_all(int fd,const uint8_t *data,size_t len){
+    while(len){
+        ssize_t rv = write(fd,data,len);
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<=0) return false;
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+//one command in the request format, the length prefix included
+static void aof_put(Buffer &out,const std::string_view *args,size_t n){
+    uint32_t len = 4;
+    for(size_t i=0;i<n;++i) len += 4 + (uint32_t)args[i].size();
+    buf_append_u32(out,len);
+    buf_append_u32(out,(uint32_t)n);
+    for(size_t i=0;i<n;++i){
+        buf_append_u32(out,(uint32_t)args[i].size());
+        buf_append(out,(const uint8_t *)args[i].data(),args[i].size());
+    }
+}
+
+struct AofCtx{
+    int fd = -1;
+    bool failed = false;
+    Buffer out;
+    uint64_t now_ms = 0;
+    uint64_t unix_ms = 0;
+    std::vector<std::string_view> args;
+    char scores[k_aof_zadd_batch][k_max_num_len];
+};
+
+static void aof_ctx_write(AofCtx &ctx){
+    if(!ctx.failed && !write_all(ctx.fd,buf_data(ctx.out),buf_size(ctx.out))) ctx.failed = true;
+    buf_clear(ctx.out);
+}
+
+//a key as the commands which make it again: SET or ZADDs, then PEXPIREAT
+static bool cb_aof(HNode *node,void *arg){
+    AofCtx &ctx = *(AofCtx *)arg;
+    Entry *ent = container_of(node,Entry,node);
+    uint64_t expire_at = entry_expire_at(ent);
+    if(expire_at != (uint64_t)-1 && expire_at <= ctx.now_ms) return true;
+    //an empty zset writes no ZADD, so its PEXPIREAT must not be written either
+    if(ent->type == T_ZSET && zset_size(ent->zset) == 0) return true;
+    std::string_view key = entry_key(ent);
+    if(ent->type == T_ZSET){
+        //a big set takes a few commands so the replay never parses a huge one
+        ZIter it;
+        zset_iter(ent->zset,zset_select(ent->zset,0),&it);
+        while(it.node){
+            ctx.args.assign({"zadd",key});
+            for(size_t i=0;i<k_aof_zadd_batch && it.node;++i,zset_iter_next(&it)){
+                ctx.args.push_back(dbl2str(it.node->score,ctx.scores[i]));
+                ctx.args.push_back(std::string_view(it.node->name,it.node->len));
+            }
+            aof_put(ctx.out,ctx.args.data(),ctx.args.size());
+            if(buf_size(ctx.out) >= k_aof_chunk) aof_ctx_write(ctx);
+        }
+    }else{
+        char buf[k_max_num_len];
+        std::string_view args[] = {"set",key,entry_str(ent,buf)};
+        aof_put(ctx.out,args,3);
+    }
+    if(expire_at != (uint64_t)-1){
+        char buf[k_max_num_len];
+        //a TTL near the int64 limit may go just past it when the two clocks have drifted apart
+        uint64_t at_ms = std::min<uint64_t>(ctx.unix_ms + (expire_at - ctx.now_ms),INT64_MAX);
+        std::string_view args[] = {"pexpireat",key,int2str((int64_t)at_ms,buf)};
+        aof_put(ctx.out,args,3);
+    }
+    if(buf_size(ctx.out) >= k_aof_chunk) aof_ctx_write(ctx);
+    return !ctx.failed;
+}
+
+//write the data of this shard as commands to the file and fsync it, false with errno set when it failed.
+// It only reads the data so the child of BGREWRITEAOF runs it like the one of BGSAVE
+static bool aof_rewrite_file(const char *tmp){
+    AofCtx *ctx = new AofCtx();
+    ctx->fd = open(tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    bool ok = ctx->fd >= 0;
+    if(ok){
+        ctx->now_ms = get_monotonic_msec();
+        ctx->unix_ms = get_realtime_msec();
+        hm_foreach(&g_data.db,&cb_aof,ctx);
+        aof_ctx_write(*ctx);
+        ok = !ctx->failed && fdatasync(ctx->fd) == 0;
+        int err = errno;
+        close(ctx->fd);
+        errno = err;
+        if(!ok) unlink(tmp);
+    }
+    delete ctx;
+    return ok;
+}
+
+//bgrewriteaof, every shard forks and the child writes the data as it was at the fork. The writes made
+// meanwhile are kept and appended to the new file before it replaces the old one, see aof_check()
+static void do_bgrewriteaof(std::vector<std::string_view> &,Buffer &out){
+    size_t arr = out_begin_arr(out);
+    char line[256];
+    if(g_data.aof_fd < 0){
+        out_err(out,ERR_IO,"appendonly is off");
+        return out_end_arr(out,arr,1);
+    }
+    if(g_data.save_pid > 0 || g_data.rewrite_pid > 0 || g_data.rewrite_tail){
+        out_err(out,ERR_IO,"a background save or log rewrite is running");
+        return out_end_arr(out,arr,1);
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        char tmp[256];
+        aof_path(tmp,sizeof(tmp),g_aof_gen,g_data.shard_id,true);
+        _exit(aof_rewrite_file(tmp) ? 0 : 1);
+    }
+    if(pid < 0){
+        int len = snprintf(line,sizeof(line),"shard %u: fork failed: %s",g_data.shard_id,strerror(errno));
+        out_err(out,ERR_IO,std::string_view(line,(size_t)len));
+    }else{
+        g_data.rewrite_pid = pid;
+        g_data.rewrite_start_ms = get_monotonic_msec();
+        buf_clear(g_data.aof_rewrite_buf);
+        int len = snprintf(line,sizeof(line),"shard %u: background log rewrite started",g_data.shard_id);
+        out_str(out,line,(size_t)len);
+    }
+    out_end_arr(out,arr,1);
+}
+
+static void aof_flush();
+
+//the writes made during a rewrite, they can be many after a long one so the loop does not write them
+struct AofTail{
+    int fd = -1;
+    Buffer data;
+    char path[256];
+    char tmp[256];
+    //what a failed aof_flush() left in aof_buf, it is in data as well
+    size_t stale = 0;
+    bool ok = false;
+    uint32_t done = 0;
+};
+
+static void aof_tail_func(void *arg){
+    AofTail *tail = (AofTail *)arg;
+    tail->ok = write_all(tail->fd,buf_data(tail->data),buf_size(tail->data)) && fdatasync(tail->fd) == 0 &&
+        rename(tail->tmp,tail->path) == 0;
+    __atomic_store_n(&tail->done,1,__ATOMIC_RELEASE);
+}
+
+//the child wrote the data, a thread of the pool appends the writes made since the fork and puts the file
+// in place of the old one. The new writes wait in aof_buf until then, see aof_flush()
+static bool aof_rewrite_done(){
+    //the old file stays complete until the rename
+    aof_flush();
+    AofTail *tail = new AofTail();
+    aof_path(tail->path,sizeof(tail->path),g_aof_gen,g_data.shard_id,false);
+    aof_path(tail->tmp,sizeof(tail->tmp),g_aof_gen,g_data.shard_id,true);
+    tail->fd = open(tail->tmp,O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(tail->fd < 0){
+        delete tail;
+        return false;
+    }
+    buf_swap(tail->data,g_data.aof_rewrite_buf);
+    tail->stale = buf_size(g_data.aof_buf);
+    g_data.rewrite_tail = tail;
+    thread_pool_queue(&g_thread_pool,&aof_tail_func,tail);
+    return true;
+}
+
+//switch to the new file once the thread pool is done with it
+static void aof_tail_check(){
+    AofTail *tail = g_data.rewrite_tail;
+    if(!__atomic_load_n(&tail->done,__ATOMIC_ACQUIRE)) return;
+    g_data.rewrite_tail = NULL;
+    if(tail->ok){
+        close(g_data.aof_fd);
+        g_data.aof_fd = tail->fd;
+        //what the old file had and was not synced yet is in the new one, synced
+        g_data.aof_dirty = false;
+        buf_consume(g_data.aof_buf,tail->stale);
+    }else{
+        //the old file has every write up to the held ones, they go there instead
+        close(tail->fd);
+        unlink(tail->tmp);
+    }
+    fprintf(stderr,"shard %u: background log rewrite %s in %llu ms\n",g_data.shard_id,tail->ok ? "done" : "failed",
+        (unsigned long long)(get_monotonic_msec()-g_data.rewrite_start_ms));
+    delete tail;
+}
+
+//reap the child of BGREWRITEAOF once it is done
+static void aof_check(){
+    if(g_data.rewrite_tail) return aof_tail_check();
+    if(g_data.rewrite_pid <= 0) return;
+    int status = 0;
+    pid_t rv = waitpid(g_data.rewrite_pid,&status,WNOHANG);
+    if(rv == 0) return;
+    g_data.rewrite_pid = -1;
+    bool ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && aof_rewrite_done();
+    if(ok) return;
+    char tmp[256];
+    aof_path(tmp,sizeof(tmp),g_aof_gen,g_data.shard_id,true);
+    unlink(tmp);
+    buf_clear(g_data.aof_rewrite_buf);
+    fprintf(stderr,"shard %u: background log rewrite failed in %llu ms\n",g_data.shard_id,
+        (unsigned long long)(get_monotonic_msec()-g_data.rewrite_start_ms));
+}
+
+//command flags
+enum {
+    CMD_READ = 1,           //does not modify the data
+    CMD_WRITE = 2,          //modifies the data
+    CMD_ALL_SHARDS = 4,     //runs on every shard and the replies are merged into one array
+    CMD_CURSOR = 8,         //the argument at first_key is a SCAN cursor, it runs on the shard the cursor names
+};
+
+typedef void (*cmd_handler)(std::vector<std::string_view> &cmd,Buffer &out);
+
+struct CmdDef{
+    const char *name;       //lower case
+    cmd_handler handler;
+    int32_t arity;          //the number of the arguments including the name, -N means at least N
+    uint32_t flags;
+    uint32_t first_key;     //the argument position of the key, 0 if there is no key
+};
+
+static void do_cmdstats(std::vector<std::string_view> &cmd,Buffer &out);
+
+//the command registry, a new command only needs a line here
+static constexpr CmdDef k_cmds[] = {
+    {"get",     do_get,     2, CMD_READ,                   1},
+    {"set",     do_set,     3, CMD_WRITE,                  1},
+    {"incr",    do_incr,    2, CMD_WRITE,                  1},
+    {"decr",    do_decr,    2, CMD_WRITE,                  1},
+    {"incrby",  do_incrby,  3, CMD_WRITE,                  1},
+    {"decrby",  do_decrby,  3, CMD_WRITE,                  1},
+    {"incrbyfloat", do_incrbyfloat, 3, CMD_WRITE,          1},
+    {"del",     do_del,     2, CMD_WRITE,                  1},
+    {"pexpire", do_expire,  3, CMD_WRITE,                  1},
+    {"pexpireat", do_pexpireat, 3, CMD_WRITE,              1},
+    {"pttl",    do_ttl,     2, CMD_READ,                   1},
+    {"keys",    do_keys,    1, CMD_READ | CMD_ALL_SHARDS,  0},
+    {"scan",    do_scan,   -2, CMD_READ | CMD_CURSOR,      1},
+    {"memstats", do_memstats, 1, CMD_READ | CMD_ALL_SHARDS, 0},
+    {"cmdstats", do_cmdstats, 1, CMD_READ | CMD_ALL_SHARDS, 0},
+    {"save",    do_save,    1, CMD_READ | CMD_ALL_SHARDS,  0},
+    {"bgsave",  do_bgsave,  1, CMD_READ | CMD_ALL_SHARDS,  0},
+    {"bgrewriteaof", do_bgrewriteaof, 1, CMD_READ | CMD_ALL_SHARDS, 0},
+    {"zadd",    do_zadd,   -4, CMD_WRITE,                  1},
+    {"zrem",    do_zrem,    3, CMD_WRITE,                  1},
+    {"zscore",  do_zscore,  3, CMD_READ,                   1},
+    {"zquery",  do_zquery,  6, CMD_READ,                   1},
+    {"zrank",   do_zrank,   3, CMD_READ,                   1},
+    {"zrevrank", do_zrevrank, 3, CMD_READ,                 1},
+    {"zcount",  do_zcount,  4, CMD_READ,                   1},
+    {"zrange",  do_zrange, -4, CMD_READ,                   1},
+    {"zrevrange", do_zrevrange, -4, CMD_READ,              1},
+    {"zrangebyscore", do_zrangebyscore, -4, CMD_READ,      1},
+    {"zrevrangebyscore", do_zrevrangebyscore, -4, CMD_READ, 1},
+    {"zscan",   do_zscan,  -3, CMD_READ,                   1},
+};
+const size_t k_ncmds = sizeof(k_cmds)/sizeof(k_cmds[0]);
+
+//the counters are per shard so the threads never share the cache lines
+struct CmdStats{
+    uint64_t calls = 0;
+    uint64_t errors = 0;    //the calls which replied with an error
+};
+static thread_local CmdStats g_cmd_stats[k_ncmds];
+
+//CMDSTATS, one line per command this shard ran
+static void do_cmdstats(std::vector<std::string_view> &,Buffer &out){
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    char line[128];
+    for(size_t i=0;i<k_ncmds;++i){
+        const CmdStats &c = g_cmd_stats[i];
+        if(!c.calls) continue;
+        int len = snprintf(line,sizeof(line),"shard %u %s: calls %llu errors %llu",g_data.shard_id,k_cmds[i].name,
+            (unsigned long long)c.calls,(unsigned long long)c.errors);
+        out_str(out,line,(size_t)len);
+        n++;
+    }
+    out_end_arr(out,ctx,n);
+}
+
+constexpr uint8_t cmd_lower(uint8_t c){
+    return (c>='A' && c<='Z') ? c+('a'-'A') : c;
+}
+
+//FNV-1a of the lower cased name, so the lookup is case insensitive
+constexpr uint32_t cmd_hash(const char *s,size_t n,uint32_t seed){
+    uint32_t h = seed;
+    for(size_t i=0;i<n;++i) h = (h ^ cmd_lower((uint8_t)s[i])) * 0x01000193;
+    return h;
+}
+
+constexpr size_t cmd_name_len(const char *s){
+    size_t n = 0;
+    while(s[n]) ++n;
+    return n;
+}
+
+const uint32_t k_cmd_slots = 128;   //must be the power of 2 and well above k_ncmds
+
+//a perfect hash, every command has a slot of its own so a lookup is one probe
+struct CmdIndex{
+    bool ok = false;
+    uint32_t seed = 0;
+    uint8_t slots[k_cmd_slots] = {};   //the index into k_cmds plus 1, 0 is an empty slot
+};
+
+//try the seeds until no two commands collide, this runs in the compiler
+constexpr CmdIndex cmd_index_build(){
+    for(uint32_t seed = 0x811C9DC5;seed < 0x811C9DC5 + 100000;++seed){
+        CmdIndex idx;
+        idx.seed = seed;
+        idx.ok = true;
+        for(size_t i=0;i<k_ncmds && idx.ok;++i){
+            const char *name = k_cmds[i].name;
+            uint32_t pos = cmd_hash(name,cmd_name_len(name),seed) & (k_cmd_slots-1);
+            if(idx.slots[pos]) idx.ok = false;
+            else idx.slots[pos] = (uint8_t)(i+1);
+        }
+        if(idx.ok) return idx;
+    }
+    return CmdIndex();
+}
+static constexpr CmdIndex k_cmd_index = cmd_index_build();
+static_assert(k_cmd_index.ok,"no perfect hash for the command table, raise k_cmd_slots");
+static_assert(k_ncmds < 255,"the slots are uint8_t");
+
+//NULL for an unknown command
+static const CmdDef *cmd_lookup(std::string_view name){
+    uint32_t pos = cmd_hash(name.data(),name.size(),k_cmd_index.seed) & (k_cmd_slots-1);
+    uint8_t i = k_cmd_index.slots[pos];
+    if(!i) return NULL;
+    const CmdDef *def = &k_cmds[i-1];
+    //the slot only says which command it could be, compare the name
+    for(size_t j=0;j<name.size();++j){
+        if(!def->name[j] || cmd_lower((uint8_t)name[j]) != (uint8_t)def->name[j]) return NULL;
+    }
+    return def->name[name.size()] ? NULL : def;
+}
+
+static bool cmd_arity_ok(const CmdDef *def,size_t n){
+    return def->arity>=0 ? n == (size_t)def->arity : n >= (size_t)-def->arity;
+}
+
+//log a write which went through, the replay of the log runs the same command again. A relative
+// TTL would start over on replay so PEXPIRE is logged with its deadline
+static void aof_feed(const CmdDef *def,std::vector<std::string_view> &cmd){
+    int64_t ttl_ms = 0;
+    char buf[k_max_num_len];
+    std::string_view at[3];
+    const std::string_view *args = cmd.data();
+    size_t n = cmd.size();
+    if(def->handler == &do_expire && str2int(cmd[2],ttl_ms) && ttl_ms >= 0){
+        at[0] = "pexpireat";
+        at[1] = cmd[1];
+        //the clock moved on since do_expire() checked the sum, the deadline stays at the maximum then
+        int64_t at_ms = 0;
+        if(__builtin_add_overflow((int64_t)get_realtime_msec(),ttl_ms,&at_ms)) at_ms = INT64_MAX;
+        at[2] = int2str(at_ms,buf);
+        args = at;
+    }
+    aof_put(g_data.aof_buf,args,n);
+    if(g_data.rewrite_pid > 0) aof_put(g_data.aof_rewrite_buf,args,n);
+}
+
+//def comes from cmd_lookup(cmd[0])
+static void do_request(const CmdDef *def,std::vector<std::string_view> &cmd,Buffer &out){
+    if(!def) return out_err(out,ERR_UNKNOWN,"unknown command.");
+    if(!cmd_arity_ok(def,cmd.size())) return out_err(out,ERR_BAD_ARG,"wrong number of arguments");
+
+    CmdStats &stats = g_cmd_stats[def-k_cmds];
+    stats.calls++;
+    size_t pos = buf_size(out);
+    def->handler(cmd,out);
+    if(buf_data(out)[pos] == TAG_ERR) stats.errors++;
+    else if((def->flags & CMD_WRITE) && g_data.aof_fd >= 0) aof_feed(def,cmd);
+}
+static void response_begin(Buffer &out,size_t *header){
+    *header = buf_size(out) ; //message header postion
+    buf_append_u32(out,0); //reserving the space for the header length
+}
+
+static size_t response_size(Buffer &out,size_t header){
+    return buf_size(out)-header-4;
+}
+static void response_end(Buffer &out,size_t header){
+    size_t msg_size = response_size(out, header);
+    if(msg_size>k_max_msg){
+        buf_truncate(out,header+4);
+        out_err(out,ERR_TOO_BIG,"response too big");
+        msg_size = response_size(out,header);
+    }
+    //message header [position]
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(buf_data(out)+header,&len,4);
+}
+
+//a request forwarded to the shard which owns the key, the same object carries the reply back
+struct ShardMsg{
+    uint32_t from = 0;      //the shard of the connection
+    Conn *conn = NULL;      //only touched by the origin shard
+    bool gather = false;    //a CMD_ALL_SHARDS command, the replies are merged
+    bool done = false;      //set by the target shard
+    Buffer req;             //a copy of the request body
+    Buffer out;             //the serialised reply
+    uint32_t nelem = 0;     //array elements in the reply of a gather
+};
+
+//the parts of a shard that the other shards touch
+struct ShardLink{
+    int efd = -1;                       //eventfd which wakes up the event loop of the shard
+    uint32_t notified = 0;              //the efd already has a pending wakeup
+    std::vector<SpscQueue *> inbox;     //one queue per sending shard
+};
+
+//indexed by the shard id, it is read only once the shard threads run
+static std::vector<ShardLink *> g_shards;
+
+//use the high bits of the hash, the low bits pick the bucket inside the shard
+static uint32_t hash_shard(uint64_t h){
+    h = ((h * 0x9E3779B97F4A7C15ull) >> 32) * g_shards.size();
+    return (uint32_t)(h >> 32);
+}
+
+static uint32_t key_shard(std::string_view key){
+    return hash_shard(str_hash((const uint8_t *)key.data(),key.size()));
+}
+
+static void shard_notify(uint32_t dst){
+    ShardLink *link = g_shards[dst];
+    //pairs with the fence in shard_process_inbox() so a wakeup is never lost
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&link->notified,1,__ATOMIC_SEQ_CST)) return;
+    uint64_t one = 1;
+    (void)write(link->efd,&one,8);
+}
+
+static void shard_send(uint32_t dst,ShardMsg *msg){
+    //keep the order behind the messages which are already waiting
+    if(!g_data.outbox.empty() || !spsc_push(g_shards[dst]->inbox[g_data.shard_id],msg)){
+        g_data.outbox.push_back({dst,msg});
+        return;
+    }
+    shard_notify(dst);
+}
+
+//retry the messages to the queues which were full
+static void shard_flush_outbox(){
+    while(!g_data.outbox.empty()){
+        std::pair<uint32_t,ShardMsg *> &item = g_data.outbox.front();
+        if(!spsc_push(g_shards[item.first]->inbox[g_data.shard_id],item.second)) break;
+        shard_notify(item.first);
+        g_data.outbox.pop_front();
+    }
+}
+
+//under appendfsync always a reply waits until the write it answers is on the disk
+static bool aof_hold(){
+    return g_aof_fsync == AOF_FSYNC_ALWAYS && buf_size(g_data.aof_buf) > 0;
+}
+
+struct AofSync{
+    int fd = -1;
+    uint32_t *busy = NULL;
+};
+
+//an fsync blocks as long as the disk takes, a thread of the pool waits for it instead of the loop
+static void aof_sync_func(void *arg){
+    AofSync *job = (AofSync *)arg;
+    if(fdatasync(job->fd)) msg_errno("append only log fdatasync()");
+    close(job->fd);
+    __atomic_store_n(job->busy,0,__ATOMIC_RELEASE);
+    delete job;
+}
+
+//write the commands of this loop iteration with one write() and one fsync, the group commit, then
+// let the replies which waited for it go
+static void aof_flush(){
+    //the writes go to the file after the tail of a rewrite, the replies held for them wait as well
+    if(g_data.aof_fd < 0 || g_data.rewrite_tail) return;
+    Buffer &buf = g_data.aof_buf;
+    while(buf_size(buf)){
+        ssize_t rv = write(g_data.aof_fd,buf_data(buf),buf_size(buf));
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<=0){
+            //the replies held for always cannot say the write is safe any more
+            if(g_aof_fsync == AOF_FSYNC_ALWAYS) die("append only log write()");
+            msg_errno("append only log write(), retrying");
+            break;
+        }
+        buf_consume(buf,(size_t)rv);
+        g_data.aof_dirty = true;
+    }
+    if(g_data.aof_dirty){
+        uint64_t now_ms = get_monotonic_msec();
+        if(g_aof_fsync == AOF_FSYNC_ALWAYS){
+            if(fdatasync(g_data.aof_fd)) die("append only log fdatasync()");
+            g_data.aof_dirty = false;
+        }else if(g_aof_fsync == AOF_FSYNC_NO){
+            g_data.aof_dirty = false;
+        }else if(now_ms >= g_data.aof_sync_ms + k_aof_sync_ms &&
+                !__atomic_load_n(&g_data.aof_sync_busy,__ATOMIC_ACQUIRE)){
+            //the job has its own fd, a rewrite may close this one meanwhile
+            AofSync *job = new AofSync();
+            job->fd = dup(g_data.aof_fd);
+            job->busy = &g_data.aof_sync_busy;
+            if(job->fd < 0){
+                msg_errno("dup()");
+                delete job;
+            }else{
+                g_data.aof_sync_busy = 1;
+                g_data.aof_dirty = false;
+                g_data.aof_sync_ms = now_ms;
+                thread_pool_queue(&g_thread_pool,&aof_sync_func,job);
+            }
+        }
+    }
+    for(ShardMsg *msg : g_data.aof_replies) shard_send(msg->from,msg);
+    g_data.aof_replies.clear();
+}
+
+static ShardMsg *shard_msg_new(Conn *conn,const uint8_t *req,uint32_t len,bool gather){
+    ShardMsg *msg = new ShardMsg();
+    msg->from = g_data.shard_id;
+    msg->conn = conn;
+    msg->gather = gather;
+    buf_append(msg->req,req,len);
+    return msg;
+}
+
+//the part of a CMD_ALL_SHARDS command from this shard, the handler replies with an array
+//and only its elements are kept, the count is returned
+static uint32_t gather_run(const CmdDef *def,std::vector<std::string_view> &cmd,Buffer &out){
+    CmdStats &stats = g_cmd_stats[def-k_cmds];
+    stats.calls++;
+    size_t pos = buf_size(out);
+    def->handler(cmd,out);
+    if(buf_data(out)[pos] == TAG_ERR) stats.errors++;
+    if(buf_data(out)[pos] != TAG_ARR) return 1;    //an error is one element
+    uint32_t n = 0;
+    memcpy(&n,buf_data(out)+pos+1,4);
+    uint8_t *p = buf_data(out)+pos;
+    memmove(p,p+5,buf_size(out)-pos-5);
+    buf_truncate(out,buf_size(out)-5);
+    return n;
+}
+
+//true if the request went to the other shards, the connection then waits for the replies
+static bool shard_forward(Conn *conn,const uint8_t *req,uint32_t len,const CmdDef *def,std::vector<std::string_view> &cmd){
+    uint32_t nshards = (uint32_t)g_shards.size();
+    //the errors for the unknown commands and the bad arguments are local
+    if(nshards<=1 || !def || !cmd_arity_ok(def,cmd.size())) return false;
+
+    if(def->flags & CMD_ALL_SHARDS){
+        //the local elements go first, the rest is appended as the replies arrive
+        conn->fwd_nelem = gather_run(def,cmd,conn->fwd_out);
+        for(uint32_t i=0;i<nshards;++i){
+            if(i != g_data.shard_id) shard_send(i,shard_msg_new(conn,req,len,true));
+        }
+        conn->fwd_pending = nshards-1;
+        conn->fwd_gather = true;
+    }else{
+        //the command goes to the shard which owns its key, or the one its cursor is in
+        if(!def->first_key) return false;
+        uint32_t dst = 0;
+        if(def->flags & CMD_CURSOR){
+            uint64_t cursor = 0;
+            if(!scan_cursor(cmd[def->first_key],cursor)) return false;
+            dst = (uint32_t)(cursor >> k_hm_scan_bits);
+        }else{
+            dst = key_shard(cmd[def->first_key]);
+        }
+        if(dst == g_data.shard_id) return false;
+        shard_send(dst,shard_msg_new(conn,req,len,false));
+        conn->fwd_pending = 1;
+    }
+    conn->fwd_active = true;
+    return true;
+}
+
+//process one request one at a time 
+static bool try_one_request(Conn *conn){
+    //the responses must keep the request order, so wait for the forwarded one first
+    if(conn->fwd_active) return false;
+    //try to parese the request by following the protocol
+    if(buf_size(conn->incoming)<4) return false;   //this means the size of incoming buffer is less than 1 byte 
+
+    uint32_t len = 0;
+    memcpy(&len,buf_data(conn->incoming),4); 
+    if(len>k_max_msg){
+        msg("too long ");
+        conn->want_close = true;
+        return false;
+    }
+    //message body 
+    if(4+len > buf_size(conn->incoming)) return false;
+
+    const uint8_t *request = buf_data(conn->incoming)+4;
+     //assumption of got one requet now doing the applicaitom logic 
+    std::vector<std::string_view> &cmd = conn->args;
+    if(parse_req(request,len,cmd) <0){
+        msg("bad request ");
+        conn->want_close = true;
+        return false;
+    }
+    //a key owned by the other shard is executed there
+    const CmdDef *def = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if(shard_forward(conn,request,len,def,cmd)){
+        buf_consume(conn->incoming,4+len);
+        return false;
+    }
+
+    size_t header_pos = 0;
+    response_begin(conn->outgoing,&header_pos);
+    do_request(def,cmd,conn->outgoing);
+    response_end(conn->outgoing,header_pos);
+
+    //the logic is done now removinng the request from teh buffer
+    buf_consume(conn->incoming,4+len);
+
+    return true;
+}
+
+//update the readiness intention from the buffers
+static void conn_update_intention(Conn *conn){
+    if(buf_size(conn->outgoing)>0){
+        //has a response 
+        conn->want_read = false;
+        conn->want_write = true;
+    }else{
+        //all data is written, a conn waiting for the other shards does not read meanwhile
+        conn->want_read = !conn->fwd_active;
+        conn->want_write = false;
+    }
+}
+
+//the application logic after some data has been written, shared by the readiness and the completion based loops
+static void handle_write_done(Conn *conn,size_t n){
+    //remove the written buffer from the outgoing 
+    buf_consume(conn->outgoing,n);
+    conn_update_intention(conn);
+}
+
+//now the call back of the application when the soket is writable 
+static void handle_write(Conn *conn){
+    assert(buf_size(conn->outgoing) >0);
+    //the socket stays writable, the reply goes out after aof_flush()
+    if(aof_hold()) return;
+    ssize_t rv = write(conn->fd,buf_data(conn->outgoing),buf_size(conn->outgoing));
+
+    if(rv<0 && errno == EAGAIN){
+        return;
+    }
+
+    if(rv <0){
+        msg_errno("write() error");
+        conn->want_close =true;
+        return ;
+
+    }
+    handle_write_done(conn,(size_t)rv);
+}
+
+//now handling teh end of the file 
+static void handle_read_eof(Conn *conn){
+    if(buf_size(conn->incoming) == 4){
+        msg("client closed");
+    }else{
+        msg("Unexpected end of the file ");
+    }
+    conn->want_close = true;
 }
 
+//the application logic after some data has been read, shared by the readiness and the completion based loops
+static void handle_read_requests(Conn *conn){
+    //now parse and generate the responses for the request 
+    while(try_one_request(conn)){}
+    conn_update_intention(conn);
+}
+
+const size_t k_read_size = 64*1024;
+
 //the call back of the applicaiton when the soceket is readable 
 static void handle_read(Conn *conn){
-    //read some data 
-    uint8_t rbuf[64*1024];
-    ssize_t rv = read(conn->fd,rbuf,sizeof(rbuf));
+    //read some data straight into the free space of the incoming buffer
+    uint8_t *rbuf = buf_prepare(conn->incoming,k_read_size);
+    ssize_t rv = read(conn->fd,rbuf,k_read_size);
     if(rv<0 && errno == EAGAIN) return ;
 
     if(rv  <0){
@@ -665,35 +2299,102 @@ static void handle_read(Conn *conn){
         conn->want_close = true;
         return ;    //want close 
     }
-    //now handling teh end of the file 
-    if(rv==0){
-        if(conn->incoming.size() == 4){
-            msg("client closed");
-        }else{
-            msg("Unexpected end of the file ");
-        }
-        conn->want_close = true;
-        return ;
+    if(rv==0) return handle_read_eof(conn);
+
+    buf_commit(conn->incoming,(size_t)rv);
+    handle_read_requests(conn);
+    //handle the write of the socket 
+    if(conn->want_write) return handle_write(conn);
+}
+
+
+//hand the new intention of a conn to the event loop backend
+static void conn_rearm(Conn *conn){
+#ifdef USE_URING
+    if(g_data.uring){
+        if(conn->want_close) conn_destroy(conn);
+        else uring_conn_arm(conn);
+        return;
     }
-    //noew append the data to teh buf
-    buf_append(conn->incoming,rbuf,(size_t)rv);
+#endif
+#ifndef USE_POLL
+    if(!conn->want_close) conn_update_events(conn);
+#endif
+    if(conn->want_close) conn_destroy(conn);
+}
+
+//all the replies are there, write the response and continue with the pipelined requests
+static void conn_forward_done(Conn *conn){
+    size_t header_pos = 0;
+    response_begin(conn->outgoing,&header_pos);
+    if(conn->fwd_gather) out_arr(conn->outgoing,conn->fwd_nelem);
+    buf_append(conn->outgoing,buf_data(conn->fwd_out),buf_size(conn->fwd_out));
+    response_end(conn->outgoing,header_pos);
+
+    buf_clear(conn->fwd_out);
+    conn->fwd_nelem = 0;
+    conn->fwd_gather = false;
+    conn->fwd_active = false;
 
-    //now parse and generate the responses for the request 
     while(try_one_request(conn)){}
+    conn_update_intention(conn);
+}
 
-    //update the readiness intention
-    if(conn->outgoing.size()>0){
-        //has a response 
-        conn->want_read = false;
-        conn->want_write = true;
-        //handle the write of the socket 
-        return handle_write(conn);
+//a reply for a connection of this shard
+static void shard_reply(ShardMsg *msg){
+    Conn *conn = msg->conn;
+    assert(conn->fwd_pending>0);
+    conn->fwd_pending--;
+    if(conn->fd<0){
+        //the conn was destroyed while it was waiting
+        delete msg;
+        conn_try_free(conn);
+        return;
+    }
+    buf_append(conn->fwd_out,buf_data(msg->out),buf_size(msg->out));
+    conn->fwd_nelem += msg->nelem;
+    delete msg;
+
+    //the outgoing buffer is not touched while an io_uring send is in flight, the completion finishes it
+    if(conn->fwd_pending == 0 && !conn->inflight){
+        conn_forward_done(conn);
+        conn_rearm(conn);
     }
 }
 
+//execute a request for a key owned by this shard and send the reply back
+static void shard_execute(ShardMsg *msg){
+    std::vector<std::string_view> &cmd = g_data.shard_args;
+    int32_t rv = parse_req(buf_data(msg->req),buf_size(msg->req),cmd);
+    assert(rv == 0);    //it was parsed by the origin shard already
+    (void)rv;
+    if(msg->gather) msg->nelem = gather_run(cmd_lookup(cmd[0]),cmd,msg->out);
+    else do_request(cmd_lookup(cmd[0]),cmd,msg->out);
+    msg->done = true;
+    if(aof_hold()) g_data.aof_replies.push_back(msg);
+    else shard_send(msg->from,msg);
+}
+
+//drain the messages from the other shards
+static void shard_process_inbox(){
+    ShardLink *link = g_shards[g_data.shard_id];
+    uint64_t cnt = 0;
+    (void)read(link->efd,&cnt,8);   //reset the eventfd, it is non blocking
+    __atomic_store_n(&link->notified,0,__ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(SpscQueue *q : link->inbox){
+        while(ShardMsg *msg = (ShardMsg *)spsc_pop(q)){
+            if(msg->done) shard_reply(msg);
+            else shard_execute(msg);
+        }
+    }
+}
 
 const  uint64_t k_idle_timeout_ms = 180*1000; //this keeps the  server alive for 3 minutes without removing the idle connections
 
+const uint64_t k_save_poll_ms = 100;
+
 static uint32_t next_timer_ms(){
     uint64_t now_ms = get_monotonic_msec();
     uint64_t next_ms = (uint64_t) -1;
@@ -703,10 +2404,30 @@ static uint32_t next_timer_ms(){
         Conn *conn = container_of(g_data.idle_list.next,Conn,idle_node);
         next_ms = conn->last_active_ms + k_idle_timeout_ms;
     }
+#ifdef USE_TTL_HEAP
     //TTL tinemrs using the heap
     if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
         next_ms = g_data.heap[0].val;
     }
+#else
+    //TTL timers on the wheel, it can wake up early to move the far timers down
+    uint64_t ttl_ms = tw_next_ms(&g_data.wheel);
+    if(ttl_ms < next_ms) next_ms = ttl_ms;
+#endif
+    //retry the messages to the full queues soon
+    if(!g_data.outbox.empty() && now_ms+1 < next_ms) next_ms = now_ms+1;
+    //look for the end of a background save or log rewrite now and then
+    if((g_data.save_pid > 0 || g_data.rewrite_pid > 0) && now_ms+k_save_poll_ms < next_ms) next_ms = now_ms+k_save_poll_ms;
+    //the writes are held until the tail of a rewrite is in the new file, look for it soon
+    if(g_data.rewrite_tail && now_ms+1 < next_ms) next_ms = now_ms+1;
+    //the fsync of everysec, or the retry of a failed write
+    if(g_data.aof_dirty){
+        uint64_t sync_ms = g_data.aof_sync_ms + k_aof_sync_ms;
+        //not done yet because the last one is still running
+        if(sync_ms <= now_ms) sync_ms = now_ms+k_save_poll_ms;
+        if(sync_ms < next_ms) next_ms = sync_ms;
+    }
+    if(buf_size(g_data.aof_buf) && now_ms+k_save_poll_ms < next_ms) next_ms = now_ms+k_save_poll_ms;
     //time out value 
     if(next_ms == (uint64_t)-1) return -1; //this means no timers nad n timeout s
 
@@ -715,11 +2436,11 @@ static uint32_t next_timer_ms(){
     return (uint32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode *node,HNode *key){
-    return node==key;
-}
-
 static void process_timers(){
+    //not a timer, but it runs once per loop iteration as well: take back the blocks the thread pool freed
+    slab_collect();
+    snap_check();
+    aof_check();
     uint64_t now_ms = get_monotonic_msec();
     //idle timers using the linked list
     while(!dlist_empty(&g_data.idle_list)){
@@ -730,48 +2451,65 @@ static void process_timers(){
         fprintf(stderr,"removing the idle connections: %d\n",conn->fd);
         conn_destroy(conn);
     }
-    //TTL timers using a heap
-    const size_t k_max_works = 2000;
+    //TTL timers, the expired keys are removed until the budget runs out. The ones left over make
+    // next_timer_ms() return 0 so the next cycle runs right after the I/O of this iteration
+    uint64_t start_ns = get_monotonic_nsec();
     size_t nwork= 0;
+#ifdef USE_TTL_HEAP
+    //TTL timers using a heap
     const std::vector<HeapItem> &heap = g_data.heap;
     while(!heap.empty() && heap[0].val<now_ms){
         Entry *ent= container_of(heap[0].ref,Entry,heap_idx);
+#else
+    //TTL timers on the wheel, the due ones left over wait in its due list
+    tw_advance(&g_data.wheel,now_ms);
+    while(TWNode *timer = tw_due(&g_data.wheel)){
+        Entry *ent = container_of(timer,EntryTTL,timer)->ent;
+#endif
         HNode *node = hm_delete(&g_data.db,&ent->node,&hnode_same);
         assert(node == &ent->node);
         
         entry_del(ent);
-        if(nwork++ >=k_max_works) break;
-        //dont stall the server if too many keys are expiring at once
+        //the clock is read every 32 keys
+        if((++nwork & 31) == 0 && get_monotonic_nsec()-start_ns >= g_data.expire_budget_ns) break;
     }
+#ifdef USE_TTL_HEAP
+    bool more = !heap.empty() && heap[0].val<now_ms;
+#else
+    bool more = tw_due(&g_data.wheel) != NULL;
+#endif
+    uint64_t &budget = g_data.expire_budget_ns;
+    if(more) budget = budget*2 < k_expire_budget_max_ns ? budget*2 : k_expire_budget_max_ns;
+    else budget = budget/2 > k_expire_budget_min_ns ? budget/2 : k_expire_budget_min_ns;
 }
 
-int main(){
-    //initialissaiton
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool,4);
-
-    //listening socke t
-    int fd = socket(AF_INET,SOCK_STREAM,0);
-    if(fd<0) die("socket()");
-
-    int val = 1;
-    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&val,sizeof(val));
+//the application call back for a ready connection socket
+static void handle_conn_ready(Conn *conn,bool readable,bool writable,bool error){
+    //update the idle timers by moving the conn to the end of the list 
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&g_data.idle_list,&conn->idle_node);
 
-    //now bindit
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
-    addr.sin_addr.s_addr= htonl(0); //wild card ip address 0.0.0.0
-    int rv = bind(fd,(const sockaddr *)&addr,sizeof(addr));
-    if(rv) die("bind()");
+    //jhandling the io 
+    if(readable){
+        assert(conn->want_read);
+        handle_read(conn);
+    }
 
-    //set the fd to the non blockign mode 
-    fd_set_nb(fd);
-    //listen to the connections
-    rv = listen(fd,SOMAXCONN);
-    if(rv) die("listen()");
+    if(writable){
+        assert(conn->want_write);
+        handle_write(conn);
+    }
+#ifndef USE_POLL
+    if(!conn->want_close) conn_update_events(conn);
+#endif
+    //close the socket if there is socket error or the application error 
+    if(error ||conn->want_close) conn_destroy(conn);
+}
 
-    //the event loop 
+#ifdef USE_POLL
+//the poll() backend rebuilds the whole pollfd array on every iteration
+static void event_loop(int fd){
     std::vector<struct pollfd> poll_args;
     while(true){
         //preparae the arguments of the poll()
@@ -779,6 +2517,13 @@ int main(){
         //put the listening sockets int the first position 
         struct pollfd pfd = {fd,POLLIN,0};
         poll_args.push_back(pfd);
+        //then the wakeups from the other shards
+        size_t first_conn = 1;
+        if(g_data.efd>=0){
+            struct pollfd pfd = {g_data.efd,POLLIN,0};
+            poll_args.push_back(pfd);
+            first_conn = 2;
+        }
         //the rest are teh connecction sockets
         for(Conn *conn : g_data.fd2conn){
             if(!conn) continue;
@@ -792,41 +2537,662 @@ int main(){
             poll_args.push_back(pfd);
         }
         //wait for the readiness 
+        aof_flush();
         int32_t timeout_ms = next_timer_ms();
         //mow the socket need not to wait for the infinite time for the connection rather thatn that wait for the timeout connection time nad then break the client or the server
         int rv = poll(poll_args.data(),(nfds_t)poll_args.size(),timeout_ms);
         if(rv<0 &&errno == EINTR)continue;
         if(rv<0) die("Poll()");
 
-        //handle the listening sockets 
-        if(poll_args[0].revents) handle_accept(fd);
+        //handle the listening sockets, accept everything that is queued
+        if(poll_args[0].revents){
+            while(handle_accept(fd) == 0){}
+        }
+        if(first_conn == 2 && poll_args[1].revents) shard_process_inbox();
         //now handling the conectio sockets 
-        for(size_t i=1;i<poll_args.size();++i){
+        for(size_t i=first_conn;i<poll_args.size();++i){
             uint32_t ready = poll_args[i].revents;
             if(ready==0) continue; //this means the socket is not ready so skip teh current itereation
             Conn *conn = g_data.fd2conn[poll_args[i].fd];
+            handle_conn_ready(conn,ready & POLLIN,ready & POLLOUT,ready & POLLERR);
+        }
+        //handle timers 
+        process_timers();
+        shard_flush_outbox();
+    }
+}
+#else
+//the epoll() backend only gets the ready sockets, so a wakeup is O(ready) instead of O(connections)
+static void event_loop(int fd){
+    g_data.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(g_data.epfd<0) die("epoll_create1()");
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if(epoll_ctl(g_data.epfd,EPOLL_CTL_ADD,fd,&ev) <0) die("epoll_ctl()");
+    if(g_data.efd>=0){
+        ev.data.fd = g_data.efd;
+        if(epoll_ctl(g_data.epfd,EPOLL_CTL_ADD,g_data.efd,&ev) <0) die("epoll_ctl()");
+    }
 
-            //update the idle timers by moving the conn to the end of the list 
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list,&conn->idle_node);
-            
-
-            //jhandling the io 
-            if(ready & POLLIN){
-                assert(conn->want_read);
-                handle_read(conn);
+    std::vector<struct epoll_event> events(1024);
+    while(true){
+        //wait for the readiness, the log is written first so the replies held for it can go
+        aof_flush();
+        int32_t timeout_ms = next_timer_ms();
+        int rv = epoll_wait(g_data.epfd,events.data(),(int)events.size(),timeout_ms);
+        if(rv<0 &&errno == EINTR)continue;
+        if(rv<0) die("epoll_wait()");
+
+        for(int i=0;i<rv;++i){
+            uint32_t ready = events[i].events;
+            if(events[i].data.fd == fd){
+                //handle the listening sockets, accept everything that is queued
+                while(handle_accept(fd) == 0){}
+                continue;
             }
-
-            if(ready & POLLOUT){
-                assert(conn->want_write);
-                handle_write(conn);
+            if(events[i].data.fd == g_data.efd){
+                shard_process_inbox();
+                continue;
             }
-            //close the socket if there is socket error or the application error 
-            if((ready & POLLERR) ||conn->want_close) conn_destroy(conn);
+            Conn *conn = g_data.fd2conn[events[i].data.fd];
+            if(!conn) continue;
+            handle_conn_ready(conn,ready & EPOLLIN,ready & EPOLLOUT,ready & EPOLLERR);
         }
+        //a full batch means there may be more ready sockets than the array can hold
+        if((size_t)rv == events.size()) events.resize(events.size()*2);
         //handle timers 
         process_timers();
+        shard_flush_outbox();
+    }
+}
+#endif
+
+#ifdef USE_URING
+//the user_data of an sqe is the Conn pointer with the operation in the low bits
+enum{
+    UOP_LISTEN = 0,
+    UOP_RECV = 1,
+    UOP_SEND = 2,
+    UOP_WAKE = 3,   //the eventfd of the shard, like UOP_LISTEN it has no conn
+};
+const uint64_t k_uop_mask = 3;
+const uint32_t k_uring_entries = 4096;
+//the provided buffers which the kernel fills on recv
+const uint16_t k_uring_bgid = 0;
+const uint32_t k_uring_nbufs = 512;
+const uint32_t k_uring_buf_size = 16*1024;
+
+static struct io_uring_sqe *uring_sqe(){
+    //a full queue is submitted right away, a held send must not go out with it
+    URing *ring = g_data.uring;
+    if(*ring->sq_tail + ring->sq_pending - __atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE) > ring->sq_mask) aof_flush();
+    struct io_uring_sqe *sqe = uring_get_sqe(g_data.uring);
+    if(!sqe) die("io_uring_enter()");
+    return sqe;
+}
+
+//a multishot poll, the accept and the eventfd read are the usual handle_accept() and shard_process_inbox()
+static void uring_submit_poll(int fd,uint64_t op){
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = op;
+}
+
+//the kernel picks the buffer from the provided buffer ring when the data arrives
+static void uring_submit_recv(Conn *conn){
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->len = k_uring_buf_size;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | UOP_RECV;
+    conn->inflight++;
+}
+
+//the outgoing buffer is not touched until the send completes because the conn does not read meanwhile
+static void uring_submit_send(Conn *conn){
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf_data(conn->outgoing);
+    sqe->len = (uint32_t)buf_size(conn->outgoing);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | UOP_SEND;
+    conn->inflight++;
+}
+
+//queue the next operation from the application intention, the sqes are submitted together in the next loop turn
+static void uring_conn_arm(Conn *conn){
+    if(conn->inflight) return;  //one operation at a time, the completion arms the next one
+    if(conn->want_write) uring_submit_send(conn);
+    else if(conn->want_read) uring_submit_recv(conn);
+}
+
+static void uring_handle_cqe(int fd,const struct io_uring_cqe *cqe){
+    if(cqe->user_data == UOP_LISTEN){
+        //handle the listening sockets, accept everything that is queued
+        while(handle_accept(fd) == 0){}
+        if(!(cqe->flags & IORING_CQE_F_MORE)) uring_submit_poll(fd,UOP_LISTEN);
+        return;
+    }
+    if(cqe->user_data == UOP_WAKE){
+        shard_process_inbox();
+        if(!(cqe->flags & IORING_CQE_F_MORE)) uring_submit_poll(g_data.efd,UOP_WAKE);
+        return;
+    }
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~k_uop_mask);
+    uint32_t op = (uint32_t)(cqe->user_data & k_uop_mask);
+    conn->inflight--;
+    bool has_buf = op == UOP_RECV && cqe->res>0 && (cqe->flags & IORING_CQE_F_BUFFER);
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if(conn->fd<0){
+        //the conn was destroyed while the operation was in flight
+        if(has_buf) ubuf_ring_recycle(&g_data.bufring,bid);
+        conn_try_free(conn);
+        return;
+    }
+    //update the idle timers by moving the conn to the end of the list 
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&g_data.idle_list,&conn->idle_node);
+
+    if(op == UOP_RECV){
+        if(has_buf){
+            //noew append the data to teh buf
+            buf_append(conn->incoming,ubuf_ring_buf(&g_data.bufring,bid),(size_t)cqe->res);
+            ubuf_ring_recycle(&g_data.bufring,bid);
+            handle_read_requests(conn);
+        }else if(cqe->res == 0){
+            handle_read_eof(conn);
+        }else if(cqe->res != -ENOBUFS){
+            //ENOBUFS only means that every buffer was in use, the recv is retried
+            errno = -cqe->res;
+            msg_errno("recv() error");
+            conn->want_close = true;
+        }
+    }else{
+        if(cqe->res<0){
+            errno = -cqe->res;
+            msg_errno("send() error");
+            conn->want_close = true;
+        }else{
+            handle_write_done(conn,(size_t)cqe->res);
+        }
+    }
+    //the replies from the other shards arrived while the operation was in flight
+    if(conn->fwd_active && !conn->fwd_pending && !conn->want_close) conn_forward_done(conn);
+    if(conn->want_close) conn_destroy(conn);
+    else uring_conn_arm(conn);
+}
+
+//the io_uring backend: the reads and writes of a whole loop turn go to the kernel in one syscall
+static int uring_event_loop(int fd){
+    URing ring;
+    if(uring_init(&ring,k_uring_entries)<0) return -1;
+    if(ubuf_ring_init(&ring,&g_data.bufring,k_uring_bgid,k_uring_nbufs,k_uring_buf_size)<0){
+        uring_exit(&ring);
+        return -1;
+    }
+    g_data.uring = &ring;
+    uring_submit_poll(fd,UOP_LISTEN);
+    if(g_data.efd>=0) uring_submit_poll(g_data.efd,UOP_WAKE);
+
+    while(true){
+        //submit the queued operations and wait for the completions, the sends after the log is written
+        aof_flush();
+        int32_t timeout_ms = next_timer_ms();
+        if(uring_submit_and_wait(&ring,timeout_ms)<0) die("io_uring_enter()");
+
+        while(struct io_uring_cqe *cqe = uring_peek_cqe(&ring)){
+            //copy it out so the slot can be reused by the kernel right away
+            struct io_uring_cqe c = *cqe;
+            uring_cqe_seen(&ring);
+            uring_handle_cqe(fd,&c);
+        }
+        //handle timers 
+        process_timers();
+        shard_flush_outbox();
+    }
+    return 0;
+}
+#endif
+
+static int listen_socket(bool reuseport){
+    //listening socke t
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+    if(fd<0) die("socket()");
+
+    int val = 1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&val,sizeof(val));
+    //every shard has its own listening socket on the same port and the kernel spreads the connections
+    if(reuseport && setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&val,sizeof(val))) die("SO_REUSEPORT");
+
+    //now bindit
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1234);
+    addr.sin_addr.s_addr= htonl(0); //wild card ip address 0.0.0.0
+    int rv = bind(fd,(const sockaddr *)&addr,sizeof(addr));
+    if(rv) die("bind()");
+
+    //set the fd to the non blockign mode 
+    fd_set_nb(fd);
+    //listen to the connections
+    rv = listen(fd,SOMAXCONN);
+    if(rv) die("listen()");
+    return fd;
+}
+
+//a record of a dump file and the hash of its key, the hash also picks the shard
+struct SnapRef{
+    uint64_t pos = 0;
+    uint64_t hcode = 0;
+};
+
+//a segment of a dump file, decoded on the thread pool into the records of every shard
+struct SnapJob{
+    const DumpFile *f = NULL;
+    size_t seg = 0;
+    const char *err = NULL;
+    std::vector<std::vector<SnapRef>> refs;     //by shard, in the file order
+};
+
+//the files of the last save, mapped and decoded once for all the shards before they start
+static std::vector<DumpFile> g_snap_files;
+static std::vector<char *> g_snap_paths;
+static std::vector<SnapJob> g_snap_jobs;
+static WaitGroup g_snap_wg;
+static uint64_t g_snap_unix_ms = 0;
+
+//check the checksum of the segment, then find the records which are not expired and their shards.
+// Only the keys are hashed here, the shards make the entries since the slab heaps are per thread
+static void snap_decode_func(void *arg){
+    SnapJob *job = (SnapJob *)arg;
+    const DumpSeg &seg = job->f->segs[job->seg];
+    job->refs.resize(g_shards.size());
+    if(!dump_seg_ok(job->f,job->seg)){
+        job->err = "bad segment checksum";
+        return wait_group_done(&g_snap_wg);
+    }
+    size_t pos = seg.begin,at = pos;
+    DumpRec rec;
+    int rv = 0;
+    while((rv = dump_next(job->f,&pos,seg.end,&rec)) > 0){
+        SnapRef ref;
+        ref.pos = at;
+        at = pos;
+        //an empty zset is not a key, an older file may still have one
+        if(rec.type == DUMP_ZSET && rec.nmembers == 0) continue;
+        if(rec.deadline_ms != k_dump_no_ttl && rec.deadline_ms <= g_snap_unix_ms) continue;
+        ref.hcode = str_hash((const uint8_t *)rec.key.data(),rec.key.size());
+        job->refs[hash_shard(ref.hcode)].push_back(ref);
+    }
+    if(rv < 0) job->err = "malformed record";
+    wait_group_done(&g_snap_wg);
+}
+
+//map all the files of the last save and decode their segments in parallel. The hash seed is new in every
+// process so a key is rarely in the shard it was saved from, the first file tells how many there are
+static void snap_prepare(){
+    char path[256];
+    uint32_t nfiles = 1;
+    uint64_t start_ms = get_monotonic_msec(),bytes = 0;
+    g_snap_unix_ms = get_realtime_msec();
+    for(uint32_t i=0;i<nfiles;++i){
+        dump_path(path,sizeof(path),i,false);
+        DumpFile f;
+        if(!dump_open(&f,path)){
+            if(errno == ENOENT) continue;
+            //refuse to start, the next save would replace it with less
+            fprintf(stderr,"%s: %s\n",path,errno ? strerror(errno) : "not a complete dump file");
+            exit(1);
+        }
+        if(i == 0) nfiles = f.hdr.nshards;
+        bytes += f.size;
+        g_snap_files.push_back(f);
+        g_snap_paths.push_back(strdup(path));
+    }
+    //the jobs point into the vectors, they are filled before anything is queued
+    for(size_t i=0;i<g_snap_files.size();++i){
+        for(size_t j=0;j<g_snap_files[i].segs.size();++j){
+            SnapJob job;
+            job.f = &g_snap_files[i];
+            job.seg = j;
+            g_snap_jobs.push_back(job);
+        }
+    }
+    wait_group_init(&g_snap_wg,g_snap_jobs.size());
+    for(SnapJob &job : g_snap_jobs) thread_pool_queue(&g_thread_pool,&snap_decode_func,&job);
+    wait_group_wait(&g_snap_wg);
+    for(SnapJob &job : g_snap_jobs){
+        if(job.err){
+            fprintf(stderr,"%s: %s\n",g_snap_paths[job.f - g_snap_files.data()],job.err);
+            exit(1);
+        }
+    }
+    if(!g_snap_files.empty()){
+        fprintf(stderr,"decoded %zu segments of %zu dump files, %llu MB in %llu ms\n",g_snap_jobs.size(),
+            g_snap_files.size(),(unsigned long long)(bytes >> 20),(unsigned long long)(get_monotonic_msec()-start_ms));
+    }
+}
+
+//make the entries of the records which the decode found for this shard, the table is sized for all of
+// them first so it never rehashes on the way
+static void snap_load(){
+    if(g_snap_jobs.empty()) return;
+    uint64_t start_ms = get_monotonic_msec(),nkeys = 0;
+    size_t n = 0;
+    for(SnapJob &job : g_snap_jobs) n += job.refs[g_data.shard_id].size();
+    hm_reserve(&g_data.db,n);
+    std::vector<ZAdd> members;
+    for(SnapJob &job : g_snap_jobs){
+        std::vector<SnapRef> &refs = job.refs[g_data.shard_id];
+        const DumpSeg &seg = job.f->segs[job.seg];
+        for(const SnapRef &ref : refs){
+            size_t pos = (size_t)ref.pos;
+            DumpRec rec;
+            int rv = dump_next(job.f,&pos,seg.end,&rec);
+            assert(rv > 0);     //it was decoded already
+            (void)rv;
+            LookupKey key;
+            key.key = rec.key;
+            key.node.hcode = ref.hcode;
+            //a key in two files comes from the saves of two runs, the first one is kept
+            if(hm_lookup(&g_data.db,&key.node,&entry_eq)) continue;
+
+            Entry *ent = NULL;
+            if(rec.type == DUMP_ZSET){
+                members.clear();
+                ZAdd m;
+                std::string_view name;
+                while(dump_next_member(&rec,&m.score,&name)){
+                    m.name = name.data();
+                    m.len = name.size();
+                    members.push_back(m);
+                }
+                ent = entry_new(T_ZSET,key.key,key.node.hcode,0);
+                zset_add_new(ent->zset,members.data(),members.size());
+            }else if(rec.type == DUMP_INT){
+                ent = entry_new(T_STR,key.key,key.node.hcode,0);
+                entry_set_int(ent,rec.ival);
+            }else{
+                ent = entry_new(T_STR,key.key,key.node.hcode,rec.val.size());
+                entry_set_str(ent,rec.val);
+            }
+            hm_insert(&g_data.db,&ent->node);
+            if(rec.deadline_ms != k_dump_no_ttl) entry_set_ttl(ent,(int64_t)(rec.deadline_ms - g_snap_unix_ms));
+            nkeys++;
+        }
+        std::vector<SnapRef>().swap(refs);
+    }
+    fprintf(stderr,"shard %u: loaded %llu keys in %llu ms\n",g_data.shard_id,
+        (unsigned long long)nkeys,(unsigned long long)(get_monotonic_msec()-start_ms));
+}
+
+//every shard has its keys, unmap the files
+static void snap_release(){
+    for(DumpFile &f : g_snap_files) dump_close(&f);
+    for(char *path : g_snap_paths) free(path);
+    g_snap_files.clear();
+    g_snap_paths.clear();
+    g_snap_jobs.clear();
+}
+
+//the whole file, false with errno set when it cannot be read
+static bool read_whole_file(const char *path,std::vector<uint8_t> &data){
+    int fd = open(path,O_RDONLY | O_CLOEXEC);
+    if(fd<0) return false;
+    struct stat st;
+    bool ok = fstat(fd,&st) == 0;
+    data.resize(ok ? (size_t)st.st_size : 0);
+    size_t got = 0;
+    while(ok && got<data.size()){
+        ssize_t rv = read(fd,data.data()+got,data.size()-got);
+        if(rv<0 && errno == EINTR) continue;
+        if(rv<0) ok = false;
+        if(rv<=0) break;
+        got += (size_t)rv;
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    data.resize(got);
+    return ok;
+}
+
+//the logs of the last run are there, they are loaded instead of the dump files
+static bool g_aof_replay = false;
+
+//find the logs of the last run and the generation of this one, false if there are none
+static bool aof_manifest_read(){
+    char path[256];
+    aof_manifest_path(path,sizeof(path),false);
+    FILE *fp = fopen(path,"r");
+    if(fp){
+        unsigned long long gen = 0;
+        unsigned nfiles = 0;
+        bool ok = fscanf(fp,"gen %llu files %u",&gen,&nfiles) == 2 && gen > 0;
+        fclose(fp);
+        if(!ok){
+            fprintf(stderr,"%s: malformed manifest\n",path);
+            exit(1);
+        }
+        g_aof_load_gen = gen;
+        g_aof_load_nfiles = nfiles;
+    }else{
+        if(errno != ENOENT){
+            fprintf(stderr,"%s: %s\n",path,strerror(errno));
+            exit(1);
+        }
+        //the files of an older server are numbered from 0 on
+        uint32_t nfiles = 0;
+        for(;;++nfiles){
+            aof_path(path,sizeof(path),0,nfiles,false);
+            if(access(path,F_OK)) break;
+        }
+        g_aof_load_gen = 0;
+        g_aof_load_nfiles = nfiles;
+    }
+    g_aof_gen = g_aof_load_gen+1;
+    return g_aof_load_gen > 0 || g_aof_load_nfiles > 0;
+}
+
+//a rename is only safe on the disk once the directory is synced
+static void fsync_dir(const char *path){
+    char dir[256];
+    snprintf(dir,sizeof(dir),"%s",path);
+    char *slash = strrchr(dir,'/');
+    if(slash == dir) dir[1] = 0;
+    else if(slash) *slash = 0;
+    else snprintf(dir,sizeof(dir),".");
+    int fd = open(dir,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd<0 || fsync(fd)) die("fsync() of the log directory");
+    close(fd);
+}
+
+//shard 0 switches the manifest to the files every shard has written, then the old ones can go
+static void aof_manifest_write(){
+    char path[256],tmp[256];
+    aof_manifest_path(path,sizeof(path),false);
+    aof_manifest_path(tmp,sizeof(tmp),true);
+    //the new log files first, the manifest must never name a file which is not there
+    fsync_dir(path);
+    char line[64];
+    int len = snprintf(line,sizeof(line),"gen %llu files %u\n",(unsigned long long)g_aof_gen,g_data.nshards);
+    int fd = open(tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+    if(fd<0 || !write_all(fd,(const uint8_t *)line,(size_t)len) || fsync(fd) || close(fd) || rename(tmp,path)){
+        fprintf(stderr,"%s: %s\n",path,strerror(errno));
+        exit(1);
+    }
+    fsync_dir(path);
+    for(uint32_t i=0;i<g_aof_load_nfiles;++i){
+        aof_path(path,sizeof(path),g_aof_load_gen,i,false);
+        unlink(path);
+    }
+    //a start which crashed before its manifest may have left more files of this generation
+    for(uint32_t i=g_data.nshards;;++i){
+        aof_path(path,sizeof(path),g_aof_gen,i,false);
+        if(unlink(path)) break;
+    }
+}
+
+//replay the logs the manifest names with the usual parser and handlers. Like the dump files, every shard
+// reads all of them and runs the commands on its own keys
+static void aof_load(){
+    char path[256];
+    std::vector<uint8_t> data;
+    std::vector<std::string_view> cmd;
+    Buffer out;
+    uint64_t ncmds = 0,start_ms = get_monotonic_msec();
+    for(uint32_t i=0;i<g_aof_load_nfiles;++i){
+        aof_path(path,sizeof(path),g_aof_load_gen,i,false);
+        if(!read_whole_file(path,data)){
+            fprintf(stderr,"%s: %s\n",path,strerror(errno));
+            exit(1);
+        }
+        size_t pos = 0;
+        while(data.size()-pos >= 4){
+            uint32_t len = 0;
+            memcpy(&len,&data[pos],4);
+            if(len > data.size()-pos-4) break;
+            const CmdDef *def = NULL;
+            if(parse_req(&data[pos+4],len,cmd) == 0 && !cmd.empty()) def = cmd_lookup(cmd[0]);
+            if(!def || !(def->flags & CMD_WRITE) || !cmd_arity_ok(def,cmd.size())){
+                //not a torn write at the end, refuse to start like with a bad dump file
+                fprintf(stderr,"%s: malformed command at offset %zu\n",path,pos);
+                exit(1);
+            }
+            pos += 4+len;
+            if(key_shard(cmd[def->first_key]) != g_data.shard_id) continue;
+            buf_clear(out);
+            def->handler(cmd,out);
+            ncmds++;
+        }
+        //the last write was cut short by a crash, the rewrite after the load drops it
+        if(pos < data.size() && g_data.shard_id == 0){
+            fprintf(stderr,"%s: ignoring %zu bytes of an incomplete command at the end\n",path,data.size()-pos);
+        }
+    }
+    fprintf(stderr,"shard %u: replayed %llu commands from %u log files in %llu ms\n",g_data.shard_id,
+        (unsigned long long)ncmds,g_aof_load_nfiles,(unsigned long long)(get_monotonic_msec()-start_ms));
+}
+
+//no shard accepts connections before all of them have loaded, a forwarded request would see a part of the data.
+// aof_start() waits at it as well
+static pthread_barrier_t g_load_barrier;
+
+//after the load every shard writes its log from its data into a new generation, the old one may be for
+// another shard count and is replayed again if this start does not get as far as the manifest
+static void aof_start(){
+    char path[256],tmp[256];
+    aof_path(path,sizeof(path),g_aof_gen,g_data.shard_id,false);
+    aof_path(tmp,sizeof(tmp),g_aof_gen,g_data.shard_id,true);
+    if(!aof_rewrite_file(tmp) || rename(tmp,path)){
+        fprintf(stderr,"%s: %s\n",path,strerror(errno));
+        exit(1);
+    }
+    //the manifest names the new files once all of them are complete, and no shard appends to its
+    // file before that, a write there would be lost with a crash in between
+    pthread_barrier_wait(&g_load_barrier);
+    if(g_data.shard_id == 0) aof_manifest_write();
+    pthread_barrier_wait(&g_load_barrier);
+    g_data.aof_fd = open(path,O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(g_data.aof_fd<0) die("open() of the append only log");
+    g_data.aof_sync_ms = get_monotonic_msec();
+}
+
+//create the queues and the eventfds before any shard thread runs
+static void shards_init(uint32_t nshards){
+    g_shards.resize(nshards);
+    for(uint32_t i=0;i<nshards;++i){
+        ShardLink *link = new ShardLink();
+        if(nshards>1){
+            link->efd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+            if(link->efd<0) die("eventfd()");
+            link->inbox.resize(nshards);
+            for(uint32_t j=0;j<nshards;++j) link->inbox[j] = new SpscQueue();
+        }
+        g_shards[i] = link;
+    }
+}
+
+//one event loop per shard, it owns the keys of the shard and the connections it accepted
+static void *shard_main(void *arg){
+    //initialissaiton
+    g_data.shard_id = (uint32_t)(uintptr_t)arg;
+    g_data.nshards = (uint32_t)g_shards.size();
+    g_data.efd = g_shards[g_data.shard_id]->efd;
+    dlist_init(&g_data.idle_list);
+#ifndef USE_TTL_HEAP
+    tw_init(&g_data.wheel,get_monotonic_msec());
+#endif
+    if(g_aof_replay) aof_load();
+    else snap_load();
+    pthread_barrier_wait(&g_load_barrier);
+    if(g_data.shard_id == 0) snap_release();
+    if(g_aof_on) aof_start();
+    int fd = listen_socket(g_shards.size()>1);
+
+    //the event loop 
+#ifdef USE_URING
+    if(uring_event_loop(fd)<0) msg("io_uring is not available, using the readiness based loop");
+#endif
+    event_loop(fd);
+    return NULL;
+}
+
+int main(int argc,char **argv){
+    uint32_t nshards = 1;
+    for(int i=1;i<argc;++i){
+        if(!strcmp(argv[i],"--shards") && i+1<argc){
+            nshards = (uint32_t)atoi(argv[++i]);
+        }else if(!strcmp(argv[i],"--zset-max-listpack-entries") && i+1<argc){
+            g_zset_max_listpack_entries = (size_t)atoll(argv[++i]);
+        }else if(!strcmp(argv[i],"--zset-max-listpack-value") && i+1<argc){
+            g_zset_max_listpack_value = (size_t)atoll(argv[++i]);
+        }else if(!strcmp(argv[i],"--dbfilename") && i+1<argc){
+            g_dump_prefix = argv[++i];
+        }else if(!strcmp(argv[i],"--appendonly")){
+            g_aof_on = true;
+        }else if(!strcmp(argv[i],"--appendfsync") && i+1<argc && !strcmp(argv[i+1],"always")){
+            g_aof_fsync = AOF_FSYNC_ALWAYS;
+            ++i;
+        }else if(!strcmp(argv[i],"--appendfsync") && i+1<argc && !strcmp(argv[i+1],"everysec")){
+            g_aof_fsync = AOF_FSYNC_EVERYSEC;
+            ++i;
+        }else if(!strcmp(argv[i],"--appendfsync") && i+1<argc && !strcmp(argv[i+1],"no")){
+            g_aof_fsync = AOF_FSYNC_NO;
+            ++i;
+        }else if(!strcmp(argv[i],"--appendfilename") && i+1<argc){
+            g_aof_prefix = argv[++i];
+        }else{
+            fprintf(stderr,"usage: %s [--shards N] [--zset-max-listpack-entries N] [--zset-max-listpack-value N] [--dbfilename PREFIX]\n"
+                "       [--appendonly] [--appendfsync always|everysec|no] [--appendfilename PREFIX]\n",argv[0]);
+            return 1;
+        }
+    }
+    if(nshards<1) nshards = 1;
+
+    //before anything is hashed, every shard uses the same seed so the key routing agrees
+    hash_init();
+    thread_pool_init(&g_thread_pool,4);
+    shards_init(nshards);
+    pthread_barrier_init(&g_load_barrier,NULL,nshards);
+    //the log has every write up to the end of the last run, it wins over the dump
+    g_aof_replay = g_aof_on && aof_manifest_read();
+    if(!g_aof_replay) snap_prepare();
+    //the main thread is the shard 0
+    for(uint32_t i=1;i<nshards;++i){
+        pthread_t tid;
+        if(pthread_create(&tid,NULL,&shard_main,(void *)(uintptr_t)i)) die("pthread_create()");
     }
+    shard_main((void *)0);
     return 0;
 }
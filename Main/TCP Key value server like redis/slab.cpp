@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define SLAB_POISON(p,n)    ASAN_POISON_MEMORY_REGION(p,n)
+#define SLAB_UNPOISON(p,n)  ASAN_UNPOISON_MEMORY_REGION(p,n)
+#else
+#define SLAB_POISON(p,n)    ((void)(p),(void)(n))
+#define SLAB_UNPOISON(p,n)  ((void)(p),(void)(n))
+#endif
+
+static const uint32_t k_slab_sizes[k_slab_nclass] = {
+    16,32,48,64,80,96,112,128,
+    160,192,224,256,320,384,448,512,
+    640,768,896,1024,
+};
+
+//the class of every size in steps of 16, built by the compiler
+struct SlabClassOf{
+    uint8_t cls[k_slab_max/16 + 1] = {};
+};
+static constexpr SlabClassOf slab_class_of_build(){
+    SlabClassOf t;
+    uint32_t c = 0;
+    for(size_t i=0;i<=k_slab_max/16;++i){
+        while(k_slab_sizes[c] < i*16) ++c;
+        t.cls[i] = (uint8_t)c;
+    }
+    return t;
+}
+static constexpr SlabClassOf k_slab_class_of = slab_class_of_build();
+
+const size_t k_slab_span = 32;      //pages per mmap()
+
+struct SlabHeap;
+
+//at the start of every page, the blocks follow it
+struct SlabPage{
+    SlabHeap *owner = NULL;
+    uint32_t cls = 0;
+    uint32_t size = 0;
+};
+const size_t k_slab_header = 64;
+static_assert(sizeof(SlabPage) <= k_slab_header,"the page header");
+
+struct SlabClass{
+    void *free = NULL;      //the freed blocks, linked through their first word
+    char *bump = NULL;      //the part of the newest page which was never handed out
+    char *end = NULL;
+    SlabStats stats;
+};
+
+struct SlabHeap{
+    alignas(64) void *remote = NULL;    //pushed by the other threads, taken all at once by the owner
+    alignas(64) SlabClass cls[k_slab_nclass];
+    char *span = NULL;      //the pages of the last mmap() which are not used yet
+    char *span_end = NULL;
+};
+
+//created on the first allocation of a thread, a thread which only frees never has one
+static thread_local SlabHeap *g_slab = NULL;
+
+static SlabPage *slab_page_of(const void *ptr){
+    return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_page-1));
+}
+
+static char *slab_new_page(SlabHeap *heap){
+    if(heap->span == heap->span_end){
+        //map one page more and cut off the ends, the pages must be aligned to their size
+        size_t len = k_slab_span*k_slab_page;
+        char *mem = (char *)mmap(NULL,len+k_slab_page,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(mem == MAP_FAILED){
+            fprintf(stderr,"slab: mmap() failed\n");
+            abort();
+        }
+        char *start = (char *)(((uintptr_t)mem + k_slab_page-1) & ~(uintptr_t)(k_slab_page-1));
+        if(start != mem) munmap(mem,start-mem);
+        munmap(start+len,(mem+len+k_slab_page)-(start+len));
+        heap->span = start;
+        heap->span_end = start+len;
+    }
+    char *page = heap->span;
+    heap->span += k_slab_page;
+    return page;
+}
+
+//put a block back on its class list, only the owner does this
+static void slab_push(SlabHeap *heap,SlabPage *page,void *ptr){
+    SlabClass &c = heap->cls[page->cls];
+    *(void **)ptr = c.free;
+    c.free = ptr;
+    SLAB_POISON((char *)ptr+sizeof(void *),page->size-sizeof(void *));
+    c.stats.used--;
+    c.stats.frees++;
+}
+
+static void slab_drain(SlabHeap *heap){
+    if(!__atomic_load_n(&heap->remote,__ATOMIC_RELAXED)) return;
+    void *list = __atomic_exchange_n(&heap->remote,NULL,__ATOMIC_ACQUIRE);
+    while(list){
+        void *next = *(void **)list;
+        SlabPage *page = slab_page_of(list);
+        heap->cls[page->cls].stats.remote_frees++;
+        slab_push(heap,page,list);
+        list = next;
+    }
+}
+
+static SlabHeap *slab_heap(){
+    if(!g_slab){
+        g_slab = new SlabHeap();
+        for(size_t i=0;i<k_slab_nclass;++i) g_slab->cls[i].stats.size = k_slab_sizes[i];
+    }
+    return g_slab;
+}
+
+void *slab_alloc(size_t size){
+    assert(size>0 && size<=k_slab_max);
+    SlabHeap *heap = slab_heap();
+    uint32_t cls = k_slab_class_of.cls[(size+15)/16];
+    SlabClass &c = heap->cls[cls];
+    if(!c.free) slab_drain(heap);
+
+    void *ptr = c.free;
+    if(ptr){
+        SLAB_UNPOISON(ptr,k_slab_sizes[cls]);
+        c.free = *(void **)ptr;
+    }else{
+        //carve a new block, a new page when the current one is used up
+        if(c.end - c.bump < (ptrdiff_t)k_slab_sizes[cls]){
+            char *mem = slab_new_page(heap);
+            SlabPage *page = (SlabPage *)mem;
+            page->owner = heap;
+            page->cls = cls;
+            page->size = k_slab_sizes[cls];
+            c.bump = mem + k_slab_header;
+            c.end = mem + k_slab_page;
+            c.stats.pages++;
+        }
+        ptr = c.bump;
+        c.bump += k_slab_sizes[cls];
+    }
+    c.stats.used++;
+    c.stats.allocs++;
+    return ptr;
+}
+
+void slab_free(void *ptr){
+    if(!ptr) return;
+    SlabPage *page = slab_page_of(ptr);
+    SlabHeap *heap = page->owner;
+    if(heap == g_slab) return slab_push(heap,page,ptr);
+    //a lock free stack push, the owner never pops single blocks so there is no ABA
+    void *head = __atomic_load_n(&heap->remote,__ATOMIC_RELAXED);
+    do{
+        *(void **)ptr = head;
+    }while(!__atomic_compare_exchange_n(&heap->remote,&head,ptr,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+size_t slab_size(const void *ptr){
+    return slab_page_of(ptr)->size;
+}
+
+void slab_collect(){
+    if(g_slab) slab_drain(g_slab);
+}
+
+void slab_stats(SlabStats out[k_slab_nclass]){
+    SlabHeap *heap = slab_heap();
+    for(size_t i=0;i<k_slab_nclass;++i) out[i] = heap->cls[i].stats;
+}
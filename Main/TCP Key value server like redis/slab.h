@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size class slabs for the small objects of the server (Entry, ZNode, ZSet, Conn)
+//  every thread allocates from a heap of its own, a block is carved out of a 64KB page of its size class
+//  and goes back to a per class free list. A block freed by another thread (the thread pool) is pushed
+//  to the remote list of the owning heap, the owner takes it back in slab_collect() or when a class runs dry.
+//  The pages are never given back to the OS.
+
+const size_t k_slab_page = 64*1024;     //pages are aligned to their size, the header is at the start
+const size_t k_slab_max = 1024;         //the largest block, bigger objects use malloc
+const size_t k_slab_nclass = 20;
+
+//size must be 1..k_slab_max
+void  *slab_alloc(size_t size);
+//from any thread
+void   slab_free(void *ptr);
+//the size of the class of ptr, the block can use all of it
+size_t slab_size(const void *ptr);
+//take back the blocks the other threads freed, the event loop calls it once per iteration
+void   slab_collect();
+
+struct SlabStats{
+    uint32_t size = 0;          //the block size of the class
+    uint64_t pages = 0;
+    uint64_t used = 0;          //blocks in use
+    uint64_t allocs = 0;
+    uint64_t frees = 0;         //including the remote ones
+    uint64_t remote_frees = 0;  //freed by the other threads
+};
+
+//the classes of the heap of the calling thread
+void slab_stats(SlabStats out[k_slab_nclass]);
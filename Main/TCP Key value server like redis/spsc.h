@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//a bounded single producer single consumer queue, it needs no locks because each index has only one writer
+const size_t k_spsc_cap = 1024;   //must be the power of 2
+
+struct SpscQueue{
+    alignas(64) uint64_t head = 0;  //only written by the consumer
+    alignas(64) uint64_t tail = 0;  //only written by the producer
+    void *slots[k_spsc_cap] = {};
+};
+
+//false means the queue is full and the producer has to retry later
+inline bool spsc_push(SpscQueue *q,void *item){
+    uint64_t tail = q->tail;
+    if(tail - __atomic_load_n(&q->head,__ATOMIC_ACQUIRE) >= k_spsc_cap) return false;
+    q->slots[tail & (k_spsc_cap-1)] = item;
+    __atomic_store_n(&q->tail,tail+1,__ATOMIC_RELEASE);
+    return true;
+}
+
+//NULL means the queue is empty
+inline void *spsc_pop(SpscQueue *q){
+    uint64_t head = q->head;
+    if(head == __atomic_load_n(&q->tail,__ATOMIC_ACQUIRE)) return NULL;
+    void *item = q->slots[head & (k_spsc_cap-1)];
+    __atomic_store_n(&q->head,head+1,__ATOMIC_RELEASE);
+    return item;
+}
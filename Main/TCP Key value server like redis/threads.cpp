@@ -39,4 +39,26 @@ void thread_pool_queue(ThreadPool *tp,void (* f)(void *),void *args){
     tp->queue.push_back(Work{f,args});
     pthread_cond_signal(&tp->non_empty);
     pthread_mutex_unlock(&tp->mu);
-}
\ No newline at end of file
+}
+
+void wait_group_init(WaitGroup *wg,size_t n){
+    int rv = pthread_mutex_init(&wg->mu,NULL);
+    assert(rv==0);
+    rv = pthread_cond_init(&wg->done,NULL);
+    assert(rv==0);
+    (void)rv;
+    wg->pending = n;
+}
+
+void wait_group_done(WaitGroup *wg){
+    pthread_mutex_lock(&wg->mu);
+    assert(wg->pending>0);
+    if(--wg->pending == 0) pthread_cond_broadcast(&wg->done);
+    pthread_mutex_unlock(&wg->mu);
+}
+
+void wait_group_wait(WaitGroup *wg){
+    pthread_mutex_lock(&wg->mu);
+    while(wg->pending) pthread_cond_wait(&wg->done,&wg->mu);
+    pthread_mutex_unlock(&wg->mu);
+}
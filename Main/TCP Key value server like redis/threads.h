@@ -19,4 +19,16 @@ struct ThreadPool{
 };
 
 void thread_pool_init(ThreadPool *tp,size_t num_threads);
-void thread_pool_queue(ThreadPool *tp,void (* f)(void *),void *args);
\ No newline at end of file
+void thread_pool_queue(ThreadPool *tp,void (* f)(void *),void *args);
+
+//counts the jobs of a batch, the thread which queued them waits until the last one is done
+struct WaitGroup{
+    size_t pending = 0;
+    pthread_mutex_t mu;
+    pthread_cond_t done;
+};
+
+void wait_group_init(WaitGroup *wg,size_t n);
+//called by a job when it is finished
+void wait_group_done(WaitGroup *wg);
+void wait_group_wait(WaitGroup *wg);
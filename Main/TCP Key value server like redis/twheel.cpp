@@ -0,0 +1,171 @@
+#include <assert.h>
+#include "twheel.h"
+
+const uint64_t k_tw_span = 1ull << (k_tw_bits*k_tw_levels);
+//a call of tw_advance() moves at most this many timers down, a big slot takes a few calls
+const size_t k_tw_max_moves = 4096;
+
+void tw_init(TWheel *tw,uint64_t now_ms){
+    tw->cur_ms = now_ms;
+    tw->size = 0;
+    tw->moved_ms = (uint64_t)-1;
+    dlist_init(&tw->due);
+    dlist_init(&tw->moving);
+    for(uint32_t l=0;l<k_tw_levels;++l){
+        for(uint32_t i=0;i<k_tw_slots;++i) dlist_init(&tw->slots[l][i]);
+        for(uint32_t w=0;w<k_tw_slots/64;++w) tw->used[l][w] = 0;
+    }
+}
+
+static uint32_t tw_index(uint64_t ms,uint32_t level){
+    return (uint32_t)(ms >> (k_tw_bits*level)) & (k_tw_slots-1);
+}
+
+//the slot for the deadline as seen from cur_ms
+static void tw_place(TWheel *tw,TWNode *node){
+    uint64_t at = node->expire_ms;
+    assert(at >= tw->cur_ms);
+    if(at - tw->cur_ms >= k_tw_span) at = tw->cur_ms + k_tw_span - 1;
+    uint64_t delta = at - tw->cur_ms;
+    uint32_t level = delta ? (63 - __builtin_clzll(delta)) / k_tw_bits : 0;
+    uint32_t idx = tw_index(at,level);
+    dlist_insert_before(&tw->slots[level][idx],&node->link);
+    tw->used[level][idx/64] |= 1ull << (idx%64);
+}
+
+//move the timers of a slot to the end of the list and leave it empty
+static void tw_take(TWheel *tw,uint32_t level,uint32_t idx,DList *to){
+    DList *slot = &tw->slots[level][idx];
+    tw->used[level][idx/64] &= ~(1ull << (idx%64));
+    if(dlist_empty(slot)) return;
+    DList *first = slot->next;
+    DList *last = slot->prev;
+    first->prev = to->prev;
+    to->prev->next = first;
+    last->next = to;
+    to->prev = last;
+    dlist_init(slot);
+}
+
+//the first slot from idx on which may have timers, -1 when there is none
+static int tw_find(const uint64_t *bits,uint32_t idx){
+    for(uint32_t w=idx/64;w<k_tw_slots/64;++w){
+        uint64_t b = bits[w];
+        if(w == idx/64) b &= ~0ull << (idx%64);
+        if(b) return (int)(w*64 + __builtin_ctzll(b));
+    }
+    return -1;
+}
+
+//the first slot with timers going round from idx, a bit left by tw_del() is cleared on the way
+static int tw_find_round(TWheel *tw,uint32_t level,uint32_t idx){
+    while(true){
+        int i = tw_find(tw->used[level],idx);
+        if(i < 0) i = tw_find(tw->used[level],0);
+        if(i < 0) return -1;
+        if(!dlist_empty(&tw->slots[level][i])) return i;
+        tw->used[level][i/64] &= ~(1ull << (i%64));
+    }
+}
+
+void tw_add(TWheel *tw,TWNode *node,uint64_t expire_ms){
+    if(tw_active(node)) tw_del(tw,node);
+    node->expire_ms = expire_ms;
+    //the tick of the deadline is gone already
+    if(expire_ms < tw->cur_ms) dlist_insert_before(&tw->due,&node->link);
+    else tw_place(tw,node);
+    tw->size++;
+}
+
+void tw_del(TWheel *tw,TWNode *node){
+    assert(tw_active(node));
+    //the bit of the slot stays, it is cleared when the slot is looked at
+    dlist_detach(&node->link);
+    node->link.prev = node->link.next = NULL;
+    tw->size--;
+}
+
+TWNode *tw_due(TWheel *tw){
+    if(dlist_empty(&tw->due)) return NULL;
+    return (TWNode *)((char *)tw->due.next - offsetof(TWNode,link));
+}
+
+//cur_ms is at the start of a slot of this level, its timers and the ones of the slots above which
+// start there go to the moving list
+static void tw_cascade(TWheel *tw,uint32_t level){
+    uint32_t idx = tw_index(tw->cur_ms,level);
+    if(idx == 0 && level+1 < k_tw_levels) tw_cascade(tw,level+1);
+    tw_take(tw,level,idx,&tw->moving);
+}
+
+//put the timers of the moving list in their slots as seen from cur_ms, false when the moves ran out first
+static bool tw_move_down(TWheel *tw,size_t *moves){
+    while(!dlist_empty(&tw->moving)){
+        if(*moves >= k_tw_max_moves) return false;
+        DList *link = tw->moving.next;
+        dlist_detach(link);
+        tw_place(tw,(TWNode *)((char *)link - offsetof(TWNode,link)));
+        (*moves)++;
+    }
+    return true;
+}
+
+//the first tick which has timers or moves timers down. moved is true when the slots cur_ms starts
+// have been moved down already
+static uint64_t tw_next_tick(TWheel *tw,bool moved){
+    uint64_t next_ms = (uint64_t)-1;
+    for(uint32_t l=0;l<k_tw_levels;++l){
+        uint32_t shift = k_tw_bits*l;
+        uint64_t pos = tw->cur_ms >> shift;
+        uint64_t first = (l == 0 || (!moved && (tw->cur_ms & ((1ull << shift)-1)) == 0)) ? 0 : 1;
+        uint32_t from = (uint32_t)((pos + first) & (k_tw_slots-1));
+        int i = tw_find_round(tw,l,from);
+        if(i < 0) continue;
+        uint64_t dist = first + (((uint32_t)i - from) & (k_tw_slots-1));
+        uint64_t at = (pos + dist) << shift;
+        if(at < next_ms) next_ms = at;
+    }
+    return next_ms;
+}
+
+void tw_advance(TWheel *tw,uint64_t now_ms){
+    //a slot which was moved down only in part holds the time where it is
+    size_t moves = 0;
+    if(!tw_move_down(tw,&moves)) return;
+    if(tw->size == 0){
+        if(tw->cur_ms <= now_ms) tw->cur_ms = now_ms+1;
+        return;
+    }
+    while(tw->cur_ms <= now_ms){
+        uint32_t idx = tw_index(tw->cur_ms,0);
+        if(idx == 0 && tw->moved_ms != tw->cur_ms){
+            tw_cascade(tw,1);
+            tw->moved_ms = tw->cur_ms;
+            if(!tw_move_down(tw,&moves)) return;
+        }
+        //jump to the next slot with timers in this turn of the lowest level,
+        // or when there is none to the next tick with anything to do
+        uint64_t base = tw->cur_ms - idx;
+        int next = tw_find(tw->used[0],idx);
+        if(next < 0){
+            uint64_t at = tw_next_tick(tw,true);
+            tw->cur_ms = at <= now_ms ? at : now_ms+1;
+            continue;
+        }
+        if(base + next > now_ms){
+            tw->cur_ms = now_ms+1;
+            break;
+        }
+        //a timer is on the lowest level only when its deadline is less than a turn away,
+        // so the whole slot is due
+        tw->cur_ms = base + next;
+        tw_take(tw,0,next,&tw->due);
+        tw->cur_ms++;
+    }
+}
+
+uint64_t tw_next_ms(TWheel *tw){
+    if(!dlist_empty(&tw->due) || !dlist_empty(&tw->moving)) return 0;
+    if(tw->size == 0) return (uint64_t)-1;
+    return tw_next_tick(tw,tw->moved_ms == tw->cur_ms);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+// a hierarchical timing wheel of millisecond deadlines
+//  4 levels of 256 slots, every level covers 256 times the span of the one below it (256ms, 65s, 4.6h, 49 days).
+//  A timer is put in the slot of its deadline on the lowest level that reaches it, when the time gets to
+//  a slot of a higher level its timers are moved down. A deadline further out than the top level waits
+//  in the farthest slot and is put back until it is in range.
+//  The slots are intrusive lists so adding and removing a timer is O(1), a bitmap per level skips the empty slots.
+//  A due slot joins the due list in one step, a big slot of a higher level is moved down over a few calls
+
+const uint32_t k_tw_bits = 8;
+const uint32_t k_tw_slots = 1u << k_tw_bits;
+const uint32_t k_tw_levels = 4;
+
+struct TWNode{
+    DList link;             //NULL when it is not in the wheel
+    uint64_t expire_ms = 0;
+};
+
+struct TWheel{
+    uint64_t cur_ms = 0;    //the next tick to go through, the ones before it are done
+    size_t size = 0;        //the timers in the slots and in the two lists
+    DList due;              //the timers which are past their deadline, waiting for the caller
+    DList moving;           //the timers of the slots starting at cur_ms which are not moved down yet
+    uint64_t moved_ms = -1; //the tick whose slots went to the moving list
+    uint64_t used[k_tw_levels][k_tw_slots/64] = {};    //a set bit for a slot which may have timers
+    DList slots[k_tw_levels][k_tw_slots];
+};
+
+inline bool tw_active(const TWNode *node){
+    return node->link.next != NULL;
+}
+
+void     tw_init(TWheel *tw,uint64_t now_ms);
+//add the timer or move it to a new deadline
+void     tw_add(TWheel *tw,TWNode *node,uint64_t expire_ms);
+//remove the timer, from a slot or from either list
+void     tw_del(TWheel *tw,TWNode *node);
+//go through the ticks up to now_ms, the timers with expire_ms <= now_ms are moved to the due list
+void     tw_advance(TWheel *tw,uint64_t now_ms);
+//the first due timer, it stays there until tw_del() or tw_add()
+TWNode  *tw_due(TWheel *tw);
+//the earliest time tw_advance() has something to do, 0 when a timer is due or a slot is being moved down
+// and -1 when there are none.
+// It can be before the first deadline, a timer of a higher level is moved down first
+uint64_t tw_next_ms(TWheel *tw);
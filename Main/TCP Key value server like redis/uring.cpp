@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(uint32_t entries,struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int sys_enter(int fd,uint32_t to_submit,uint32_t min_complete,uint32_t flags,void *arg,size_t argsz){
+    return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,arg,argsz);
+}
+
+static int sys_register(int fd,uint32_t op,void *arg,uint32_t nargs){
+    return (int)syscall(__NR_io_uring_register,fd,op,arg,nargs);
+}
+
+int uring_init(URing *ring,uint32_t entries){
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    int fd = sys_setup(entries,&p);
+    if(fd<0) return -1;     //no kernel support or blocked by the sandbox
+    //the server relies on these, older kernels use the readiness based loop instead
+    const uint32_t k_needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if((p.features & k_needed) != k_needed){
+        close(fd);
+        return -1;
+    }
+
+    //with the single mmap feature the sq and cq rings share one mapping
+    size_t sq_sz = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    ring->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    ring->ring_ptr = mmap(NULL,ring->ring_sz,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if(ring->ring_ptr == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    ring->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL,ring->sqes_sz,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+    if(sqes == MAP_FAILED){
+        munmap(ring->ring_ptr,ring->ring_sz);
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *base = (uint8_t *)ring->ring_ptr;
+    ring->fd = fd;
+    ring->sq_head = (uint32_t *)(base + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(base + p.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(base + p.sq_off.ring_mask);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->cq_head = (uint32_t *)(base + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(base + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    ring->sq_pending = 0;
+
+    //the sq index array is an identity mapping, so the sqe slot is just tail & mask
+    uint32_t *array = (uint32_t *)(base + p.sq_off.array);
+    for(uint32_t i=0;i<p.sq_entries;++i) array[i] = i;
+    return 0;
+}
+
+void uring_exit(URing *ring){
+    if(ring->fd<0) return;
+    munmap(ring->sqes,ring->sqes_sz);
+    munmap(ring->ring_ptr,ring->ring_sz);
+    close(ring->fd);
+    *ring = URing{};
+}
+
+//publish the prepared sqes and let the kernel consume them
+static int uring_enter(URing *ring,uint32_t wait_nr,int32_t timeout_ms){
+    uint32_t to_submit = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail,*ring->sq_tail + to_submit,__ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg;
+    memset(&arg,0,sizeof(arg));
+    if(timeout_ms>=0){
+        ts.tv_sec = timeout_ms/1000;
+        ts.tv_nsec = (long long)(timeout_ms%1000)*1000*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    uint32_t flags = IORING_ENTER_EXT_ARG;
+    if(wait_nr) flags |= IORING_ENTER_GETEVENTS;
+    int rv = sys_enter(ring->fd,to_submit,wait_nr,flags,&arg,sizeof(arg));
+    if(rv<0 && (errno == ETIME || errno == EINTR)) return 0;
+    return rv<0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(URing *ring){
+    uint32_t head = __atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+    uint32_t next = *ring->sq_tail + ring->sq_pending;
+    if(next - head > ring->sq_mask){
+        //the queue is full, hand the batch to the kernel first
+        if(uring_enter(ring,0,-1)<0) return NULL;
+        head = __atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+        next = *ring->sq_tail;
+        if(next - head > ring->sq_mask) return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[next & ring->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(URing *ring,int32_t timeout_ms){
+    //do not block if there is already something to process
+    uint32_t wait_nr = uring_peek_cqe(ring) ? 0 : 1;
+    return uring_enter(ring,wait_nr,timeout_ms);
+}
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring){
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE);
+    if(head == tail) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring){
+    __atomic_store_n(ring->cq_head,*ring->cq_head + 1,__ATOMIC_RELEASE);
+}
+
+int ubuf_ring_init(URing *ring,UBufRing *br,uint16_t bgid,uint32_t nbufs,uint32_t buf_size){
+    assert(nbufs>0 && ((nbufs-1)&nbufs)==0 && nbufs <= 32768);
+    br->ring_sz = nbufs*sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL,br->ring_sz,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(mem == MAP_FAILED) return -1;
+    br->br = (struct io_uring_buf_ring *)mem;
+    br->bgid = bgid;
+    br->nbufs = nbufs;
+    br->buf_size = buf_size;
+    br->bufs = (uint8_t *)malloc((size_t)nbufs*buf_size);
+    assert(br->bufs);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if(sys_register(ring->fd,IORING_REGISTER_PBUF_RING,&reg,1)<0){
+        //provided buffer rings need linux 5.19
+        free(br->bufs);
+        munmap(mem,br->ring_sz);
+        *br = UBufRing{};
+        return -1;
+    }
+    //hand every buffer to the kernel
+    br->tail = 0;
+    for(uint32_t i=0;i<nbufs;++i) ubuf_ring_recycle(br,(uint16_t)i);
+    return 0;
+}
+
+void ubuf_ring_free(URing *ring,UBufRing *br){
+    if(!br->br) return;
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.bgid = br->bgid;
+    (void)sys_register(ring->fd,IORING_UNREGISTER_PBUF_RING,&reg,1);
+    free(br->bufs);
+    munmap(br->br,br->ring_sz);
+    *br = UBufRing{};
+}
+
+void ubuf_ring_recycle(UBufRing *br,uint16_t bid){
+    //not br->br->bufs, in C++ the empty struct inside __DECLARE_FLEX_ARRAY moves it to the offset 8
+    struct io_uring_buf *bufs = (struct io_uring_buf *)br->br;
+    struct io_uring_buf *buf = &bufs[br->tail & (br->nbufs-1)];
+    buf->addr = (uint64_t)(uintptr_t)ubuf_ring_buf(br,bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    br->tail++;
+    __atomic_store_n(&br->br->tail,br->tail,__ATOMIC_RELEASE);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+//a minimal io_uring wrapper over the raw syscalls, only the parts the server needs
+struct URing{
+    int fd = -1;
+    //submission queue, shared with the kernel
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t sq_mask = 0;
+    struct io_uring_sqe *sqes = NULL;
+    uint32_t sq_pending = 0;    //prepared sqes which are not submitted yet
+    //completion queue, shared with the kernel
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    //the mapped regions
+    void *ring_ptr = NULL;
+    size_t ring_sz = 0;
+    size_t sqes_sz = 0;
+};
+
+//a provided buffer ring, the kernel picks a free buffer itself when a recv completes
+struct UBufRing{
+    struct io_uring_buf_ring *br = NULL;
+    size_t ring_sz = 0;
+    uint16_t bgid = 0;
+    uint16_t tail = 0;
+    uint32_t nbufs = 0;     //must be the power of 2
+    uint32_t buf_size = 0;
+    uint8_t *bufs = NULL;
+};
+
+int  uring_init(URing *ring,uint32_t entries);
+void uring_exit(URing *ring);
+// a free sqe, the pending ones are submitted first if the queue is full
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+// submit the pending sqes and wait for a completion or the timeout (-1 means no timeout)
+int  uring_submit_and_wait(URing *ring,int32_t timeout_ms);
+// the next completion or NULL, it must be released with uring_cqe_seen()
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+int  ubuf_ring_init(URing *ring,UBufRing *br,uint16_t bgid,uint32_t nbufs,uint32_t buf_size);
+void ubuf_ring_free(URing *ring,UBufRing *br);
+// give a consumed buffer back to the kernel
+void ubuf_ring_recycle(UBufRing *br,uint16_t bid);
+
+inline uint8_t *ubuf_ring_buf(UBufRing *br,uint16_t bid){
+    return br->bufs + (size_t)bid * br->buf_size;
+}
@@ -1,88 +1,320 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <vector>
 
 #include "zset.h"
 #include "common.h"
 #include "avl.h"
 #include "hashtable.h"
+#include "slab.h"
 
+size_t g_zset_max_listpack_entries = 128;
+size_t g_zset_max_listpack_value = 64;
+//a batch of new members at least this large, and not much smaller than the zset, rebuilds the tree
+const size_t k_zset_bulk_min = 64;
 
-static ZNode *znode_new(const char *name,size_t len,double score){
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode)+len);
-    assert(node);
-    avl_init(&node->tree);
-    node->hmap.next = NULL;
-    node->hmap.hcode = str_hash((uint8_t *)name,len);
+static size_t min(size_t lhs,size_t rhs){
+    return lhs<rhs ? lhs : rhs;
+}
+
+//compare the member with the (score,name) tuple, <0 when the member goes first
+static int zcmp(const ZNode *zl,double score,const char *name,size_t len){
+    if(zl->score != score) return zl->score < score ? -1 : 1;
+
+    int rv = memcmp(zl->name,name,min(zl->len,len));
+    if(rv!= 0) return rv;
+
+    return zl->len < len ? -1 : (zl->len > len ? 1 : 0);
+}
+
+// the small form
+
+//the bytes of a member in the buffer, the next one starts 8 byte aligned
+static size_t lp_size(size_t len){
+    return (sizeof(ZNode)+len+7) & ~(size_t)7;
+}
+
+static ZNode *lp_begin(ZSet *zset){
+    return (ZNode *)zset->lp;
+}
+
+static ZNode *lp_end(ZSet *zset){
+    return (ZNode *)(zset->lp+zset->lp_used);
+}
+
+static ZNode *lp_next(ZNode *node){
+    return (ZNode *)((char *)node+lp_size(node->len));
+}
+
+static ZNode *lp_find(ZSet *zset,const char *name,size_t len){
+    for(ZNode *node = lp_begin(zset),*end = lp_end(zset);node<end;node = lp_next(node)){
+        if(node->len == len && 0 == memcmp(node->name,name,len)) return node;
+    }
+    return NULL;
+}
+
+//the first member >= (score,name), the end of the buffer when there is none
+static ZNode *lp_lower(ZSet *zset,double score,const char *name,size_t len){
+    ZNode *node = lp_begin(zset),*end = lp_end(zset);
+    while(node<end && zcmp(node,score,name,len) < 0) node = lp_next(node);
+    return node;
+}
+
+static void lp_insert(ZSet *zset,const char *name,size_t len,double score){
+    size_t size = lp_size(len);
+    if(zset->lp_used+size > zset->lp_cap){
+        size_t cap = zset->lp_cap ? zset->lp_cap : 128;
+        while(cap < zset->lp_used+size) cap *= 2;
+        zset->lp = (char *)realloc(zset->lp,cap);
+        assert(zset->lp);
+        zset->lp_cap = cap;
+    }
+    char *at = (char *)lp_lower(zset,score,name,len);
+    memmove(at+size,at,zset->lp+zset->lp_used-at);
+    ZNode *node = (ZNode *)at;
     node->score = score;
     node->len = len;
     memcpy(&node->name[0],name,len);
+    zset->lp_used += size;
+    zset->lp_n++;
+}
+
+static void lp_remove(ZSet *zset,ZNode *node){
+    char *at = (char *)node;
+    size_t size = lp_size(node->len);
+    memmove(at,at+size,zset->lp+zset->lp_used-(at+size));
+    zset->lp_used -= size;
+    zset->lp_n--;
+}
+
+static int64_t lp_rank(ZSet *zset,ZNode *node){
+    int64_t rank = 0;
+    for(ZNode *cur = lp_begin(zset);cur<node;cur = lp_next(cur)) rank++;
+    return rank;
+}
+
+static ZNode *lp_select(ZSet *zset,int64_t rank){
+    if(rank < 0 || rank >= (int64_t)zset->lp_n) return NULL;
+    ZNode *node = lp_begin(zset);
+    while(rank-- > 0) node = lp_next(node);
     return node;
 }
 
-static void znode_del(ZNode *node){
-    free(node);
+static ZNode *lp_offset(ZSet *zset,ZNode *node,int64_t offset){
+    if(offset < 0){
+        //walk from the start, the buffer is not linked backwards
+        int64_t rank = lp_rank(zset,node)+offset;
+        if(rank < 0) return NULL;
+        node = lp_begin(zset);
+        offset = rank;
+    }
+    ZNode *end = lp_end(zset);
+    for(;offset>0 && node<end;--offset) node = lp_next(node);
+    return node<end ? node : NULL;
 }
 
-static size_t min(size_t lhs,size_t rhs){
-    return lhs<rhs ? lhs : rhs;
+// the tree form
+
+//the long names do not fit into a slab block
+static bool zitem_in_slab(size_t len){
+    return sizeof(ZItem)+len <= k_slab_max;
 }
 
-//compare the kv paris by the (score,name) tuple
-static bool zless(AVLNode *lhs,double score,const char *name,size_t len){
-    ZNode *zl = container_of(lhs,ZNode,tree);
-    if(zl->score != score) return zl->score <score;
+static ZItem *zitem_new(const char *name,size_t len,double score){
+    ZItem *item = (ZItem *)(zitem_in_slab(len) ? slab_alloc(sizeof(ZItem)+len) : malloc(sizeof(ZItem)+len));
+    assert(item);
+#ifndef USE_BTREE
+    avl_init(&item->tree);
+#endif
+    item->hmap = HNode{};
+    item->hmap.hcode = str_hash((uint8_t *)name,len);
+    item->node.score = score;
+    item->node.len = len;
+    memcpy(&item->node.name[0],name,len);
+    return item;
+}
 
-    int rv = memcmp(zl->name,name,min(zl->len,len));
-    if(rv!= 0) return rv<0;
+static void zitem_del(ZItem *item){
+    if(zitem_in_slab(item->node.len)) slab_free(item);
+    else free(item);
+}
+
+static ZItem *zitem_of(ZNode *node){
+    return container_of(node,ZItem,node);
+}
+
+#ifdef USE_BTREE
+
+static void tree_insert(ZSet *zset,ZItem *item){
+    bt_insert(&zset->tree,&item->node);
+}
+
+static void tree_remove(ZSet *zset,ZItem *item){
+    bt_delete(&zset->tree,&item->node);
+}
 
-    return zl->len < len;
+//update the score of the existing node, it is taken out under its old score
+static void tree_update(ZSet *zset,ZItem *item,double score){
+    if(item->node.score == score) return;
+    bt_delete(&zset->tree,&item->node);
+    item->node.score = score;
+    bt_insert(&zset->tree,&item->node);
+}
+
+static ZNode *tree_seekge(ZSet *zset,double score,const char *name,size_t len){
+    return bt_seekge(&zset->tree,score,name,len);
+}
+
+static ZNode *tree_offset(ZSet *zset,ZNode *node,int64_t offset){
+    return bt_offset(&zset->tree,node,offset);
+}
+
+static int64_t tree_rank(ZSet *zset,ZNode *node){
+    return bt_rank(&zset->tree,node);
+}
+
+static ZNode *tree_select(ZSet *zset,int64_t rank){
+    return bt_select(&zset->tree,rank);
+}
+
+static void tree_iter(ZIter *it){
+    bt_iter(&it->zset->tree,it->node,&it->bt);
+}
+
+static void tree_iter_step(ZIter *it,bool fwd){
+    it->node = fwd ? bt_iter_next(&it->bt) : bt_iter_prev(&it->bt);
+}
+
+//the tree is empty, the members are in order
+static void tree_build(ZSet *zset,std::vector<ZNode *> &nodes){
+    bt_build(&zset->tree,nodes.data(),nodes.size());
+}
+
+//empty the tree but keep the members
+static void tree_drop(ZSet *zset){
+    bt_clear(&zset->tree,NULL);
+}
+
+static void tree_member_del(ZNode *node){
+    zitem_del(zitem_of(node));
+}
+
+static void tree_clear(ZSet *zset){
+    bt_clear(&zset->tree,&tree_member_del);
+}
+
+#else   //USE_BTREE
+
+static ZNode *tree_node(AVLNode *node){
+    return &container_of(node,ZItem,tree)->node;
+}
+
+//compare the kv paris by the (score,name) tuple
+static bool zless(AVLNode *lhs,double score,const char *name,size_t len){
+    return zcmp(tree_node(lhs),score,name,len) < 0;
 }
 
 static bool zless(AVLNode *lhs,AVLNode *rhs){
-    ZNode *zr = container_of(rhs,ZNode,tree);
+    ZNode *zr = tree_node(rhs);
     return zless(lhs,zr->score,zr->name,zr->len);
 }
 
 //insert into the AVL Treee
-static void tree_insert(ZSet *zset,ZNode *znode){
+static void tree_insert(ZSet *zset,ZItem *item){
     AVLNode *parent = NULL; //the supplied node will be the child of this node
     AVLNode **from = &zset->root;
     while(*from){
         parent = *from;
-        from = zless(&znode->tree,parent) ? &parent->left : &parent->right;
+        from = zless(&item->tree,parent) ? &parent->left : &parent->right;
     }
-    *from = &znode->tree;
-    znode->tree.parent = parent;
-    zset->root = avl_fix(&znode->tree);
+    *from = &item->tree;
+    item->tree.parent = parent;
+    zset->root = avl_fix(&item->tree);
 }
 
-//update the score of the existing node 
-static void zset_update(ZSet *zset,ZNode *znode,double score){
-    if(znode->score == score) return;
-    //if not then detach the tre node and then upate the value and reinsert it 
-    zset->root = avl_del(&znode->tree);
-    avl_init(&znode->tree);
-    
-    znode->score  = score;
-    tree_insert(zset,znode);
+static void tree_remove(ZSet *zset,ZItem *item){
+    zset->root = avl_del(&item->tree);
 }
 
-//add a new score name tuple if it  is not possible then update the tuple if it is already existing
-bool zset_insert(ZSet *zset,const char *name,size_t len,double score){
-    ZNode *znode = zset_lookup(zset,name,len);
-    if(znode){
-        zset_update(zset,znode,score);
-        return false;
-    }else{
-        znode = znode_new(name,len,score);
-        hm_insert(&zset->hmap,&znode->hmap);
-        tree_insert(zset,znode);
-        return true;
+//update the score of the existing node
+static void tree_update(ZSet *zset,ZItem *item,double score){
+    if(item->node.score == score) return;
+    //if not then detach the tre node and then upate the value and reinsert it
+    zset->root = avl_del(&item->tree);
+    avl_init(&item->tree);
+
+    item->node.score  = score;
+    tree_insert(zset,item);
+}
+
+//find teh first score,name tuple that is > = key
+static ZNode *tree_seekge(ZSet *zset,double score,const char *name,size_t len){
+    AVLNode *found = NULL;
+    for(AVLNode *node = zset->root;node;){
+        if(zless(node,score,name,len)) node = node->right;
+        else{
+            found = node;
+            node = node->left;
+        }
     }
+    return found ? tree_node(found) : NULL;
+}
+
+//offset into the suceedign or preceeding nod e
+static ZNode *tree_offset(ZSet *,ZNode *node,int64_t offset){
+    AVLNode *tnode = avl_offset(&zitem_of(node)->tree,offset);
+    return tnode ? tree_node(tnode) : NULL;
 }
 
-// a helper structure for the hash table look up 
+static int64_t tree_rank(ZSet *,ZNode *node){
+    return avl_rank(&zitem_of(node)->tree);
+}
+
+//the root is at the rank of its left subtree, go from there
+static ZNode *tree_select(ZSet *zset,int64_t rank){
+    if(!zset->root || rank < 0 || rank >= (int64_t)avl_cnt(zset->root)) return NULL;
+    AVLNode *node = avl_offset(zset->root,rank-(int64_t)avl_cnt(zset->root->left));
+    return node ? tree_node(node) : NULL;
+}
+
+static void tree_iter(ZIter *){
+}
+
+//the node itself is the position. A step up or down the parent pointers without the counts
+// measured slower than avl_offset(), which is amortised O(1) for +1 and -1 as well
+static void tree_iter_step(ZIter *it,bool fwd){
+    it->node = tree_offset(it->zset,it->node,fwd ? +1 : -1);
+}
+
+//the tree is empty, the members are in order
+static void tree_build(ZSet *zset,std::vector<ZNode *> &nodes){
+    std::vector<AVLNode *> tnodes(nodes.size());
+    for(size_t i=0;i<nodes.size();++i) tnodes[i] = &zitem_of(nodes[i])->tree;
+    zset->root = avl_build(tnodes.data(),tnodes.size());
+}
+
+//empty the tree but keep the members, avl_build() sets every field again
+static void tree_drop(ZSet *zset){
+    zset->root = NULL;
+}
+
+static void tree_dispose(AVLNode *node){
+    if(!node) return;
+    tree_dispose(node->left);
+    tree_dispose(node->right);
+    zitem_del(container_of(node,ZItem,tree));
+}
+
+static void tree_clear(ZSet *zset){
+    tree_dispose(zset->root);
+    zset->root = NULL;
+}
+
+#endif  //USE_BTREE
+
+// a helper structure for the hash table look up
 struct HKey{
     HNode node;
     const char *name =  NULL;
@@ -90,68 +322,226 @@ struct HKey{
 };
 
 static bool hcmp(HNode *node,HNode *key){
-    ZNode *znode = container_of(node,ZNode,hmap); //this container of returns the pointer to the entire structure but not the member of the structure 
+    ZNode *znode = &container_of(node,ZItem,hmap)->node; //this container of returns the pointer to the entire structure but not the member of the structure
     HKey *hkey = container_of(key,HKey,node);
     if(znode->len != hkey->len) return false;
 
     return 0 == memcmp(znode->name,hkey->name,znode->len);
 }
 
-//now the function to look up by name 
-ZNode *zset_lookup(ZSet *zset,const char *name,size_t len){
-    if(!zset->root) return NULL;
+static ZItem *tree_lookup(ZSet *zset,const char *name,size_t len){
     HKey key;
     key.node.hcode = str_hash((uint8_t *)name,len);
     key.name  = name;
     key.len = len;
     HNode *found = hm_lookup(&zset->hmap,&key.node,&hcmp);
-    return found? container_of(found,ZNode,hmap) : NULL;
+    return found? container_of(found,ZItem,hmap) : NULL;
+}
+
+//move the members of the small form into the hash table and the tree
+static void zset_convert(ZSet *zset){
+    char *lp = zset->lp;
+    ZNode *end = lp_end(zset);
+    for(ZNode *node = lp_begin(zset);node<end;node = lp_next(node)){
+        ZItem *item = zitem_new(node->name,node->len,node->score);
+        hm_insert(&zset->hmap,&item->hmap);
+        tree_insert(zset,item);
+    }
+    free(lp);
+    zset->lp = NULL;
+    zset->lp_n = 0;
+    zset->lp_used = zset->lp_cap = 0;
+    zset->enc = ZSET_TREE;
+}
+
+static bool zless(const ZNode *lhs,const ZNode *rhs){
+    return zcmp(lhs,rhs->score,rhs->name,rhs->len) < 0;
 }
 
-//to deete a node 
+//the bulk path of zset_add_new(), the members of the zset and the batch are merged and the tree is built from them
+static void zset_rebuild(ZSet *zset,ZAdd *items,size_t n){
+    std::vector<ZNode *> old;
+    old.reserve(zset_size(zset)+n);
+    //a set which leaves the listpack form, or a new one loaded at startup, gets its table at the final size
+    hm_reserve(&zset->hmap,zset_size(zset)+n);
+    if(zset->enc == ZSET_LISTPACK){
+        ZNode *end = lp_end(zset);
+        for(ZNode *node = lp_begin(zset);node<end;node = lp_next(node)){
+            ZItem *item = zitem_new(node->name,node->len,node->score);
+            hm_insert(&zset->hmap,&item->hmap);
+            old.push_back(&item->node);
+        }
+        free(zset->lp);
+        zset->lp = NULL;
+        zset->lp_n = 0;
+        zset->lp_used = zset->lp_cap = 0;
+        zset->enc = ZSET_TREE;
+    }else{
+        ZIter it;
+        for(zset_iter(zset,zset_select(zset,0),&it);it.node;zset_iter_next(&it)) old.push_back(it.node);
+        tree_drop(zset);
+    }
+
+    std::vector<ZNode *> fresh(n);
+    for(size_t i=0;i<n;++i){
+        ZItem *item = zitem_new(items[i].name,items[i].len,items[i].score);
+        hm_insert(&zset->hmap,&item->hmap);
+        fresh[i] = &item->node;
+    }
+    std::sort(fresh.begin(),fresh.end(),[](ZNode *lhs,ZNode *rhs){ return zless(lhs,rhs); });
+
+    size_t nold = old.size();
+    old.insert(old.end(),fresh.begin(),fresh.end());
+    std::inplace_merge(old.begin(),old.begin()+nold,old.end(),[](ZNode *lhs,ZNode *rhs){ return zless(lhs,rhs); });
+    tree_build(zset,old);
+}
+
+void zset_add_new(ZSet *zset,ZAdd *items,size_t n){
+    if(zset->enc == ZSET_LISTPACK){
+        bool fits = zset->lp_n+n <= g_zset_max_listpack_entries;
+        for(size_t i=0;fits && i<n;++i) fits = items[i].len <= g_zset_max_listpack_value;
+        if(fits){
+            for(size_t i=0;i<n;++i) lp_insert(zset,items[i].name,items[i].len,items[i].score);
+            return;
+        }
+    }
+    //rebuilding costs O(size+n), the inserts O(n log size)
+    if(n >= k_zset_bulk_min && n*8 >= zset_size(zset)) return zset_rebuild(zset,items,n);
+
+    if(zset->enc == ZSET_LISTPACK) zset_convert(zset);
+    for(size_t i=0;i<n;++i){
+        ZItem *item = zitem_new(items[i].name,items[i].len,items[i].score);
+        hm_insert(&zset->hmap,&item->hmap);
+        tree_insert(zset,item);
+    }
+}
+
+//add a new score name tuple if it  is not possible then update the tuple if it is already existing
+bool zset_insert(ZSet *zset,const char *name,size_t len,double score){
+    if(zset->enc == ZSET_LISTPACK){
+        ZNode *node = lp_find(zset,name,len);
+        if(node){
+            if(node->score != score){
+                lp_remove(zset,node);
+                lp_insert(zset,name,len,score);
+            }
+            return false;
+        }
+        if(zset->lp_n < g_zset_max_listpack_entries && len <= g_zset_max_listpack_value){
+            lp_insert(zset,name,len,score);
+            return true;
+        }
+        zset_convert(zset);
+    }
+    ZItem *item = tree_lookup(zset,name,len);
+    if(item){
+        tree_update(zset,item,score);
+        return false;
+    }else{
+        item = zitem_new(name,len,score);
+        hm_insert(&zset->hmap,&item->hmap);
+        tree_insert(zset,item);
+        return true;
+    }
+}
+
+//now the function to look up by name
+ZNode *zset_lookup(ZSet *zset,const char *name,size_t len){
+    if(zset->enc == ZSET_LISTPACK) return lp_find(zset,name,len);
+    ZItem *item = tree_lookup(zset,name,len);
+    return item ? &item->node : NULL;
+}
+
+//to deete a node
 void zset_delete(ZSet *zset,ZNode *znode){
+    if(zset->enc == ZSET_LISTPACK) return lp_remove(zset,znode);
     //first remove the key from the hash table
+    ZItem *item = zitem_of(znode);
     HKey key;
-    key.node.hcode = znode->hmap.hcode;
+    key.node.hcode = item->hmap.hcode;
     key.name = znode->name;
     key.len = znode->len;
     HNode *found = hm_delete(&zset->hmap,&key.node,&hcmp);
     assert(found);
     //remove itfrom teh tree
-    zset->root = avl_del(&znode->tree);
+    tree_remove(zset,item);
     //now deallocating the space for teh ndoe
-    znode_del(znode);
+    zitem_del(item);
 }
 
-//find teh first score,name tuple that is > = key
 ZNode *zset_seekge(ZSet *zset,double score,const char *name,size_t len){
-    AVLNode *found = NULL;
-    for(AVLNode *node = zset->root;node;){
-        if(zless(node,score,name,len)) node = node->right;
-        else{
-            found = node;
-            node = node->left;
-        }
+    if(zset->enc == ZSET_LISTPACK){
+        ZNode *node = lp_lower(zset,score,name,len);
+        return node<lp_end(zset) ? node : NULL;
     }
-    return found ? container_of(found,ZNode,tree) : NULL;
+    return tree_seekge(zset,score,name,len);
 }
 
-//offset into the suceedign or preceeding nod e
-ZNode *znode_offset(ZNode *node,int64_t offset){
-    AVLNode *tnode = node ? avl_offset(&node->tree,offset) : NULL;
-    return tnode ? container_of(tnode,ZNode,tree) : NULL;
+ZNode *znode_offset(ZSet *zset,ZNode *node,int64_t offset){
+    if(!node) return NULL;
+    return zset->enc == ZSET_LISTPACK ? lp_offset(zset,node,offset) : tree_offset(zset,node,offset);
 }
-static void tree_dispose(AVLNode *node){
-    if(!node) return;
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node,ZNode,tree));
+
+int64_t zset_rank(ZSet *zset,ZNode *node){
+    return zset->enc == ZSET_LISTPACK ? lp_rank(zset,node) : tree_rank(zset,node);
 }
 
-//now destroy the entire zset
-void zset_clear(ZSet *zset){
-    hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
-    zset->root = NULL;
+ZNode *zset_select(ZSet *zset,int64_t rank){
+    return zset->enc == ZSET_LISTPACK ? lp_select(zset,rank) : tree_select(zset,rank);
+}
+
+void zset_iter(ZSet *zset,ZNode *node,ZIter *it){
+    it->zset = zset;
+    it->node = node;
+    if(node && zset->enc == ZSET_TREE) tree_iter(it);
+}
+
+void zset_iter_next(ZIter *it){
+    if(!it->node) return;
+    if(it->zset->enc == ZSET_TREE) return tree_iter_step(it,true);
+    ZNode *next = lp_next(it->node);
+    it->node = next<lp_end(it->zset) ? next : NULL;
 }
 
+void zset_iter_prev(ZIter *it){
+    if(!it->node) return;
+    if(it->zset->enc == ZSET_TREE) return tree_iter_step(it,false);
+    it->node = lp_offset(it->zset,it->node,-1);
+}
+
+size_t zset_size(ZSet *zset){
+    return zset->enc == ZSET_LISTPACK ? zset->lp_n : hm_size(&zset->hmap);
+}
+
+struct ZScanCtx{
+    void (*f)(ZNode *,void *);
+    void *arg;
+};
+
+static void cb_zscan(HNode *node,void *arg){
+    ZScanCtx *ctx = (ZScanCtx *)arg;
+    ctx->f(&container_of(node,ZItem,hmap)->node,ctx->arg);
+}
+
+uint64_t zset_scan(ZSet *zset,uint64_t cursor,size_t count,void (*f)(ZNode *,void *),void *arg){
+    if(zset->enc == ZSET_LISTPACK){
+        //the small form is done in one call whatever the cursor is
+        for(ZNode *node = lp_begin(zset),*end = lp_end(zset);node<end;node = lp_next(node)) f(node,arg);
+        return 0;
+    }
+    ZScanCtx ctx = {f,arg};
+    return hm_scan(&zset->hmap,cursor,count,&cb_zscan,&ctx);
+}
+
+//now destroy the entire zset, it is empty and small afterwards
+void zset_clear(ZSet *zset){
+    if(zset->enc == ZSET_TREE){
+        hm_clear(&zset->hmap);
+        tree_clear(zset);
+    }
+    free(zset->lp);
+    zset->lp = NULL;
+    zset->lp_n = 0;
+    zset->lp_used = zset->lp_cap = 0;
+    zset->enc = ZSET_LISTPACK;
+}
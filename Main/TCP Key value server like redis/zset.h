@@ -1,25 +1,86 @@
-#pragma once 
+#pragma once
 #include"avl.h"
 #include "hashtable.h"
+#ifdef USE_BTREE
+#include "btree.h"
+#endif
 
-struct ZSet{
-    AVLNode *root = NULL;   //this is used to index by score name 
-    HMap hmap;      //this is the index by name
-};
-
+//a member as the callers see it
 struct ZNode{
-    AVLNode tree;
-    HNode hmap;
     double score =0;
     size_t len  = 0;
     char name[0];       //this is the flexible array so o need to fix the length before hand
 };
 
+//a member of the tree form, the index nodes are in front of the member
+struct ZItem{
+#ifndef USE_BTREE
+    AVLNode tree;
+#endif
+    HNode hmap;
+    ZNode node;
+};
+
+enum {
+    ZSET_LISTPACK = 0,  //the members one after the other in a single buffer
+    ZSET_TREE = 1,      //a hash table and a tree of ZItem
+};
+
+struct ZSet{
+    uint32_t enc = ZSET_LISTPACK;
+    //the small form: ZNodes in (score,name) order, each padded to 8 bytes.
+    // A ZNode pointer into it is good until the next change of the zset
+    uint32_t lp_n = 0;
+    char *lp = NULL;
+    size_t lp_used = 0;
+    size_t lp_cap = 0;
+    //the tree form
+#ifdef USE_BTREE
+    BTree tree;     //the index by score name, the members are kept in wide nodes
+#else
+    AVLNode *root = NULL;   //this is used to index by score name
+#endif
+    HMap hmap;      //this is the index by name
+};
+
+//walks the members in order one step at a time, the zset must not change while it is in use
+struct ZIter{
+    ZSet *zset = NULL;
+    ZNode *node = NULL;     //the current member, NULL once it went past either end
+#ifdef USE_BTREE
+    BTIter bt;
+#endif
+};
+
+//a member for zset_add_new()
+struct ZAdd{
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+//a zset stays in the small form up to this many members and names up to this long,
+// past either it turns into the tree form for good
+extern size_t g_zset_max_listpack_entries;
+extern size_t g_zset_max_listpack_value;
 
 bool   zset_insert(ZSet *zset, const char *name, size_t len, double score);
+// add members which are not in the zset and differ from each other. A large batch is sorted
+// and merged with the members that are there, then the tree is built again in one pass
+void   zset_add_new(ZSet *zset, ZAdd *items, size_t n);
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
 void   zset_delete(ZSet *zset, ZNode *node);
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 void   zset_clear(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
-
+ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset);
+// the position of the member in (score,name) order from 0
+int64_t zset_rank(ZSet *zset, ZNode *node);
+// the member at a position, NULL when it is out of range
+ZNode *zset_select(ZSet *zset, int64_t rank);
+size_t zset_size(ZSet *zset);
+// the hm_scan() of the members, the small form gives all of them in the first call and returns 0
+uint64_t zset_scan(ZSet *zset, uint64_t cursor, size_t count, void (*f)(ZNode *, void *), void *arg);
+// start at the member, NULL gives an iterator which is already at the end
+void   zset_iter(ZSet *zset, ZNode *node, ZIter *it);
+void   zset_iter_next(ZIter *it);
+void   zset_iter_prev(ZIter *it);